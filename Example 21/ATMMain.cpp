@@ -6,33 +6,464 @@
 // arguments, which are passed in to the main program. It then
 // builds a network object, which would require some parameter to
 // initialize a particular byte-transmission mechanism in the
-// real world. For this simulation, the user will type in strings to
+// real world. That parameter is an optional third command line
+// argument naming the Bank's address ("tcp:host:port" or
+// "unix:path"), optionally followed by the packet format to use
+// ("ascii" or "binary"). Without it, the user will type in strings to
 // simulate information transmitted over a network of some kind.
 // The main method then builds BankProxy around the network and
 // uses it to create an ATM object. It then activates the ATM
 // object, which sits in an infinite loop waiting for bank cards.
+// Alternatively, the -fleet option runs many ATMs on a few threads,
+// or on one (see Fleet.hpp), and the -replay option drives one ATM
+// from a session file (see Script.hpp) instead of a person, and the
+// -settle option sends a session file's requests straight to the
+// Bank, several at a time (see BankProxy in Atm.hpp). Any of these
+// may be preceded by the -receiptsync option, which has the receipt
+// logs synced to disk every so many milliseconds (see Spooler.hpp),
+// and by the -latency option, which has every ATM time the phases of
+// its sessions and writes their histograms to the named report file
+// every so many seconds, and on SIGUSR1 (see Latency.hpp), and by
+// the -timeouts option, which gives every ATM's customers so many
+// milliseconds to finish each step of a session, and the Bank so
+// many to answer each Transaction (zero waits for ever; see
+// TimerWheel.hpp). With -fleet, the -batch option has the ATMs share
+// one connection to the Bank, over which their requests travel in
+// batches of up to so many, each waiting at most so many
+// microseconds for the rest of its batch (see Concentrator.hpp). The
+// ATM_LOG environment variable, if set, says which diagnostics are
+// printed (see Log.hpp).
 
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
-#include "atm.hpp"
-#include "network.hpp"
-#include "trans.hpp"
+#include "Atm.hpp"
+#include "Concentrator.hpp"
+#include "Fleet.hpp"
+#include "Latency.hpp"
+#include "Log.hpp"
+#include "Network.hpp"
+#include "Script.hpp"
+#include "Spooler.hpp"
+#include "Trans.hpp"
+#include "Transport.hpp"
 
-int main(int argc, char **argv)
+// The compact binary packets are the default; ASCII packets are
+// easier to read when debugging.
+
+static WireFormat formatNamed(const char *formatName)
+{
+    return (formatName != NULL && std::strcmp(formatName, "ascii") == 0) ? WireFormat::Ascii : WireFormat::Binary;
+}
+
+// The connectBank function builds a Network connected to the Bank at
+// the given address (or through the given Concentrator) and
+// negotiates the packet format, and tagged frames if asked, with it.
+// A Network behind a Concentrator always asks for tagged frames: a
+// reply that comes too late is then merely dropped, whereas on an
+// untagged connection it would cost the ATM its connection for good.
+// It returns NULL (after saying why) if either step fails.
+
+static std::unique_ptr<Network> connectBank(const char *address, const char *formatName, Concentrator *concentrator = NULL,
+                                            bool tagging = false)
 {
-    if (argc != 3)
+    std::unique_ptr<Network> network;
+    try
+    {
+        std::unique_ptr<Transport> transport{concentrator != NULL ? concentrator->connect() : connectTransport(address)};
+        network = std::make_unique<Network>(transport);
+    }
+    catch (const std::exception &e)
     {
-        std::cout << "Usage: " << argv[0] << " CardSlots ATMSlots" << std::endl;
+        std::cout << "Cannot reach the Bank: " << e.what() << std::endl;
+        return NULL;
+    }
+
+    if (!network->negotiate(formatNamed(formatName), tagging || concentrator != NULL))
+    {
+        std::cout << "The Bank did not accept the connection" << std::endl;
+        return NULL;
+    }
+
+    return network;
+}
+
+// The -timeouts option applies to every ATM the process builds.
+
+static std::chrono::milliseconds keypadTimeout{0};
+static std::chrono::milliseconds bankTimeout{0};
+
+// The -batch option applies to a Fleet; no records means no batching.
+
+static std::chrono::microseconds batchLinger{0};
+static std::size_t batchRecords{0};
+
+static bool isFormat(const char *name)
+{
+    return std::strcmp(name, "ascii") == 0 || std::strcmp(name, "binary") == 0;
+}
+
+// With -fleet, the process hosts Count ATMs, named ATM1 through
+// ATMCount, served by Workers threads, or all on the Fleet's own
+// thread if Workers is zero (see SessionLoop.hpp). Every ATM has a
+// connection of its own to the Bank, unless they share one through a
+// Concentrator, so a Bank address is required.
+
+static int runFleet(int argc, char **argv)
+{
+    const int count = std::atoi(argv[2]);
+    const int workers = std::atoi(argv[3]);
+    if (count <= 0 || workers < 0)
+    {
+        std::cout << "The ATM count must be positive, and the worker count must not be negative" << std::endl;
         return 1;
     }
 
-    std::unique_ptr<Network> network{std::make_unique<Network>()};
+    const char *formatName = argc == 8 ? argv[7] : NULL;
+
+    // The Concentrator must outlive the Fleet, whose ATMs' Networks
+    // hold its Ports.
+    std::unique_ptr<Concentrator> concentrator;
+    if (batchRecords > 0)
+    {
+        try
+        {
+            std::unique_ptr<Transport> transport{connectTransport(argv[6])};
+            concentrator = std::make_unique<Concentrator>(transport, batchLinger, batchRecords);
+        }
+        catch (const std::exception &e)
+        {
+            std::cout << "Cannot reach the Bank: " << e.what() << std::endl;
+            return 1;
+        }
+
+        if (!concentrator->negotiate(formatNamed(formatName)))
+        {
+            std::cout << "The Bank did not agree to batching" << std::endl;
+            return 1;
+        }
+    }
+
+    Fleet fleet(argv[4], static_cast<unsigned int>(workers));
+
+    for (int i = 1; i <= count; ++i)
+    {
+        std::unique_ptr<Network> network{connectBank(argv[6], formatName, concentrator.get())};
+        if (network == NULL)
+        {
+            return 1;
+        }
+
+        std::unique_ptr<BankProxy> bank{std::make_unique<BankProxy>(network)};
+        std::unique_ptr<ATM> atm{std::make_unique<ATM>(bank, "ATM" + std::to_string(i), 8500, argv[4], argv[5])};
+        atm->setTimeouts(keypadTimeout, bankTimeout);
+        fleet.addATM(atm);
+    }
+
+    fleet.run();
+
+    return 0;
+}
+
+// With -replay, one ATM replays a session file, Times times over,
+// against the Network simulation. The summary goes to the error
+// stream so that the ATM's own output can be thrown away when timing.
+
+static int runReplay(int argc, char **argv)
+{
+    const int times = argc == 4 ? std::atoi(argv[3]) : 1;
+    if (times <= 0)
+    {
+        std::cout << "The replay count must be positive" << std::endl;
+        return 1;
+    }
+
+    InputScript script;
+    if (!script.load(argv[2]))
+    {
+        return 1;
+    }
+
+    std::unique_ptr<Network> network{std::make_unique<Network>(script)};
     std::unique_ptr<BankProxy> myBank{std::make_unique<BankProxy>(network)};
-    std::unique_ptr<ATM> atm{std::make_unique<ATM>(myBank, "ATM1", 8500)};
+    std::unique_ptr<ATM> atm{std::make_unique<ATM>(myBank, "ATM1", 8500, script)};
+    atm->setTimeouts(keypadTimeout, bankTimeout);
+
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < times; ++i)
+    {
+        script.rewind();
+        atm->activate();
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    const double sessions = static_cast<double>(script.cardCount()) * times;
+    std::cerr << "Replayed " << sessions << " sessions in " << elapsed.count() << " s";
+    if (elapsed.count() > 0)
+    {
+        std::cerr << " (" << sessions / elapsed.count() << " sessions/s)";
+    }
+    std::cerr << std::endl;
 
-    cardSlots = argv[1];
-    atmSlots = argv[2];
+    return 0;
+}
+
+// The buildRequest function makes the Transaction that a request of a
+// session file describes (see Script.hpp), or returns NULL if it
+// cannot.
+
+static std::unique_ptr<Transaction> buildRequest(const std::string &text)
+{
+    std::istringstream fields(text);
+    std::string type;
+    std::string account;
+    std::string pin;
+    std::string target;
+    std::string amountText;
+
+    fields >> type >> account >> pin;
+    if (type == "Tran")
+    {
+        fields >> target;
+    }
+    if (type != "Bala")
+    {
+        fields >> amountText;
+    }
+
+    Money amount;
+    if (!fields || (type != "Bala" && !Money::parse(amountText, amount)))
+    {
+        return NULL;
+    }
+
+    if (type == "With")
+    {
+        return std::make_unique<Withdraw>(account, pin, amount);
+    }
+    else if (type == "Depo")
+    {
+        return std::make_unique<Deposit>(account, pin, amount);
+    }
+    else if (type == "Bala")
+    {
+        return std::make_unique<Balance>(account, pin);
+    }
+    else if (type == "Tran")
+    {
+        return std::make_unique<Transfer>(account, pin, target, amount);
+    }
+
+    return NULL;
+}
+
+// With -settle, the requests of a session file are a queue of
+// Transactions to push to the Bank as fast as it takes them, as in a
+// bulk replay or a settlement run. No ATM is involved: they go
+// straight through a BankProxy, which keeps up to Window of them
+// outstanding on one tagged connection. Without a Bank address, the
+// file's replies answer them, in whatever order they are listed.
+// Once all are answered, each is printed with the Bank's verdict, in
+// the order of the file; the summary goes to the error stream.
+
+static int runSettle(int argc, char **argv)
+{
+    const int window = std::atoi(argv[3]);
+    if (window <= 0)
+    {
+        std::cout << "The window must be positive" << std::endl;
+        return 1;
+    }
+
+    InputScript script;
+    if (!script.load(argv[2]))
+    {
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<Transaction>> transactions;
+    for (std::size_t i = 0; i < script.requestCount(); ++i)
+    {
+        transactions.push_back(buildRequest(script.request(i)));
+        if (transactions.back() == NULL)
+        {
+            std::cout << "Bad request: " << script.request(i) << std::endl;
+            return 1;
+        }
+    }
+
+    std::unique_ptr<Network> network;
+    if (argc >= 5)
+    {
+        network = connectBank(argv[4], argc == 6 ? argv[5] : NULL, NULL, true);
+        if (network == NULL)
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        network = std::make_unique<Network>(script);
+        network->negotiate(WireFormat::Ascii, true);
+    }
+
+    BankProxy bankProxy(network, static_cast<unsigned int>(window));
+    std::unordered_map<const Transaction *, bool> verdicts;
+
+    const auto start = std::chrono::steady_clock::now();
+    for (const std::unique_ptr<Transaction> &t : transactions)
+    {
+        if (!bankProxy.submit(*t))
+        {
+            verdicts[t.get()] = false;
+        }
+    }
+
+    Transaction *answered;
+    bool status;
+    while (bankProxy.complete(answered, status))
+    {
+        verdicts[answered] = status;
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::size_t approved = 0;
+    for (std::size_t i = 0; i < transactions.size(); ++i)
+    {
+        const bool verdict = verdicts[transactions[i].get()];
+        approved += verdict ? 1 : 0;
+        std::cout << "Request " << i + 1 << (verdict ? " approved: " : " refused: ") << *transactions[i];
+    }
+
+    std::cerr << "Settled " << transactions.size() << " requests in " << elapsed.count() << " s";
+    if (elapsed.count() > 0)
+    {
+        std::cerr << " (" << static_cast<double>(transactions.size()) / elapsed.count() << " requests/s)";
+    }
+    std::cerr << ", " << approved << " approved" << std::endl;
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *logSpec = std::getenv("ATM_LOG");
+    if (logSpec != NULL && !configureLog(logSpec))
+    {
+        std::cout << "Bad ATM_LOG specification: " << logSpec << std::endl;
+        return 1;
+    }
+
+    // The options are dropped from the arguments, leaving the
+    // program's name in front of the rest.
+    while (true)
+    {
+        if (argc >= 3 && std::strcmp(argv[1], "-receiptsync") == 0)
+        {
+            ReceiptSpooler::shared().setSyncInterval(std::chrono::milliseconds(std::atol(argv[2])));
+            argv[2] = argv[0];
+            argc -= 2;
+            argv += 2;
+        }
+        else if (argc >= 4 && std::strcmp(argv[1], "-latency") == 0)
+        {
+            LatencyReport::shared().enable(argv[2], std::chrono::seconds(std::atol(argv[3])));
+            argv[3] = argv[0];
+            argc -= 3;
+            argv += 3;
+        }
+        else if (argc >= 4 && std::strcmp(argv[1], "-batch") == 0)
+        {
+            batchLinger = std::chrono::microseconds(std::atol(argv[2]));
+            batchRecords = static_cast<std::size_t>(std::max(std::atol(argv[3]), 0L));
+            argv[3] = argv[0];
+            argc -= 3;
+            argv += 3;
+        }
+        else if (argc >= 4 && std::strcmp(argv[1], "-timeouts") == 0)
+        {
+            keypadTimeout = std::chrono::milliseconds(std::atol(argv[2]));
+            bankTimeout = std::chrono::milliseconds(std::atol(argv[3]));
+            argv[3] = argv[0];
+            argc -= 3;
+            argv += 3;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (argc >= 2 && std::strcmp(argv[1], "-replay") == 0)
+    {
+        if (argc < 3 || argc > 4)
+        {
+            std::cout << "Usage: " << argv[0] << " -replay SessionFile [Times]" << std::endl;
+            return 1;
+        }
+
+        return runReplay(argc, argv);
+    }
+
+    if (argc >= 2 && std::strcmp(argv[1], "-settle") == 0)
+    {
+        if (argc < 4 || argc > 6 || (argc == 6 && !isFormat(argv[5])))
+        {
+            std::cout << "Usage: " << argv[0] << " -settle SessionFile Window [tcp:host:port | unix:path [ascii | binary]]" << std::endl;
+            return 1;
+        }
+
+        return runSettle(argc, argv);
+    }
+
+    if (argc >= 2 && std::strcmp(argv[1], "-fleet") == 0)
+    {
+        if (argc < 7 || argc > 8 || (argc == 8 && !isFormat(argv[7])))
+        {
+            std::cout << "Usage: " << argv[0] << " -fleet Count Workers CardSlots ATMSlots tcp:host:port | unix:path [ascii | binary]" << std::endl;
+            return 1;
+        }
+
+        return runFleet(argc, argv);
+    }
+
+    if (argc < 3 || argc > 5 || (argc == 5 && !isFormat(argv[4])))
+    {
+        std::cout << "Usage: " << argv[0] << " CardSlots ATMSlots [tcp:host:port | unix:path [ascii | binary]]" << std::endl;
+        std::cout << "       " << argv[0] << " -replay SessionFile [Times]" << std::endl;
+        std::cout << "       " << argv[0] << " -fleet Count Workers CardSlots ATMSlots tcp:host:port | unix:path [ascii | binary]" << std::endl;
+        std::cout << "       " << argv[0] << " -settle SessionFile Window [tcp:host:port | unix:path [ascii | binary]]" << std::endl;
+        std::cout << "Any of these may start with -receiptsync Milliseconds, -latency ReportFile Seconds" << std::endl;
+        std::cout << "and -timeouts KeypadMilliseconds BankMilliseconds, and -fleet with -batch LingerMicroseconds Records." << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<Network> network;
+    if (argc >= 4)
+    {
+        network = connectBank(argv[3], argc == 5 ? argv[4] : NULL);
+        if (network == NULL)
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        network = std::make_unique<Network>();
+    }
+
+    std::unique_ptr<BankProxy> myBank{std::make_unique<BankProxy>(network)};
+    std::unique_ptr<ATM> atm{std::make_unique<ATM>(myBank, "ATM1", 8500, argv[1], argv[2])};
+    atm->setTimeouts(keypadTimeout, bankTimeout);
 
     atm->activate();
 
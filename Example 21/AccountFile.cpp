@@ -0,0 +1,195 @@
+// AccountFile.cpp: The source file for writing the Bank's binary
+// account files and mapping them back into memory.
+
+#include "AccountFile.hpp"
+#include "Bank.hpp"
+#include "Journal.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(sizeof(Account) == 16, "an account file stores sixteen-byte accounts");
+static_assert(std::is_trivially_copyable<Account>::value, "an account file stores accounts byte for byte");
+
+static const char AccountFileMagic[8] = {'A', 'T', 'M', 'A', 'C', 'C', 'T', '1'};
+
+// No table is smaller than the AccountList makes them or bigger than
+// the 32-bit keys could fill, and no file has more shards than an
+// AccountList would make.
+
+const unsigned int MaxAccountFileShardBits = 16;
+const unsigned int MinAccountFileTableBits = 4;
+const unsigned int MaxAccountFileTableBits = 33;
+
+bool isAccountFile(std::istream &stream)
+{
+    char magic[sizeof(AccountFileMagic)];
+    const bool matches = stream.read(magic, sizeof(magic)) && std::memcmp(magic, AccountFileMagic, sizeof(magic)) == 0;
+
+    stream.clear();
+    stream.seekg(0);
+    return matches;
+}
+
+void saveAccountFile(const std::filesystem::path &file, const AccountImage &image)
+{
+    std::filesystem::path temporary{file};
+    temporary += ".tmp";
+
+    const int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(), temporary.string());
+    }
+
+    try
+    {
+        std::uint64_t count = 0;
+        std::vector<unsigned char> directory(image.tableBits.size() * AccountFileDirectoryEntrySize);
+        for (std::size_t i = 0; i < image.tableBits.size(); ++i)
+        {
+            const std::uint32_t entry[2] = {image.tableBits[i], static_cast<std::uint32_t>(image.used[i])};
+            std::memcpy(directory.data() + i * AccountFileDirectoryEntrySize, entry, sizeof(entry));
+            count += image.used[i];
+        }
+
+        unsigned char header[AccountFileHeaderSize]{};
+        const std::uint32_t shardBits = image.shardBits;
+        std::memcpy(header, AccountFileMagic, 8);
+        std::memcpy(header + 8, &image.sequence, 8);
+        std::memcpy(header + 16, &count, 8);
+        std::memcpy(header + 24, &shardBits, 4);
+
+        writeAll(fd, header, sizeof(header));
+        writeAll(fd, directory.data(), directory.size());
+        writeAll(fd, image.tables.data(), image.tables.size() * sizeof(Account));
+        if (::fdatasync(fd) < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "fdatasync");
+        }
+    }
+    catch (...)
+    {
+        ::close(fd);
+        throw;
+    }
+
+    ::close(fd);
+    renameDurably(temporary, file);
+}
+
+// The file is mapped privately and writably: the Bank changes
+// balances in place, and each page it changes is copied for it alone.
+// The constructor checks that the directory agrees with the header
+// and with the length of the file, so that no table reaches past the
+// end of the mapping, and that every table has an empty slot for a
+// probe to end at. It does not look at the accounts themselves, which
+// would mean reading the whole file.
+
+MappedAccountFile::MappedAccountFile(const std::filesystem::path &file) : base(MAP_FAILED), length(0)
+{
+    const int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(), file.string());
+    }
+
+    struct stat status;
+    if (::fstat(fd, &status) == 0 && static_cast<std::size_t>(status.st_size) >= AccountFileHeaderSize)
+    {
+        length = static_cast<std::size_t>(status.st_size);
+        base = ::mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+
+    if (base == MAP_FAILED)
+    {
+        throw std::runtime_error("not an account file");
+    }
+
+    const unsigned char *bytes = static_cast<const unsigned char *>(base);
+    const unsigned int shardBits = getShardBits();
+    const std::size_t shards = static_cast<std::size_t>(1) << std::min(shardBits, MaxAccountFileShardBits);
+    std::size_t offset = AccountFileHeaderSize + shards * AccountFileDirectoryEntrySize;
+    bool consistent = std::memcmp(bytes, AccountFileMagic, 8) == 0 && shardBits <= MaxAccountFileShardBits &&
+                      offset <= length;
+
+    std::uint64_t count = 0;
+    for (std::size_t i = 0; consistent && i < shards; ++i)
+    {
+        const unsigned int tableBits = getTableBits(i);
+        const std::size_t used = getUsed(i);
+        consistent = tableBits >= MinAccountFileTableBits && tableBits <= MaxAccountFileTableBits && 2 * used <= (static_cast<std::size_t>(1) << tableBits) &&
+                     (length - offset) / sizeof(Account) >= (static_cast<std::size_t>(1) << tableBits);
+        if (consistent)
+        {
+            tables.push_back(reinterpret_cast<Account *>(static_cast<unsigned char *>(base) + offset));
+            offset += sizeof(Account) << tableBits;
+            count += used;
+        }
+    }
+
+    if (!consistent || offset != length || count != size())
+    {
+        ::munmap(base, length);
+        throw std::runtime_error("not a consistent account file");
+    }
+}
+
+MappedAccountFile::~MappedAccountFile()
+{
+    ::munmap(base, length);
+}
+
+std::uint64_t MappedAccountFile::getSequence() const
+{
+    std::uint64_t sequence;
+    std::memcpy(&sequence, static_cast<const char *>(base) + 8, 8);
+    return sequence;
+}
+
+std::size_t MappedAccountFile::size() const
+{
+    std::uint64_t count;
+    std::memcpy(&count, static_cast<const char *>(base) + 16, 8);
+    return static_cast<std::size_t>(count);
+}
+
+unsigned int MappedAccountFile::getShardBits() const
+{
+    std::uint32_t shardBits;
+    std::memcpy(&shardBits, static_cast<const char *>(base) + 24, 4);
+    return shardBits;
+}
+
+unsigned int MappedAccountFile::getTableBits(std::size_t shard) const
+{
+    std::uint32_t tableBits;
+    std::memcpy(&tableBits, static_cast<const char *>(base) + AccountFileHeaderSize + shard * AccountFileDirectoryEntrySize, 4);
+    return tableBits;
+}
+
+std::size_t MappedAccountFile::getUsed(std::size_t shard) const
+{
+    std::uint32_t used;
+    std::memcpy(&used, static_cast<const char *>(base) + AccountFileHeaderSize + shard * AccountFileDirectoryEntrySize + 4, 4);
+    return used;
+}
+
+// The header and each directory entry are a multiple of eight bytes
+// long and the mapping starts on a page boundary, so every table is
+// suitably aligned for Accounts.
+
+Account *MappedAccountFile::getTable(std::size_t shard) const
+{
+    return tables[shard];
+}
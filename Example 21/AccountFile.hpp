@@ -0,0 +1,96 @@
+// AccountFile.hpp: The header file for the Bank's binary account
+// files. Reading a text accounts file means parsing every line and
+// inserting every account, which takes far too long for millions of
+// accounts. A binary account file instead holds the AccountList's
+// hash tables exactly as they are laid out in memory, so the Bank
+// maps the file and looks accounts up in the mapped pages directly.
+// Starting takes the same time however many accounts there are, the
+// kernel reads in only the pages that lookups touch, and every Bank
+// process that maps the same file shares those pages. The file is
+// mapped privately, so a changed balance goes to a copy of its page
+// in the Bank's own memory (and into the Journal), never to the file.
+//
+// The Bank's snapshots (see Bank::takeSnapshot) are account files as
+// well. Each records how far into the Journal its balances go, so a
+// Bank that starts from one replays only the records after it.
+//
+// Every account is the sixteen-byte Account record: its key (the
+// account number and S or C type, see accountKey), its packed PIN,
+// and its balance in cents. Like the Journal, an account file is laid
+// out in the host's byte order, for the machine that wrote it.
+//
+// Header (AccountFileHeaderSize bytes):
+//   0-7    magic, "ATMACCT1"
+//   8-15   sequence number of the last Journal record included (0 if none)
+//   16-23  number of accounts
+//   24-27  number of bits of the shard index (the file holds 2^n shards)
+//   28-31  reserved, zero
+//
+// The header is followed by a directory of eight bytes per shard: the
+// number of bits of the shard's table index (4-7), then the number of
+// accounts in the shard (4-7). The tables follow, in shard order,
+// each with 2^bits Account records; a zero key marks an empty slot.
+//
+// An account file is written to a temporary file, synced, and then
+// renamed over the previous one, so a crash leaves either the old
+// file or the new one, and never a partial file.
+
+#ifndef ACCOUNTFILE_HPP
+#define ACCOUNTFILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <istream>
+#include <vector>
+
+class Account;
+
+const std::size_t AccountFileHeaderSize = 32;
+const std::size_t AccountFileDirectoryEntrySize = 8;
+
+// An AccountImage is a copy of the AccountList's tables, made by
+// AccountList::snapshot, ready to be written as an account file.
+
+struct AccountImage
+{
+    std::uint64_t sequence{0};
+    unsigned int shardBits{0};
+    std::vector<unsigned int> tableBits;
+    std::vector<std::size_t> used;
+    std::vector<Account> tables;
+};
+
+// The isAccountFile function reads the start of a stream to tell a
+// binary account file from a text one. saveAccountFile throws if the
+// file could not be made durable, in which case the previous file is
+// still in place.
+
+bool isAccountFile(std::istream &);
+void saveAccountFile(const std::filesystem::path &, const AccountImage &);
+
+// A MappedAccountFile maps an account file for as long as it lives.
+// Its constructor throws if the file cannot be mapped or is not a
+// consistent account file.
+
+class MappedAccountFile
+{
+    void *base;
+    std::size_t length;
+    std::vector<Account *> tables;
+
+public:
+    explicit MappedAccountFile(const std::filesystem::path &);
+    ~MappedAccountFile();
+    MappedAccountFile(const MappedAccountFile &) = delete;
+    MappedAccountFile &operator=(const MappedAccountFile &) = delete;
+
+    std::uint64_t getSequence() const;
+    std::size_t size() const;
+    unsigned int getShardBits() const;
+    unsigned int getTableBits(std::size_t) const;
+    std::size_t getUsed(std::size_t) const;
+    Account *getTable(std::size_t) const;
+};
+
+#endif
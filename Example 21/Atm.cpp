@@ -2,26 +2,30 @@
 // side of the application. It consists of all methods and global
 // data definitions required by these classses.
 
-#include "network.hpp"
-#include "atm.hpp"
-#include "trans.hpp"
+#include "Network.hpp"
+#include "Atm.hpp"
+#include "Console.hpp"
+#include "Latency.hpp"
+#include "Log.hpp"
+#include "Script.hpp"
+#include "Spooler.hpp"
+#include "Trans.hpp"
+#include "Wire.hpp"
 
 #include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <string>
 #include <streambuf>
+#include <thread>
 
-// Definition of the two card slots in the ATM system, the
-// card reader's slot, where a user inserts his or her card,
-// and the ATM's slot into which eaten cards are taken.
-// These are simulated in this system by directories in the
-// file system. The two paths names are given to the ATM application
-// as its first two command-line parameters.
-
-std::filesystem::path cardSlots;
-std::filesystem::path atmSlots;
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
 
 // The checking of an account name determines that it consists of
 // numeric digits. (Note: The actual account on the Bank side of the
@@ -42,16 +46,202 @@ bool isBadPin(const std::string &pin)
     return badAccount(pin);
 }
 
+// When the CardSlotMonitor has to poll, the first check comes
+// quickly so that a card inserted right after the previous customer
+// is noticed at once. The interval then doubles up to a ceiling so
+// that an idle ATM wakes up only a handful of times a second. With
+// inotify, the timeout merely guards against missed events (e.g., the
+// directory being deleted and recreated underneath the watch).
+
+const std::chrono::milliseconds FirstCardPoll{1};
+const std::chrono::milliseconds MaxCardPoll{64};
+const int CardEventTimeout = 1000;
+
+CardSlotMonitor::~CardSlotMonitor()
+{
+#ifdef __linux__
+    if (notifyFd >= 0)
+    {
+        close(notifyFd);
+    }
+#endif
+}
+
+// The waitFor method returns once the given file exists. The watch
+// is set up before the file is checked for, so a card inserted in
+// between the two is not missed.
+
+void CardSlotMonitor::waitFor(const std::filesystem::path &file)
+{
+    std::filesystem::path directory{file.parent_path()};
+    if (directory.empty())
+    {
+        directory = ".";
+    }
+
+    const std::string cardName{file.filename().string()};
+    std::chrono::milliseconds delay{FirstCardPoll};
+    std::vector<std::string> arrivals;
+
+    while (true)
+    {
+        const bool watched = watch(directory);
+
+        std::error_code ec;
+        if (std::filesystem::exists(file, ec))
+        {
+            return;
+        }
+
+        if (watched)
+        {
+            arrivals.clear();
+            waitForArrivals(directory, arrivals);
+            if (std::find(arrivals.begin(), arrivals.end(), cardName) != arrivals.end())
+            {
+                return;
+            }
+        }
+        else
+        {
+            std::this_thread::sleep_for(delay);
+            delay = std::min(delay * 2, MaxCardPoll);
+        }
+    }
+}
+
+// The watch method asks the kernel to report files that are closed
+// after writing, or moved, into the CardSlots directory. Waiting for
+// the close (rather than the create) means a card that is still being
+// copied in is not read half-written. It returns false if there is no
+// such facility or the directory cannot be watched.
+
+bool CardSlotMonitor::watch(const std::filesystem::path &directory)
+{
+#ifdef __linux__
+    if (watching)
+    {
+        return true;
+    }
+
+    if (notifyFd < 0)
+    {
+        notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (notifyFd < 0)
+        {
+            return false;
+        }
+    }
+
+    watching = inotify_add_watch(notifyFd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) >= 0;
+    return watching;
+#else
+    (void)directory;
+    return false;
+#endif
+}
+
+// The getDescriptor method sets up the watch and returns the
+// descriptor that becomes readable when a card arrives, for a caller
+// that waits for other things too; waitForArrivals then returns the
+// arrivals without waiting. It returns -1 if the directory cannot be
+// watched.
+
+int CardSlotMonitor::getDescriptor(const std::filesystem::path &directory)
+{
+    return watch(directory) ? notifyFd : -1;
+}
+
+// The waitForArrivals method sleeps until the kernel reports activity
+// in the CardSlots directory (or the safety timeout expires) and adds
+// the names of the files that arrived to its argument. A caller
+// watching for many card readers at once (see the Fleet class) uses
+// it directly. It returns false, without waiting, if the directory
+// cannot be watched; the caller must then poll.
+
+bool CardSlotMonitor::waitForArrivals(const std::filesystem::path &directory, std::vector<std::string> &arrivals)
+{
+    if (!watch(directory))
+    {
+        return false;
+    }
+
+#ifdef __linux__
+    pollfd pfd{notifyFd, POLLIN, 0};
+    if (poll(&pfd, 1, CardEventTimeout) <= 0)
+    {
+        return true;
+    }
+
+    alignas(inotify_event) char buffer[4096];
+    ssize_t length;
+
+    while ((length = read(notifyFd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char *p = buffer; p < buffer + length;)
+        {
+            const inotify_event *event = reinterpret_cast<const inotify_event *>(p);
+            if (event->mask & IN_IGNORED)
+            {
+                // The directory went away; set the watch up again.
+                watching = false;
+            }
+            else if (event->len > 0)
+            {
+                arrivals.emplace_back(event->name);
+            }
+            p += sizeof(inotify_event) + event->len;
+        }
+    }
+#endif
+
+    return true;
+}
+
 // Each PhysicalCardReader has a name, which is usees as the name of
 // the BankCard file when it is inserted into CardSlot directory.
 // This naming would not be necessary in a real system, since the
 // hardware would take card of this naming problem. It appears in
-// this application onlyh for simplifying the simulation.
+// this application onlyh for simplifying the simulation. The
+// reader also knows the two directories of the simulation; the
+// path of its own card slot is worked out once, here.
+
+PhysicalCardReader::PhysicalCardReader(const std::string &n, const std::filesystem::path &cardSlots,
+                                       const std::filesystem::path &a) : name(n), cardSlot(cardSlots / n), atmSlots(a)
+{
+}
 
-PhysicalCardReader::PhysicalCardReader(const std::string &n) : name(n)
+PhysicalCardReader::PhysicalCardReader(const std::string &n, InputScript &s) : name(n), script(&s)
 {
 }
 
+bool PhysicalCardReader::cardPresent() const
+{
+    if (script != nullptr)
+    {
+        return script->cardPresent();
+    }
+
+    std::error_code ec;
+    return std::filesystem::exists(cardSlot, ec);
+}
+
+// The waitForCard method blocks until a BankCard file with the card
+// reader's name exists in the CardSlots directory. The actual waiting
+// is the CardSlotMonitor's business. A script never blocks; the
+// method returns false once the script has no more cards.
+
+bool PhysicalCardReader::waitForCard()
+{
+    if (script != nullptr)
+    {
+        return script->cardPresent();
+    }
+
+    cardSlotMonitor.waitFor(cardSlot);
+    return true;
+}
+
 // The readInfo method tries to open a file in the CardSlots
 // directory with the name of the card reader. This name
 // would not be needed in a real system. The encoded data
@@ -64,10 +254,12 @@ PhysicalCardReader::PhysicalCardReader(const std::string &n) : name(n)
 
 std::string PhysicalCardReader::readinfo() const
 {
-    std::filesystem::path file{cardSlots};
-    file.append(name);
+    if (script != nullptr)
+    {
+        return script->card();
+    }
 
-    std::ifstream ifs(file);
+    std::ifstream ifs(cardSlot);
     ifs.exceptions(std::ios::failbit | std::ifstream::badbit);
 
     std::string info;
@@ -82,40 +274,59 @@ std::string PhysicalCardReader::readinfo() const
 
 void PhysicalCardReader::ejectCard() const
 {
-    std::filesystem::path file{cardSlots};
-    file.append(name);
+    if (script != nullptr)
+    {
+        script->removeCard();
+        return;
+    }
 
-    std::filesystem::remove(file);
+    std::filesystem::remove(cardSlot);
 }
 
 // The simulation for eating cards is to move the BankCard file from
 // the CardSlot directory to the ATM slot directory. In a real ATM
-// system, this method would be a call to a hardware driver.
+// system, this method would be a call to a hardware driver. The
+// eaten cards are numbered per card reader.
 
-void PhysicalCardReader::eatCard() const
+void PhysicalCardReader::eatCard()
 {
-    static int count = 0;
-
-    ++count;
+    ++eatenCards;
 
-    std::filesystem::path old_p{cardSlots};
-    old_p.append(name);
+    if (script != nullptr)
+    {
+        script->removeCard();
+        return;
+    }
 
     std::filesystem::path new_p{atmSlots};
-    new_p.append(name + "." + std::to_string(count));
-    std::filesystem::rename(old_p, new_p);
+    new_p.append(name + "." + std::to_string(eatenCards));
+    std::filesystem::rename(cardSlot, new_p);
 }
 
 // The constructor for CardReader calls the constructor of its
 // PhysicalCardReader.
 
-CardReader::CardReader(const std::string &name) : physicalCardReader(name)
+CardReader::CardReader(const std::string &name, const std::filesystem::path &cardSlots,
+                       const std::filesystem::path &atmSlots) : physicalCardReader(name, cardSlots, atmSlots)
+{
+}
+
+CardReader::CardReader(const std::string &name, InputScript &script) : physicalCardReader(name, script)
+{
+}
+
+bool CardReader::cardPresent() const
+{
+    return physicalCardReader.cardPresent();
+}
+
+bool CardReader::waitForCard()
 {
+    return physicalCardReader.waitForCard();
 }
 
-// The read_card method checks to see if there is a card
-// in the slot. If there isn't, it returns 1. If there is and
-// it isn't readable, then the card is rejected and a 1 is
+// The read_card method waits until there is a card in the slot.
+// If the card isn't readable, then the card is rejected and a 1 is
 // returned. If the data on the card is readable, thent the account
 // and PIN are read from the card (account is assumed to be
 // a seven-character numeric string, the PIN a four-digit numeric
@@ -126,6 +337,11 @@ bool CardReader::readCard()
 {
     validCard = false;
 
+    if (!physicalCardReader.waitForCard())
+    {
+        return false;
+    }
+
     std::string buf;
 
     try
@@ -148,6 +364,12 @@ bool CardReader::readCard()
     // We have the information, parse it.
     // If the account number is bad, return 1 and eject.
 
+    if (buf.size() < 12)
+    {
+        physicalCardReader.ejectCard();
+        return false;
+    }
+
     account = buf.substr(0, 7);
 
     if (badAccount(account))
@@ -207,7 +429,7 @@ void CardReader::ejectCard() const
     physicalCardReader.ejectCard();
 }
 
-void CardReader::eatCard() const
+void CardReader::eatCard()
 {
     physicalCardReader.eatCard();
 }
@@ -216,6 +438,15 @@ Keypad::Keypad()
 {
 }
 
+Keypad::Keypad(InputScript &s) : script(&s)
+{
+}
+
+void Keypad::setDeadline(Deadline *d)
+{
+    deadline = d;
+}
+
 void Keypad::enable()
 {
     // TODO:  fflush(stdin);
@@ -228,22 +459,73 @@ void Keypad::disable()
     enabled = false;
 }
 
-// The getkey method reads a single character from the Keypad
-// (in the simulation, the hardware is assumed to be the standard
-// input). We assume the newline character to be the Enter key,
-// implying that all input has been received. The method returns
-// the character read on success, NULL terminator if the keypad
-// is not enabled.
+// A disabled Keypad, like a script, never keeps anyone waiting.
 
-char Keypad::getKey() const
+bool Keypad::lineReady() const
 {
-    // TODO: getchar()
-    return enabled ? static_cast<char>(std::getchar()) : '\0';
+    return !enabled || script != nullptr || ConsoleInput::shared().lineReady();
 }
 
-void DisplayScreen::displayMsg(const std::string &msg)
+int Keypad::getDescriptor() const
 {
-    std::cout << "@ATM Display@ " << msg << std::endl;
+    return script != nullptr ? -1 : ConsoleInput::shared().getDescriptor();
+}
+
+// The readLine method reads a line from the Keypad (in the
+// simulation, the hardware is assumed to be the standard input, or
+// an InputScript). We assume the newline character to be the Enter
+// key, implying that all input has been received.
+
+bool Keypad::readLine(std::string_view &line) const
+{
+    if (!enabled)
+    {
+        line = std::string_view{};
+        return false;
+    }
+
+    if (script != nullptr)
+    {
+        return script->getLine(line);
+    }
+
+    return ConsoleInput::shared().readLine(line, deadline);
+}
+
+bool Keypad::readPin(std::string_view &pin) const
+{
+    return readLine(pin);
+}
+
+// Only the first key of the line counts as the choice; an empty line
+// chooses NoKey. Since a choice is a single key, readChoice returns
+// false only if the input ran out before any key at all.
+
+bool Keypad::readChoice(char &choice) const
+{
+    std::string_view line;
+    const bool more = readLine(line);
+    choice = line.empty() ? NoKey : line.front();
+
+    return more || !line.empty();
+}
+
+// The readAmount method also says whether the line was a valid
+// amount, that is, one that Money can parse and that is not
+// negative.
+
+bool Keypad::readAmount(Money &amount, bool &valid) const
+{
+    std::string_view line;
+    const bool more = readLine(line);
+    valid = Money::parse(line, amount) && !amount.isNegative();
+
+    return more;
+}
+
+void DisplayScreen::displayMsg(std::string_view msg)
+{
+    logEvent(LogComponent::Display, LogLevel::Info, LogEvent::DisplayMessage, msg);
 }
 
 SuperKeypad::SuperKeypad()
@@ -252,13 +534,34 @@ SuperKeypad::SuperKeypad()
     displayScreen = std::make_unique<DisplayScreen>();
 }
 
+SuperKeypad::SuperKeypad(InputScript &script)
+{
+    keypad = std::make_unique<Keypad>(script);
+    displayScreen = std::make_unique<DisplayScreen>();
+}
+
+void SuperKeypad::setDeadline(Deadline *deadline)
+{
+    keypad->setDeadline(deadline);
+}
+
+bool SuperKeypad::lineReady() const
+{
+    return keypad->lineReady();
+}
+
+int SuperKeypad::getDescriptor() const
+{
+    return keypad->getDescriptor();
+}
+
 // This method delegates to contained display screen. Such
 // noncommunicating behavior is an argument for splitting the
 // SuperKeypad class. However, the verify_pin() and
 // get_transaction() methods provide more than enough cohesion
 // of data to justify the SuperKeypad's existence.
 
-void SuperKeypad::displayMsg(const std::string &msg)
+void SuperKeypad::displayMsg(std::string_view msg)
 {
     displayScreen->displayMsg(msg);
 }
@@ -269,106 +572,208 @@ void SuperKeypad::displayMsg(const std::string &msg)
 // on failure.
 
 bool SuperKeypad::verifyPin(const std::string &pinToVerify)
+{
+    askPin();
+    return checkPin(pinToVerify);
+}
+
+void SuperKeypad::askPin()
 {
     keypad->enable();
     displayScreen->displayMsg("Enter Pin Number: ");
-    std::string pin;
-    char c;
-    while ((c = keypad->getKey()) != EnterKey)
-    {
-        pin += c;
-    }
+}
+
+bool SuperKeypad::checkPin(const std::string &pinToVerify)
+{
+    std::string_view pin;
+    keypad->readPin(pin);
     keypad->disable();
     return pin == pinToVerify;
 }
 
-// Note the case analysis on the type of transaction. This case
-// analysis is necessary since our object-oriented design has
-// bumped up against an action-oriented (text-menu driven) user
-// interface as per our discussion in Chapter 9. At least this case
-// analysis is restricted to one point in the design (one method)
-// and hidden in the SuperKeypad class. Any classes higher in the
-// system are oblivious to the case analysis.
+// The getTransaction method carries on the whole dialogue that builds
+// a Transaction, returning NULL if the customer chose to quit (or
+// walked away). The Transaction is built in the session's
+// TransactionList, which keeps it only if the ATM adds it; once the
+// list is full, the session is over.
 
-std::unique_ptr<Transaction> SuperKeypad::getTransaction(const std::string &account, const std::string &pin)
+Transaction *SuperKeypad::getTransaction(const std::string &account, const std::string &pin, TransactionList &list)
 {
-    std::string transactionAccount(account);
-    char transType;
-    double amount;
+    Transaction *transaction = NULL;
+    if (beginTransaction(account, pin, list))
+    {
+        while (!continueTransaction(transaction))
+        {
+        }
+    }
 
-    keypad->enable();
-    do
-    {
-        displayScreen->displayMsg("Select a Transaction");
-        displayScreen->displayMsg("  W)ithdrawal");
-        displayScreen->displayMsg("  D)eposit");
-        displayScreen->displayMsg("  B)alance");
-        displayScreen->displayMsg("  T)ransfer");
-        displayScreen->displayMsg("  Q)uit");
-        transType = keypad->getKey();
-        while (keypad->getKey() != EnterKey) /*nothing*/
-            ;
-    } while (transType != 'W' && transType != 'D' &&
-             transType != 'B' && transType != 'T' && transType != 'Q');
-
-    if (transType == 'Q')
+    return transaction;
+}
+
+// The beginTransaction method puts up the menu of Transactions, and
+// returns false (having said why) if the session cannot have another.
+
+bool SuperKeypad::beginTransaction(const std::string &account, const std::string &pin, TransactionList &list)
+{
+    if (list.full())
     {
-        return NULL;
+        displayScreen->displayMsg("No More Transactions This Session");
+        return false;
     }
 
-    displayScreen->displayMsg("Enter Account Type (S/C): ");
-    transactionAccount += keypad->getKey();
-    while (keypad->getKey() != EnterKey) /*nothing*/
-        ;
+    transactionList = &list;
+    transactionAccount = account;
+    transactionPin = pin;
+    targetAccount.clear();
+    amount = Money();
+
+    keypad->enable();
+    showMenu();
+    return true;
+}
+
+void SuperKeypad::showMenu()
+{
+    dialogue = Dialogue::Choice;
+    displayScreen->displayMsg("Select a Transaction");
+    displayScreen->displayMsg("  W)ithdrawal");
+    displayScreen->displayMsg("  D)eposit");
+    displayScreen->displayMsg("  B)alance");
+    displayScreen->displayMsg("  T)ransfer");
+    displayScreen->displayMsg("  Q)uit");
+}
+
+// The continueTransaction method reads one line of the dialogue and
+// prompts for the next. It returns false while the dialogue goes on;
+// once it is over, it returns true, with the Transaction (or NULL, if
+// the customer quit) in its argument.
+
+bool SuperKeypad::continueTransaction(Transaction *&transaction)
+{
+    transaction = NULL;
+    char accountType;
 
-    if (transType != 'B')
+    switch (dialogue)
     {
-        displayScreen->displayMsg("Enter Amount: ");
-        std::string amount_str;
-        char c;
-        while ((c = keypad->getKey()) != EnterKey)
+    case Dialogue::Choice:
+        // No key at all means the customer has gone, which is as good
+        // as quitting.
+        if (!keypad->readChoice(transType))
         {
-            amount_str += c;
+            transType = 'Q';
+        }
+        if (transType != 'W' && transType != 'D' && transType != 'B' && transType != 'T' && transType != 'Q')
+        {
+            showMenu();
+            return false;
+        }
+        if (transType == 'Q')
+        {
+            return true;
         }
-        amount = std::atof(amount_str.c_str());
-    }
 
-    std::string targetAccount;
+        displayScreen->displayMsg("Enter Account Type (S/C): ");
+        dialogue = Dialogue::AccountType;
+        return false;
 
-    if (transType == 'T')
+    case Dialogue::AccountType:
+        keypad->readChoice(accountType);
+        if (accountType != NoKey)
+        {
+            transactionAccount += accountType;
+        }
+        if (transType == 'B')
+        {
+            break;
+        }
+
+        displayScreen->displayMsg("Enter Amount: ");
+        dialogue = Dialogue::Amount;
+        return false;
+
+    case Dialogue::Amount:
     {
-        displayScreen->displayMsg("Enter Target Account Number: ");
-        char c;
-        while ((c = keypad->getKey()) != EnterKey)
+        // Keep asking until the amount makes sense, or until the
+        // customer walks away.
+        bool valid;
+        const bool more = keypad->readAmount(amount, valid);
+        if (!valid)
+        {
+            if (!more)
+            {
+                return true;
+            }
+            displayScreen->displayMsg("Invalid Amount");
+            displayScreen->displayMsg("Enter Amount: ");
+            return false;
+        }
+        if (transType != 'T')
         {
-            targetAccount += c;
+            break;
         }
 
+        displayScreen->displayMsg("Enter Target Account Number: ");
+        dialogue = Dialogue::TargetAccount;
+        return false;
+    }
+
+    case Dialogue::TargetAccount:
+    {
+        std::string_view targetNumber;
+        keypad->readLine(targetNumber);
+        targetAccount = targetNumber;
+
+        // Like the source account type, the target account type is
+        // one key followed by Enter.
         displayScreen->displayMsg("Enter Target Account Type (S/C): ");
-        targetAccount += keypad->getKey();
+        dialogue = Dialogue::TargetType;
+        return false;
     }
 
+    case Dialogue::TargetType:
+        keypad->readChoice(accountType);
+        if (accountType != NoKey)
+        {
+            targetAccount += accountType;
+        }
+        break;
+    }
+
+    transaction = buildTransaction();
+    return true;
+}
+
+// Note the case analysis on the type of transaction. This case
+// analysis is necessary since our object-oriented design has
+// bumped up against an action-oriented (text-menu driven) user
+// interface as per our discussion in Chapter 9. At least this case
+// analysis is restricted to one point in the design (one method)
+// and hidden in the SuperKeypad class. Any classes higher in the
+// system are oblivious to the case analysis.
+
+Transaction *SuperKeypad::buildTransaction()
+{
     switch (transType)
     {
     case 'W':
-        return std::make_unique<Withdraw>(transactionAccount, pin, amount);
+        return transactionList->create<Withdraw>(transactionAccount, transactionPin, amount);
     case 'D':
-        return std::make_unique<Deposit>(transactionAccount, pin, amount);
+        return transactionList->create<Deposit>(transactionAccount, transactionPin, amount);
     case 'B':
-        return std::make_unique<Balance>(transactionAccount, pin);
+        return transactionList->create<Balance>(transactionAccount, transactionPin);
     case 'T':
-        return std::make_unique<Transfer>(transactionAccount, pin, targetAccount, account);
+        return transactionList->create<Transfer>(transactionAccount, transactionPin, targetAccount, amount);
     default:
         std::cerr << "Unknown type in get_transaction switch statement" << std::endl;
         return NULL;
     }
 }
 
-CashDispenser::CashDispenser(unsigned int initialCash) : cashOnHand{initialCash}
+CashDispenser::CashDispenser(Money initialCash) : cashOnHand{initialCash}
 {
 }
 
-bool CashDispenser::enoughCash(unsigned int amount)
+bool CashDispenser::enoughCash(Money amount) const
 {
     return amount <= cashOnHand;
 }
@@ -381,12 +786,13 @@ bool CashDispenser::enoughCash(unsigned int amount)
 // these items can be added to this class without impact on the rest
 // of the system.
 
-bool CashDispenser::dispense(unsigned int amount)
+bool CashDispenser::dispense(Money amount)
 {
-    amount -= amount % 10;
+    amount -= Money::fromCents(amount.getCents() % Money::fromDollars(10).getCents());
     if (enoughCash(amount))
     {
-        std::cout << "@CashDispenser@ Giving the user " << amount << " cash" << std::endl;
+        cashOnHand -= amount;
+        logEvent(LogComponent::CashDispenser, LogLevel::Info, LogEvent::CashDispensed, {}, amount.getCents());
         return true;
     }
 
@@ -395,37 +801,62 @@ bool CashDispenser::dispense(unsigned int amount)
 
 bool DepositSlot::retrieveEnvelope()
 {
-    std::cout << "@DepositSlot@ Getting an envelope from the user" << std::endl;
+    logEvent(LogComponent::DepositSlot, LogLevel::Info, LogEvent::EnvelopeRetrieved);
     return true;
 }
 
 // The receipt printer simulates the printing of receipts by
-// creationg a Receipts file in the current working directory.
-// Again, the reader can elaborate on this class, adding a number
-// of error checks, paper availability, etc. Like the cash
-// dispenser, this is left as an exercise to th e reader since it
+// appending them to a receipt log named after the ATM in the current
+// working directory. Again, the reader can elaborate on this class,
+// adding a number of error checks, paper availability, etc. Like the
+// cash dispenser, this is left as an exercise to th e reader since it
 // adds no pedagogical benefit to this example.
 
-void ReceiptPrinter::print(const TransactionList &transactionList)
+ReceiptPrinter::ReceiptPrinter(const std::filesystem::path &file) : receiptFile(file)
 {
-    std::cout << "@@ReceiptPrinter@ Your receipt is as follows:" << std::endl;
+}
 
-    std::streambuf *buf;
-    std::ofstream ofs;
+// A ReceiptBuffer is a stream buffer that appends whatever is
+// written through it to a string.
 
-    // Attempt to write to "receipt". If that fails, write to stdout.
-    try
+class ReceiptBuffer : public std::streambuf
+{
+    std::string &text;
+
+public:
+    explicit ReceiptBuffer(std::string &t) : text(t)
     {
-        ofs.exceptions(std::ios::failbit | std::ifstream::badbit);
-        ofs.open("receipt");
-        buf = ofs.rdbuf();
     }
-    catch (const std::ifstream::failure &)
+
+protected:
+    int_type overflow(int_type c) override
     {
-        buf = std::cout.rdbuf();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            text.push_back(traits_type::to_char_type(c));
+        }
+        return traits_type::not_eof(c);
     }
 
-    transactionList.print(buf);
+    std::streamsize xsputn(const char *s, std::streamsize n) override
+    {
+        text.append(s, static_cast<std::size_t>(n));
+        return n;
+    }
+};
+
+// The receipt is rendered into the printer's buffer and handed to the
+// ReceiptSpooler, which writes it out later on a thread of its own,
+// so that the customer never waits for the disk. The spooler hands
+// back a buffer it has finished with, which the next receipt reuses.
+
+void ReceiptPrinter::print(const TransactionList &transactionList)
+{
+    logEvent(LogComponent::ReceiptPrinter, LogLevel::Info, LogEvent::ReceiptPrinted);
+
+    ReceiptBuffer buf(receipt);
+    transactionList.print(&buf);
+    ReceiptSpooler::shared().submit(receiptFile, receipt);
 }
 
 // The BankProxy is an extremely important class. It is the
@@ -444,6 +875,25 @@ BankProxy::BankProxy(std::unique_ptr<Network> &n)
     network = std::move(n);
 }
 
+// The second constructor sets the number of Transactions that may be
+// outstanding at once when pipelining, up to as many as the Bank will
+// read ahead (see Wire.hpp).
+
+BankProxy::BankProxy(std::unique_ptr<Network> &n, unsigned int w)
+    : window(std::clamp<unsigned int>(w, 1, WireMaxOutstanding))
+{
+    network = std::move(n);
+}
+
+// A BankProxy given a Deadline stops waiting for the Bank once it
+// expires; the Transaction is then refused, as if the Bank had been
+// lost.
+
+void BankProxy::setDeadline(Deadline *deadline)
+{
+    network->setDeadline(deadline);
+}
+
 // When a BankProxy needs to process a transaction, it asks its
 // Network object to send it. Assuming the send works correctly,
 // the method then asks the Network for a response, which takes the
@@ -455,40 +905,243 @@ BankProxy::BankProxy(std::unique_ptr<Network> &n)
 // a transaction in the ATM's application space from changes
 // generated from the Bank's application space. Currently, only
 // the Balance derived transaction users this method to update it's
-// balance from the account in the Bank's application space.
+// balance from the account in the Bank's application space. On a
+// tagged Network, answers to earlier submitted Transactions may
+// arrive first; they are set aside for complete.
+
+bool BankProxy::process(Transaction &t)
+{
+    return start(t) && finish(t);
+}
 
-bool BankProxy::process(const Transaction &t)
+// The start method sends the Transaction, and returns false if it
+// could not be sent. Unless it does, finish must be called next, to
+// wait for the Bank's answer.
+
+bool BankProxy::start(Transaction &t)
+{
+    if (!network->isTagged())
+    {
+        return network->send(t);
+    }
+
+    return submit(t);
+}
+
+// The answerReady method tells whether finish would return without
+// waiting, and getDescriptor what to wait on otherwise.
+
+bool BankProxy::answerReady()
 {
-    if (!network->send(t))
+    return !completed.empty() || network->answerReady();
+}
+
+int BankProxy::getDescriptor() const
+{
+    return network->getDescriptor();
+}
+
+bool BankProxy::finish(Transaction &t)
+{
+    if (!network->isTagged())
+    {
+        // TODO: Should return bool?
+        int status;
+
+        const std::string other_info{network->receive(status)};
+        if (!other_info.empty())
+        {
+            t.update(other_info);
+        }
+
+        return status;
+    }
+
+    while (true)
+    {
+        for (auto i = completed.begin(); i != completed.end(); ++i)
+        {
+            if (i->first == &t)
+            {
+                const bool status = i->second;
+                completed.erase(i);
+                return status;
+            }
+        }
+
+        collect();
+    }
+}
+
+// The submit method sends a Transaction tagged with a fresh
+// correlation ID, first waiting for answers if the window is full.
+// The Transaction must stay alive until complete hands it back. The
+// method returns false if the Transaction could not be sent; it is
+// then not outstanding.
+
+bool BankProxy::submit(Transaction &t)
+{
+    if (!network->isTagged())
+    {
+        completed.emplace_back(&t, process(t));
+        return true;
+    }
+
+    while (outstanding.size() >= window)
+    {
+        if (!collect())
+        {
+            break;
+        }
+    }
+
+    const std::uint32_t id = nextId++;
+    if (!network->send(t, id))
     {
         return false;
     }
 
-    // TODO: Should return bool?
+    outstanding.emplace(id, &t);
+    return true;
+}
+
+// The complete method hands back one answered Transaction and the
+// Bank's verdict on it, waiting for an answer if none has arrived
+// yet. It returns false once nothing is outstanding.
+
+bool BankProxy::complete(Transaction *&t, bool &status)
+{
+    while (completed.empty())
+    {
+        if (outstanding.empty())
+        {
+            return false;
+        }
+        collect();
+    }
+
+    t = completed.front().first;
+    status = completed.front().second;
+    completed.pop_front();
+
+    return true;
+}
+
+std::size_t BankProxy::pending() const
+{
+    return outstanding.size() + completed.size();
+}
+
+// The collect method receives one answer, matches it to its
+// Transaction by correlation ID, and lets the Transaction update
+// itself. If the connection to the Bank is lost, every outstanding
+// Transaction is completed as refused and the method returns false.
+
+bool BankProxy::collect()
+{
     int status;
+    std::uint32_t id;
+    std::string info;
+
+    if (!network->receive(status, id, info))
+    {
+        for (const auto &entry : outstanding)
+        {
+            completed.emplace_back(entry.second, false);
+        }
+        outstanding.clear();
+
+        return false;
+    }
+
+    const auto i = outstanding.find(id);
+    if (i == outstanding.end())
+    {
+        logEvent(LogComponent::BankProxy, LogLevel::Warning, LogEvent::UnknownAnswer, {}, id);
+        return true;
+    }
+
+    Transaction *t = i->second;
+    outstanding.erase(i);
 
-    const std::string other_info{network->receive(status)};
-    if (!other_info.empty())
+    if (!info.empty())
     {
-        t.update(other_info);
+        t->update(info);
     }
+    completed.emplace_back(t, status != 0);
 
-    return status;
+    return true;
 }
 
 // A new ATM object is given its Bank Proxy, a name to be handed down
-// to its PhysicalCardReader (only needed for a simulation), and its
-// initial cash.
-
-ATM::ATM(std::unique_ptr<BankProxy> &b, const std::string &name, unsigned int cash)
+// to its PhysicalCardReader (only needed for a simulation), its
+// initial cash (in whole dollars), and the card slot and ATM slot
+// directories of the simulation. The name also tells the receipt
+// files of several ATMs apart, and the ATMs' histograms in the
+// latency report.
+
+ATM::ATM(std::unique_ptr<BankProxy> &b, const std::string &n, unsigned int cash,
+         const std::filesystem::path &cardSlots, const std::filesystem::path &atmSlots) : name(n)
 {
     bankProxy = std::move(b);
-    cardReader = std::make_unique<CardReader>(name);
+    cardReader = std::make_unique<CardReader>(name, cardSlots, atmSlots);
     superKeypad = std::make_unique<SuperKeypad>();
-    cashDispenser = std::make_unique<CashDispenser>(cash);
+    cashDispenser = std::make_unique<CashDispenser>(Money::fromDollars(cash));
+    depositSlot = std::make_unique<DepositSlot>();
+    receiptPrinter = std::make_unique<ReceiptPrinter>("receipt." + name);
+    transactionList = std::make_unique<TransactionList>();
+    latency = LatencyReport::shared().track(name);
+    superKeypad->setDeadline(&deadline);
+    bankProxy->setDeadline(&deadline);
+}
+
+// A scripted ATM takes its cards and keys from an InputScript, which
+// must outlive it, and has no use for the slot directories.
+
+ATM::ATM(std::unique_ptr<BankProxy> &b, const std::string &n, unsigned int cash, InputScript &script) : name(n)
+{
+    bankProxy = std::move(b);
+    cardReader = std::make_unique<CardReader>(name, script);
+    superKeypad = std::make_unique<SuperKeypad>(script);
+    cashDispenser = std::make_unique<CashDispenser>(Money::fromDollars(cash));
     depositSlot = std::make_unique<DepositSlot>();
-    receiptPrinter = std::make_unique<ReceiptPrinter>();
-    transactionList = std::make_unique<TransactionList>(MaxTransactionAtm);
+    receiptPrinter = std::make_unique<ReceiptPrinter>("receipt." + name);
+    transactionList = std::make_unique<TransactionList>();
+    latency = LatencyReport::shared().track(name);
+    superKeypad->setDeadline(&deadline);
+    bankProxy->setDeadline(&deadline);
+}
+
+const std::string &ATM::getName() const
+{
+    return name;
+}
+
+const SessionCounts &ATM::getCounts() const
+{
+    return counts;
+}
+
+// The timeouts apply from the next session on.
+
+void ATM::setTimeouts(std::chrono::milliseconds keypad, std::chrono::milliseconds bank)
+{
+    keypadTimeout = keypad;
+    bankTimeout = bank;
+}
+
+// The cancelSession method may be called from any thread. Whatever
+// the session in progress is waiting for, the wait ends at once, and
+// so does the session. It has no effect between sessions.
+
+void ATM::cancelSession()
+{
+    deadline.cancel();
+}
+
+bool ATM::cardPresent() const
+{
+    return cardReader->cardPresent();
 }
 
 // The activate method for the ATM class is the main driver for the
@@ -521,71 +1174,295 @@ ATM::ATM(std::unique_ptr<BankProxy> &b, const std::string &name, unsigned int ca
 
 void ATM::activate()
 {
-    while (true)
-    {
-        superKeypad->displayMsg("Welcome to the Bank of Heuristics!");
-        superKeypad->displayMsg("Please Insert Your Card In the Card Reader");
+    welcome();
 
-        // Get a card.
-        while (!cardReader->readCard())
+    // Get a card. Waiting blocks until one is inserted; a rejected
+    // card has already been ejected by the time readCard returns. A
+    // card reader driven by an InputScript runs out of cards sooner
+    // or later, and that ends the simulation.
+    while (cardReader->waitForCard())
+    {
+        if (beginSession())
         {
+            advance(true);
+            welcome();
         }
+    }
+}
 
-        const std::string account{cardReader->getAccount()};
-        const std::string pin{cardReader->getPin()};
+void ATM::welcome()
+{
+    superKeypad->displayMsg("Welcome to the Bank of Heuristics!");
+    superKeypad->displayMsg("Please Insert Your Card In the Card Reader");
+}
 
-        // Try three times to verify the PIN.
-        unsigned int count = 0;
-        bool verified;
-        do
-        {
-            verified = superKeypad->verifyPin(pin);
+// The serveWaitingCustomer method is the non-blocking counterpart of
+// activate, for a caller that runs many ATMs on a few threads (see
+// the Fleet class). If a card is in the slot, it serves that one
+// customer and returns true; otherwise it returns false at once.
 
-        } while (!verified && count++ < 3);
+bool ATM::serveWaitingCustomer()
+{
+    if (!cardReader->cardPresent() || !beginSession())
+    {
+        return false;
+    }
 
-        // If it couldn't be verified,then eat the card.
-        if (!verified)
-        {
-            superKeypad->displayMsg("Sorry, three strikes and you're out!");
-            cardReader->eatCard();
-        }
-        else
-        {
-            // Otherwise, keep getting Transactions until the user asks to
-            // quit.
+    advance(true);
+    welcome();
+
+    return true;
+}
 
-            std::unique_ptr<Transaction> transaction;
-            while ((transaction = superKeypad->getTransaction(account, pin)) != NULL)
+// The beginSession method reads the card in the slot and, if it is a
+// good one, starts its owner's session by asking for the PIN. It
+// returns false if the card was rejected (and ejected). The session's
+// timer records each phase of the session, if the ATM's latency is
+// being recorded.
+
+bool ATM::beginSession()
+{
+    timer = PhaseTimer(latency);
+    const bool read = cardReader->readCard();
+    timer.lap(SessionPhase::CardRead);
+    if (!read)
+    {
+        return false;
+    }
+
+    account = cardReader->getAccount();
+    pin = cardReader->getPin();
+    ++counts.sessions;
+    deadline.reset();
+    pinAttempts = 0;
+    askPin();
+
+    return true;
+}
+
+// Each state of the session reads what it was waiting for and moves
+// the session on to the next state; an expired Deadline counts as
+// something to read, since the read then returns at once.
+
+SessionWait ATM::advance(bool blocking)
+{
+    while (true)
+    {
+        switch (state)
+        {
+        case SessionState::EnterPin:
+            if (!blocking && !superKeypad->lineReady() && !deadline.hasExpired())
             {
-                // Preprocess the transaction, if necessary. The default is to do
-                // nothing.
-                if (transaction->preprocess(*this))
-                {
-                    // If preprocessing was successful, then process the Transaction.
-                    // If the Bank says the Transaction is valid, then add it to the
-                    // current list (for the receipt) and carry out any postprocessing.
-
-                    if (bankProxy->process(*transaction))
-                    {
-                        transactionList->addTransaction(*transaction);
-                        transaction->postprocess(*this);
-                    }
-                }
-                else
-                {
-                    // If problems occur, display an appropriate message and continue.
-                    superKeypad->displayMsg("The Bank Refuses Your Transaction");
-                    superKeypad->displayMsg("Contact your Bank Representative.");
-                }
+                return SessionWait::Keypad;
             }
+            pinEntered();
+            break;
+        case SessionState::EnterTransaction:
+            if (!blocking && !superKeypad->lineReady() && !deadline.hasExpired())
+            {
+                return SessionWait::Keypad;
+            }
+            transactionKeyed();
+            break;
+        case SessionState::AwaitBank:
+            if (!blocking && !bankProxy->answerReady() && !deadline.hasExpired())
+            {
+                return SessionWait::Bank;
+            }
+            transactionProcessed(bankProxy->finish(*transaction));
+            break;
+        case SessionState::Idle:
+            return SessionWait::Done;
         }
+    }
+}
 
-        // When we're done, print the receipt, clean up the Transaction
-        // list, and eject the card. We're now ready to loop for another user.
-        receiptPrinter->print(*transactionList);
-        transactionList->cleanup();
+// The getDescriptor method says what the session is waiting on (-1
+// if nothing).
+
+int ATM::getDescriptor() const
+{
+    switch (state)
+    {
+    case SessionState::EnterPin:
+    case SessionState::EnterTransaction:
+        return superKeypad->getDescriptor();
+    case SessionState::AwaitBank:
+        return bankProxy->getDescriptor();
+    default:
+        return -1;
+    }
+}
+
+int ATM::getDeadlineDescriptor() const
+{
+    return deadline.getDescriptor();
+}
+
+// Try three times to verify the PIN.
+
+void ATM::askPin()
+{
+    deadline.arm(keypadTimeout);
+    superKeypad->askPin();
+    state = SessionState::EnterPin;
+}
+
+void ATM::pinEntered()
+{
+    const bool verified = superKeypad->checkPin(pin);
+    deadline.disarm();
+
+    if (verified)
+    {
+        timer.lap(SessionPhase::PinVerify);
+        nextTransaction();
+        return;
+    }
+    if (!deadline.hasExpired() && pinAttempts++ < 3)
+    {
+        askPin();
+        return;
+    }
+    timer.lap(SessionPhase::PinVerify);
+
+    // If it couldn't be verified,then eat the card. (A customer who ran
+    // out of time has merely walked away, and gets the card back.)
+    if (deadline.hasExpired())
+    {
+        superKeypad->displayMsg("Your Session Has Timed Out");
+        ++counts.timedOut;
+    }
+    else
+    {
+        superKeypad->displayMsg("Sorry, three strikes and you're out!");
+        cardReader->eatCard();
+        ++counts.cardsEaten;
+        finishSession(true);
+        return;
+    }
+    finishSession();
+}
+
+// Otherwise, keep getting Transactions until the user asks to quit,
+// giving the customer keypadTimeout to choose each one and fill it
+// in.
+
+void ATM::nextTransaction()
+{
+    deadline.arm(keypadTimeout);
+    if (!superKeypad->beginTransaction(account, pin, *transactionList))
+    {
+        deadline.disarm();
+        finishSession();
+        return;
+    }
+
+    state = SessionState::EnterTransaction;
+}
+
+// A Transaction left half filled in when time ran out is not kept,
+// and ends the session like Quit.
+
+void ATM::transactionKeyed()
+{
+    if (!superKeypad->continueTransaction(transaction))
+    {
+        return;
+    }
+    deadline.disarm();
+
+    if (deadline.hasExpired())
+    {
+        superKeypad->displayMsg("Your Session Has Timed Out");
+        ++counts.timedOut;
+        finishSession();
+        return;
+    }
+    if (transaction == NULL)
+    {
+        finishSession();
+        return;
+    }
+
+    kind = transaction->wireType();
+    timer.lap(SessionPhase::GetTransaction, kind);
+
+    // Preprocess the transaction, if necessary. The default is to do
+    // nothing.
+    const bool preprocessed = transaction->preprocess(*this);
+    timer.lap(SessionPhase::Preprocess, kind);
+    if (!preprocessed)
+    {
+        ++counts.declined;
+        // If problems occur, display an appropriate message and continue.
+        superKeypad->displayMsg("The Bank Refuses Your Transaction");
+        superKeypad->displayMsg("Contact your Bank Representative.");
+        timer.restart();
+        nextTransaction();
+        return;
+    }
+
+    // If preprocessing was successful, then process the Transaction:
+    // send it to the Bank, and wait for the answer.
+    deadline.arm(bankTimeout);
+    if (bankProxy->start(*transaction))
+    {
+        state = SessionState::AwaitBank;
+    }
+    else
+    {
+        transactionProcessed(false);
+    }
+}
+
+// If the Bank says the Transaction is valid, then add it to the
+// current list (for the receipt) and carry out any postprocessing.
+
+void ATM::transactionProcessed(bool processed)
+{
+    deadline.disarm();
+    timer.lap(SessionPhase::BankProcess, kind);
+    if (processed)
+    {
+        transaction->postprocess(*this);
+        timer.lap(SessionPhase::Postprocess, kind);
+        transactionList->addTransaction(transaction);
+        ++counts.approved;
+    }
+    else
+    {
+        ++counts.refused;
+        if (deadline.hasExpired())
+        {
+            superKeypad->displayMsg("The Bank Is Not Answering");
+            ++counts.timedOut;
+            finishSession();
+            return;
+        }
+    }
+
+    timer.restart();
+    nextTransaction();
+}
+
+// When we're done, print the receipt, clean up the Transaction
+// list, and eject the card, unless it was eaten: ejecting it as well
+// would take the next customer's card out of a script. We're now
+// ready for another user.
+
+void ATM::finishSession(bool cardEaten)
+{
+    timer.restart();
+    receiptPrinter->print(*transactionList);
+    timer.lap(SessionPhase::ReceiptPrint);
+    transactionList->cleanup();
+    if (!cardEaten)
+    {
         cardReader->ejectCard();
     }
+    transaction = nullptr;
+    state = SessionState::Idle;
 }
 
 // These are methods used by derived types of Transaction,
@@ -596,12 +1473,12 @@ bool ATM::retrieveEnvelope()
     return depositSlot->retrieveEnvelope();
 }
 
-bool ATM::enoughCash(double amount)
+bool ATM::enoughCash(Money amount)
 {
-    return cashDispenser->enoughCash(static_cast<unsigned int>(amount));
+    return cashDispenser->enoughCash(amount);
 }
 
-bool ATM::dispenseCash(double amount)
+bool ATM::dispenseCash(Money amount)
 {
-    return cashDispenser->dispense(static_cast<unsigned int>(amount));
+    return cashDispenser->dispense(amount);
 }
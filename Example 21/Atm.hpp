@@ -10,22 +10,33 @@
 // but some methods are only appropriate for one address space or
 // the other.
 
+#include <chrono>
+#include <cstdint>
+#include <deque>
 #include <filesystem>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "consts.hpp"
+#include "Latency.hpp"
+#include "Money.hpp"
+#include "TimerWheel.hpp"
 
 // Forward references
 class Transaction;
 class TransactionList;
 class Network;
+class InputScript;
 
-// These two pointers provide the path for the Card
-// Reader's directory, which simulates where a card is
-// inserted, and the ATM's directory, where eaten cards
-// are placed. Normally these would be hardware addresses,
-// but for our simulation they are going to be directories
-// in a file system. A person copies a BankCard file
+// Each card reader is given two paths: the Card Reader's directory,
+// which simulates where a card is inserted, and the ATM's
+// directory, where eaten cards are placed. Normally these would be
+// hardware addresses, but for our simulation they are going to be
+// directories in a file system. A person copies a BankCard file
 // into the CardSlots directory to simulate inserting
 // a card into the ATM and the ATM removes the file to its
 // simulate ejecting the card. The ATM moves the filoe to its
@@ -34,12 +45,40 @@ class Network;
 // numeric characters representing the account number and
 // a four-digit PIN number. The bank card itself is the
 // same name as the physical card reader's "name" data member.
-// These two directory strings are assigned int he main driver
-// function to the first two command line arguments passed
-// in.
+// These two directory strings come from the first two command line
+// arguments passed to the main driver function. Since they belong
+// to the card reader rather than to the process, many ATMs (each
+// with a differently named card reader) can share one process and
+// one pair of directories.
+
+// The CardSlotMonitor plays the role of the card reader's "card
+// present" interrupt line. Without it, the only way to find out that
+// a card was inserted is to keep trying to open the BankCard file,
+// which keeps an idle ATM busy doing nothing but failed opens. On
+// Linux the monitor asks the kernel (inotify) to wake it when a file
+// is written into or moved into the CardSlots directory. Anywhere
+// else, or if the watch cannot be set up, it falls back to checking
+// for the file with a bounded, exponentially growing sleep between
+// checks.
+
+class CardSlotMonitor
+{
+    int notifyFd{-1};
+    bool watching{false};
+
+public:
+    CardSlotMonitor() = default;
+    ~CardSlotMonitor();
+    CardSlotMonitor(const CardSlotMonitor &) = delete;
+    CardSlotMonitor &operator=(const CardSlotMonitor &) = delete;
 
-extern std::filesystem::path cardSlots;
-extern std::filesystem::path atmSlots;
+    void waitFor(const std::filesystem::path &);
+    int getDescriptor(const std::filesystem::path &);
+    bool waitForArrivals(const std::filesystem::path &, std::vector<std::string> &);
+
+private:
+    bool watch(const std::filesystem::path &);
+};
 
 // The relationship between the PhysicalCardReader
 // and the CardReader is that the CardReader is a
@@ -49,17 +88,30 @@ extern std::filesystem::path atmSlots;
 // the domain of ATM and therefore is not reusable. It is
 // responsible for distributing the system intelligence
 // from the ATM to its pieces (in this case, the CardReader).
+//
+// A PhysicalCardReader built with an InputScript takes its cards
+// from the script instead of the CardSlots directory (see
+// Script.hpp). The script is owned by the caller and must outlive
+// the reader.
 
 class PhysicalCardReader
 {
     std::string name;
+    std::filesystem::path cardSlot;
+    std::filesystem::path atmSlots;
+    unsigned int eatenCards{0};
+    CardSlotMonitor cardSlotMonitor;
+    InputScript *script{nullptr};
 
 public:
-    PhysicalCardReader(const std::string &);
+    PhysicalCardReader(const std::string &, const std::filesystem::path &, const std::filesystem::path &);
+    PhysicalCardReader(const std::string &, InputScript &);
 
+    bool cardPresent() const;
+    bool waitForCard();
     std::string readinfo() const;
     void ejectCard() const;
-    void eatCard() const;
+    void eatCard();
 };
 
 // The following clases model the physical pieces of the ATM
@@ -82,54 +134,114 @@ class CardReader
     std::string pin;
 
 public:
-    CardReader(const std::string &);
+    CardReader(const std::string &, const std::filesystem::path &, const std::filesystem::path &);
+    CardReader(const std::string &, InputScript &);
 
+    bool cardPresent() const;
+    bool waitForCard();
     bool readCard();
     std::string getAccount() const;
     std::string getPin() const;
     void ejectCard() const;
-    void eatCard() const;
+    void eatCard();
 };
 
+// The Keypad hands out what the customer types a line (up to the
+// Enter key) at a time, from the console (see Console.hpp) or from an
+// InputScript, and its field-level methods read one line each. They
+// return false if the input ran out before the Enter key, or if the
+// Keypad is not enabled, which the SuperKeypad takes as the customer
+// walking away; whatever was typed before that is still returned. A
+// returned view is valid until the next read. A Keypad reading the
+// console may be given the ATM's Deadline, in which case a read also
+// returns false (with nothing typed) once the Deadline expires.
+// lineReady tells whether a read would return without waiting, and
+// getDescriptor what to wait on otherwise (-1 if there is nothing to
+// wait on, as with a script).
+
 class Keypad
 {
     bool enabled{false};
+    InputScript *script{nullptr};
+    Deadline *deadline{nullptr};
 
 public:
     Keypad();
+    Keypad(InputScript &);
 
+    void setDeadline(Deadline *);
     void enable();
     void disable();
-    char getKey() const;
+    bool lineReady() const;
+    int getDescriptor() const;
+    bool readLine(std::string_view &) const;
+    bool readPin(std::string_view &) const;
+    bool readChoice(char &) const;
+    bool readAmount(Money &, bool &) const;
 };
 
 class DisplayScreen
 {
 public:
-    void displayMsg(const std::string &);
+    void displayMsg(std::string_view);
 };
 
+// The SuperKeypad's dialogues can also be carried on a line at a
+// time, for an ATM that must not wait for the customer (see the ATM's
+// advance method): askPin prompts for the PIN and checkPin reads it,
+// and beginTransaction starts building a Transaction, which each call
+// of continueTransaction takes one line further. verifyPin and
+// getTransaction are the same dialogues carried on in one go.
+
 class SuperKeypad
 {
+    enum class Dialogue : std::uint8_t
+    {
+        Choice,
+        AccountType,
+        Amount,
+        TargetAccount,
+        TargetType
+    };
+
     std::unique_ptr<Keypad> keypad;
     std::unique_ptr<DisplayScreen> displayScreen;
+    Dialogue dialogue{Dialogue::Choice};
+    TransactionList *transactionList{nullptr};
+    std::string transactionAccount;
+    std::string transactionPin;
+    std::string targetAccount;
+    char transType{NoKey};
+    Money amount;
 
 public:
     SuperKeypad();
+    SuperKeypad(InputScript &);
 
-    void displayMsg(const std::string &);
+    void setDeadline(Deadline *);
+    bool lineReady() const;
+    int getDescriptor() const;
+    void displayMsg(std::string_view);
     bool verifyPin(const std::string &);
-    std::unique_ptr<Transaction> getTransaction(const std::string &, const std::string &);
+    void askPin();
+    bool checkPin(const std::string &);
+    Transaction *getTransaction(const std::string &, const std::string &, TransactionList &);
+    bool beginTransaction(const std::string &, const std::string &, TransactionList &);
+    bool continueTransaction(Transaction *&);
+
+private:
+    void showMenu();
+    Transaction *buildTransaction();
 };
 
 class CashDispenser
 {
-    unsigned int cashOnHand;
+    Money cashOnHand;
 
 public:
-    CashDispenser(unsigned int);
-    bool enoughCash(unsigned int);
-    bool dispense(unsigned int);
+    CashDispenser(Money);
+    bool enoughCash(Money) const;
+    bool dispense(Money);
 };
 
 class DepositSlot
@@ -140,26 +252,111 @@ public:
 
 class ReceiptPrinter
 {
+    std::filesystem::path receiptFile;
+    std::string receipt;
+
 public:
+    ReceiptPrinter(const std::filesystem::path &);
+
     void print(const TransactionList &);
 };
 
 // The BankProxy class is the representative of the Bank class in
 // the ATM's address space. It is a wrapper class for the Network,
 // which is itself a wrapper for the exact byte-transfer mechanism
-// (pipes, in this example).
+// (pipes, in this example). Besides the one-at-a-time process
+// method, a BankProxy can pipeline: submit sends a Transaction
+// without waiting for the Bank's answer, keeping up to a window of
+// them outstanding, and complete hands back answered Transactions in
+// whatever order the Bank answered them. Pipelining needs a Network
+// that negotiated tagged frames; over any other Network, submit
+// simply processes the Transaction on the spot. Every Transaction
+// outstanding needs storage of its own, so an ATM's sessions, which
+// build each Transaction over the last in their TransactionList,
+// never pipeline; the ATM's -settle mode does (see ATMMain.cpp). The
+// process method is also available in two halves, start and finish,
+// for an ATM that must not wait for the Bank (see the ATM's advance
+// method).
 
 class BankProxy
 {
     std::unique_ptr<Network> network;
+    unsigned int window{1};
+    std::uint32_t nextId{0};
+    std::unordered_map<std::uint32_t, Transaction *> outstanding;
+    std::deque<std::pair<Transaction *, bool>> completed;
 
 public:
     BankProxy(std::unique_ptr<Network> &);
-    bool process(const Transaction &);
+    BankProxy(std::unique_ptr<Network> &, unsigned int);
+
+    void setDeadline(Deadline *);
+    int getDescriptor() const;
+    bool process(Transaction &);
+    bool start(Transaction &);
+    bool answerReady();
+    bool finish(Transaction &);
+    bool submit(Transaction &);
+    bool complete(Transaction *&, bool &);
+    std::size_t pending() const;
+
+private:
+    bool collect();
+};
+
+// An ATM gives the customer keypadTimeout to finish each step of a
+// session (entering the PIN, or choosing a Transaction and filling it
+// in), and the Bank bankTimeout to answer each Transaction; zero, the
+// default, waits for ever. A step that runs out of time ends the
+// session, and the card is ejected. The session in progress can also
+// be ended from another thread by cancelSession.
+//
+// An ATM counts what became of its sessions and their Transactions:
+// approved by the Bank, refused by it (or never answered), or
+// declined by the ATM itself before they got that far, and how many
+// sessions ran out of time (or were cancelled). Only the thread
+// serving the ATM updates the counts.
+//
+// A session is a state machine, whose states are the points at which
+// it waits: for the customer to enter the PIN, for the customer to
+// type the next line of a Transaction, and for the Bank to answer.
+// The advance method carries the session on from one to the next. If
+// told to block, it waits wherever the session has to, and returns
+// only once the session is over, which is how activate and
+// serveWaitingCustomer serve their customers. Otherwise it returns
+// what the session is waiting for as soon as it would have to wait,
+// and the caller calls it again once the ATM's descriptor (or that of
+// its Deadline) is readable; this is how one thread can carry on the
+// sessions of many ATMs at once (see SessionLoop.hpp).
+
+enum class SessionWait : std::uint8_t
+{
+    Keypad,
+    Bank,
+    Done
+};
+
+struct SessionCounts
+{
+    std::uint64_t sessions{0};
+    std::uint64_t cardsEaten{0};
+    std::uint64_t approved{0};
+    std::uint64_t refused{0};
+    std::uint64_t declined{0};
+    std::uint64_t timedOut{0};
 };
 
 class ATM
 {
+    enum class SessionState : std::uint8_t
+    {
+        Idle,
+        EnterPin,
+        EnterTransaction,
+        AwaitBank
+    };
+
+    std::string name;
     std::unique_ptr<BankProxy> bankProxy;
     std::unique_ptr<CardReader> cardReader;
     std::unique_ptr<SuperKeypad> superKeypad;
@@ -167,14 +364,47 @@ class ATM
     std::unique_ptr<DepositSlot> depositSlot;
     std::unique_ptr<ReceiptPrinter> receiptPrinter;
     std::unique_ptr<TransactionList> transactionList;
+    SessionLatency *latency;
+    SessionCounts counts;
+    Deadline deadline;
+    std::chrono::milliseconds keypadTimeout{0};
+    std::chrono::milliseconds bankTimeout{0};
+    SessionState state{SessionState::Idle};
+    std::string account;
+    std::string pin;
+    unsigned int pinAttempts{0};
+    Transaction *transaction{nullptr};
+    std::uint8_t kind{0};
+    PhaseTimer timer{nullptr};
 
 public:
-    ATM(std::unique_ptr<BankProxy> &, const std::string &, unsigned int);
-
+    ATM(std::unique_ptr<BankProxy> &, const std::string &, unsigned int,
+        const std::filesystem::path &, const std::filesystem::path &);
+    ATM(std::unique_ptr<BankProxy> &, const std::string &, unsigned int, InputScript &);
+
+    const std::string &getName() const;
+    const SessionCounts &getCounts() const;
+    void setTimeouts(std::chrono::milliseconds, std::chrono::milliseconds);
+    void cancelSession();
+    bool cardPresent() const;
     void activate();
+    void welcome();
+    bool serveWaitingCustomer();
+    bool beginSession();
+    SessionWait advance(bool);
+    int getDescriptor() const;
+    int getDeadlineDescriptor() const;
     bool retrieveEnvelope();
-    bool enoughCash(double);
-    bool dispenseCash(double);
+    bool enoughCash(Money);
+    bool dispenseCash(Money);
+
+private:
+    void askPin();
+    void pinEntered();
+    void nextTransaction();
+    void transactionKeyed();
+    void transactionProcessed(bool);
+    void finishSession(bool = false);
 };
 
 #endif
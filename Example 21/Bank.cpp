@@ -0,0 +1,786 @@
+// Bank.cpp: The source file of the main classes composing the Bank
+// side of the application.
+
+#include "Bank.hpp"
+#include "AccountFile.hpp"
+#include "Journal.hpp"
+#include "Log.hpp"
+#include "Network.hpp"
+#include "Trans.hpp"
+#include "Transport.hpp"
+#include "Wire.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+std::uint32_t accountKey(std::string_view name)
+{
+    std::uint32_t number;
+    if (name.size() != 8 || !packDigits(name.substr(0, 7), number))
+    {
+        return 0;
+    }
+
+    switch (name[7])
+    {
+    case 'S':
+        return (number << 1) + 1;
+    case 'C':
+        return (number << 1) + 2;
+    default:
+        return 0;
+    }
+}
+
+Account::Account(std::uint32_t k, std::uint16_t p, Money b) : key(k), pin(p), balance(b)
+{
+}
+
+std::uint32_t Account::getKey() const
+{
+    return key;
+}
+
+bool Account::checkPin(std::string_view candidate) const
+{
+    std::uint32_t packed;
+    return candidate.size() == 4 && packDigits(candidate, packed) && packed == pin;
+}
+
+Money Account::getBalance() const
+{
+    return balance;
+}
+
+// Only replaying the Journal sets a balance outright.
+
+void Account::setBalance(Money amount)
+{
+    balance = amount;
+}
+
+// Neither a deposit nor a withdrawal may be negative (which would
+// turn one into the other), and an account may not be overdrawn. Nor
+// may a deposit take a balance past the largest amount a Money can
+// hold; canDeposit tells beforehand whether deposit would succeed.
+
+const Money MaxBalance = Money::fromCents(std::numeric_limits<std::int64_t>::max());
+
+bool Account::canDeposit(Money amount) const
+{
+    return !amount.isNegative() && (balance.isNegative() || amount <= MaxBalance - balance);
+}
+
+bool Account::deposit(Money amount)
+{
+    if (!canDeposit(amount))
+    {
+        return false;
+    }
+
+    balance += amount;
+    return true;
+}
+
+bool Account::withdraw(Money amount)
+{
+    if (amount.isNegative() || amount > balance)
+    {
+        return false;
+    }
+
+    balance -= amount;
+    return true;
+}
+
+LockedAccount::LockedAccount(std::unique_lock<std::mutex> l, Account *a) : lock(std::move(l)), account(a)
+{
+}
+
+LockedAccount::operator bool() const
+{
+    return account != nullptr;
+}
+
+Account &LockedAccount::operator*() const
+{
+    return *account;
+}
+
+Account *LockedAccount::operator->() const
+{
+    return account;
+}
+
+// Each shard sits on cache lines of its own, so that two threads
+// working in neighbouring shards do not fight over the lines holding
+// each other's locks. A shard's table is either the vector it owns
+// or, after adopt, part of a mapped account file; a table that grows
+// always moves into the vector.
+
+struct alignas(64) AccountList::Shard
+{
+    mutable std::mutex mutex;
+    std::vector<Account> owned;
+    Account *table{nullptr};
+    unsigned int tableBits{0};
+    std::size_t used{0};
+
+    std::size_t size() const
+    {
+        return static_cast<std::size_t>(1) << tableBits;
+    }
+};
+
+// Keys are spread by Fibonacci hashing (multiplying by 2^64 divided
+// by the golden ratio). The top bits of the product pick the shard
+// and the bits below them pick the first slot to probe.
+
+static std::uint64_t hashKey(std::uint32_t key)
+{
+    return key * 0x9E3779B97F4A7C15ull;
+}
+
+static unsigned int bitsFor(std::size_t n)
+{
+    unsigned int bits = 0;
+    while ((static_cast<std::size_t>(1) << bits) < n)
+    {
+        ++bits;
+    }
+    return bits;
+}
+
+// The probe helper returns the slot holding the key, or else the
+// empty slot where the key belongs. The table is never full, so the
+// probe always ends.
+
+static Account *probe(Account *table, unsigned int tableBits, unsigned int shardBits,
+                      std::uint32_t key, std::uint64_t hash)
+{
+    const std::size_t mask = (static_cast<std::size_t>(1) << tableBits) - 1;
+    std::size_t slot = static_cast<std::size_t>((hash << shardBits) >> (64 - tableBits));
+
+    while (table[slot].getKey() != key && table[slot].getKey() != 0)
+    {
+        slot = (slot + 1) & mask;
+    }
+
+    return &table[slot];
+}
+
+// The constructor sizes every shard so that the expected number of
+// accounts fills the tables no more than half way. The number of
+// shards is rounded up to a power of two.
+
+AccountList::AccountList(std::size_t capacity, unsigned int shardCount) : shardBits(bitsFor(shardCount))
+{
+    const std::size_t count = static_cast<std::size_t>(1) << shardBits;
+    const unsigned int tableBits = std::max(4u, bitsFor(2 * capacity / count + 1));
+
+    shards = std::make_unique<Shard[]>(count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        shards[i].owned.resize(static_cast<std::size_t>(1) << tableBits);
+        shards[i].table = shards[i].owned.data();
+        shards[i].tableBits = tableBits;
+    }
+}
+
+AccountList::~AccountList()
+{
+}
+
+std::size_t AccountList::shardIndex(std::uint64_t hash) const
+{
+    return shardBits == 0 ? 0 : static_cast<std::size_t>(hash >> (64 - shardBits));
+}
+
+// The grow method makes a shard's table big enough to hold the given
+// number of accounts while no more than half full, moving the
+// accounts it already has into the bigger table. The caller must hold
+// the shard's lock.
+
+void AccountList::grow(Shard &shard, std::size_t accounts)
+{
+    unsigned int tableBits = shard.tableBits;
+    while (2 * accounts > (static_cast<std::size_t>(1) << tableBits))
+    {
+        ++tableBits;
+    }
+
+    if (tableBits == shard.tableBits)
+    {
+        return;
+    }
+
+    std::vector<Account> bigger(static_cast<std::size_t>(1) << tableBits);
+    for (std::size_t i = 0; i < shard.size(); ++i)
+    {
+        const Account &account = shard.table[i];
+        if (account.getKey() != 0)
+        {
+            *probe(bigger.data(), tableBits, shardBits, account.getKey(), hashKey(account.getKey())) = account;
+        }
+    }
+
+    shard.owned.swap(bigger);
+    shard.table = shard.owned.data();
+    shard.tableBits = tableBits;
+}
+
+// The addAccount method fails if the name or PIN is malformed, or if
+// the account already exists.
+
+bool AccountList::addAccount(std::string_view name, std::string_view pin, Money balance)
+{
+    const std::uint32_t key = accountKey(name);
+    std::uint32_t packedPin;
+    if (key == 0 || pin.size() != 4 || !packDigits(pin, packedPin))
+    {
+        return false;
+    }
+
+    const std::uint64_t hash = hashKey(key);
+    Shard &shard = shards[shardIndex(hash)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    grow(shard, shard.used + 1);
+
+    Account *slot = probe(shard.table, shard.tableBits, shardBits, key, hash);
+    if (slot->getKey() == key)
+    {
+        return false;
+    }
+
+    *slot = Account(key, static_cast<std::uint16_t>(packedPin), balance);
+    ++shard.used;
+
+    return true;
+}
+
+LockedAccount AccountList::find(std::string_view name)
+{
+    const std::uint32_t key = accountKey(name);
+    if (key == 0)
+    {
+        return LockedAccount{};
+    }
+
+    const std::uint64_t hash = hashKey(key);
+    Shard &shard = shards[shardIndex(hash)];
+    std::unique_lock<std::mutex> lock(shard.mutex);
+
+    Account *slot = probe(shard.table, shard.tableBits, shardBits, key, hash);
+    if (slot->getKey() != key)
+    {
+        return LockedAccount{};
+    }
+
+    return LockedAccount(std::move(lock), slot);
+}
+
+// The findPair method locks two accounts at once, for a Transaction
+// that must change both or neither. The two shards are locked in
+// index order; if both accounts live in the same shard, its lock is
+// taken once and held by the first LockedAccount. The method returns
+// false (and locks nothing) unless both accounts exist.
+
+bool AccountList::findPair(std::string_view firstName, std::string_view secondName, LockedAccount &first, LockedAccount &second)
+{
+    const std::uint32_t firstKey = accountKey(firstName);
+    const std::uint32_t secondKey = accountKey(secondName);
+    if (firstKey == 0 || secondKey == 0)
+    {
+        return false;
+    }
+
+    const std::uint64_t firstHash = hashKey(firstKey);
+    const std::uint64_t secondHash = hashKey(secondKey);
+    Shard &firstShard = shards[shardIndex(firstHash)];
+    Shard &secondShard = shards[shardIndex(secondHash)];
+
+    std::unique_lock<std::mutex> firstLock;
+    std::unique_lock<std::mutex> secondLock;
+    if (&firstShard == &secondShard)
+    {
+        firstLock = std::unique_lock<std::mutex>(firstShard.mutex);
+    }
+    else if (&firstShard < &secondShard)
+    {
+        firstLock = std::unique_lock<std::mutex>(firstShard.mutex);
+        secondLock = std::unique_lock<std::mutex>(secondShard.mutex);
+    }
+    else
+    {
+        secondLock = std::unique_lock<std::mutex>(secondShard.mutex);
+        firstLock = std::unique_lock<std::mutex>(firstShard.mutex);
+    }
+
+    Account *firstSlot = probe(firstShard.table, firstShard.tableBits, shardBits, firstKey, firstHash);
+    Account *secondSlot = probe(secondShard.table, secondShard.tableBits, shardBits, secondKey, secondHash);
+    if (firstSlot->getKey() != firstKey || secondSlot->getKey() != secondKey)
+    {
+        return false;
+    }
+
+    first = LockedAccount(std::move(firstLock), firstSlot);
+    second = LockedAccount(std::move(secondLock), secondSlot);
+    return true;
+}
+
+// The restore method sets the balance of the account with the given
+// key, for replaying the Journal. It fails if there is no such
+// account.
+
+bool AccountList::restore(std::uint32_t key, Money balance)
+{
+    if (key == 0)
+    {
+        return false;
+    }
+
+    const std::uint64_t hash = hashKey(key);
+    Shard &shard = shards[shardIndex(hash)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    Account *slot = probe(shard.table, shard.tableBits, shardBits, key, hash);
+    if (slot->getKey() != key)
+    {
+        return false;
+    }
+
+    slot->setBalance(balance);
+    return true;
+}
+
+// The adopt method replaces every shard's table with the table of the
+// same shard in a mapped account file, which must outlive the
+// AccountList. No account is copied or even read: the Bank's lookups
+// go straight to the mapped pages, which the kernel reads in as they
+// are first touched. The number of shards becomes the file's. Nothing
+// else may use the AccountList meanwhile.
+
+void AccountList::adopt(MappedAccountFile &file)
+{
+    shardBits = file.getShardBits();
+    const std::size_t count = static_cast<std::size_t>(1) << shardBits;
+
+    shards = std::make_unique<Shard[]>(count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        shards[i].table = file.getTable(i);
+        shards[i].tableBits = file.getTableBits(i);
+        shards[i].used = file.getUsed(i);
+    }
+}
+
+// The snapshot method copies every shard's table into an
+// AccountImage, one shard at a time under that shard's lock alone, so
+// a Transaction waits for at most one shard's copy. The image gets the
+// sequence number of the Journal's last record as it stood before the
+// copy began (zero, without a Journal). Since a Transaction appends
+// to the Journal while it holds its accounts' locks, every change
+// recorded up to then is in the copy; changes recorded later may be
+// in it too, but their records hold absolute balances, so replaying
+// them over the image does no harm. The room for the copy is found
+// beforehand, and is made outside the locks unless a table has grown
+// in the meantime.
+
+void AccountList::snapshot(AccountImage &image) const
+{
+    const std::size_t count = static_cast<std::size_t>(1) << shardBits;
+    image.sequence = journal != NULL ? journal->lastSequence() : 0;
+
+    std::size_t slots = 0;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        std::lock_guard<std::mutex> lock(shards[i].mutex);
+        slots += shards[i].size();
+    }
+
+    image.shardBits = shardBits;
+    image.tableBits.resize(count);
+    image.used.resize(count);
+    image.tables.resize(slots);
+
+    std::size_t next = 0;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        std::lock_guard<std::mutex> lock(shards[i].mutex);
+        const std::size_t size = shards[i].size();
+        if (image.tables.size() < next + size)
+        {
+            image.tables.resize(next + size);
+        }
+
+        image.tableBits[i] = shards[i].tableBits;
+        image.used[i] = shards[i].used;
+        std::copy_n(shards[i].table, size, image.tables.data() + next);
+        next += size;
+    }
+
+    image.tables.resize(next);
+}
+
+void AccountList::setJournal(Journal *j)
+{
+    journal = j;
+}
+
+// The caller must hold the locks of the accounts being recorded.
+
+void AccountList::record(const Account &first, const Account *second)
+{
+    if (journal != NULL)
+    {
+        journal->append(first, second);
+    }
+}
+
+std::size_t AccountList::size() const
+{
+    const std::size_t count = static_cast<std::size_t>(1) << shardBits;
+    std::size_t accounts = 0;
+
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        std::lock_guard<std::mutex> lock(shards[i].mutex);
+        accounts += shards[i].used;
+    }
+
+    return accounts;
+}
+
+// The total method adds up every balance in the Bank. It holds every
+// shard's lock while doing so (taking them in index order), so the
+// total is a consistent snapshot even while Transactions are being
+// processed. It returns false if the total is more than a Money can
+// hold, although no one balance is.
+
+bool AccountList::total(Money &sum) const
+{
+    const std::size_t count = static_cast<std::size_t>(1) << shardBits;
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(count);
+
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        locks.emplace_back(shards[i].mutex);
+    }
+
+    std::int64_t cents = 0;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        for (std::size_t j = 0; j < shards[i].size(); ++j)
+        {
+            if (__builtin_add_overflow(cents, shards[i].table[j].getBalance().getCents(), &cents))
+            {
+                return false;
+            }
+        }
+    }
+
+    sum = Money::fromCents(cents);
+    return true;
+}
+
+// The Bank is given the number of accounts it should expect, which
+// sizes the AccountList. More accounts than that can be added; the
+// tables merely grow.
+
+Bank::Bank(std::size_t capacity) : accounts(capacity)
+{
+}
+
+Bank::~Bank()
+{
+    {
+        std::lock_guard<std::mutex> lock(snapshotMutex);
+        stopping = true;
+    }
+    snapshotCondition.notify_one();
+
+    if (snapshotter.joinable())
+    {
+        snapshotter.join();
+    }
+}
+
+// An accounts file is either a binary account file (see
+// AccountFile.hpp), which is mapped and used in place, or text. A
+// text accounts file has one account per line: its name, its PIN,
+// and its opening balance, separated by spaces, e.g.,
+// "1234567S 1234 100.00". Blank lines and lines starting with '#'
+// are ignored. Accounts are loaded only once, before anything else
+// uses the Bank.
+
+bool Bank::loadAccounts(const std::filesystem::path &file)
+{
+    std::ifstream ifs(file, std::ios::binary);
+    if (!ifs)
+    {
+        std::cout << "@Bank@ Cannot open " << file.string() << std::endl;
+        return false;
+    }
+
+    if (isAccountFile(ifs))
+    {
+        try
+        {
+            accountFile = std::make_unique<MappedAccountFile>(file);
+        }
+        catch (const std::exception &e)
+        {
+            std::cout << "@Bank@ Cannot map " << file.string() << ": " << e.what() << std::endl;
+            return false;
+        }
+
+        accounts.adopt(*accountFile);
+        snapshotSequence = accountFile->getSequence();
+        return true;
+    }
+
+    std::string line;
+    unsigned int number = 0;
+
+    while (std::getline(ifs, line))
+    {
+        ++number;
+
+        std::string_view text{line};
+        if (!text.empty() && text.back() == '\r')
+        {
+            text.remove_suffix(1);
+        }
+
+        if (text.empty() || text.front() == '#')
+        {
+            continue;
+        }
+
+        const std::string_view::size_type first = text.find(' ');
+        const std::string_view::size_type second = first == std::string_view::npos ? first : text.find(' ', first + 1);
+
+        Money balance;
+        if (second == std::string_view::npos ||
+            !Money::parse(text.substr(second + 1), balance) ||
+            !accounts.addAccount(text.substr(0, first), text.substr(first + 1, second - first - 1), balance))
+        {
+            std::cout << "@Bank@ " << file.string() << ":" << number << ": bad or duplicate account" << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// The saveAccounts method writes every account into a binary account
+// file, and hands back the sequence number of the last Journal record
+// whose balances it is sure to include (zero, without a Journal).
+// Each shard is locked only while its table is copied; the writing
+// happens while Transactions carry on. The copy may hold balances
+// whose Journal records are not yet on disk, up to the last record
+// appended by the time the copy is done, so the file is written only
+// once those are: the ATMs have not been told of those changes, and
+// would never be if the Journal then failed.
+
+bool Bank::saveAccounts(const std::filesystem::path &file, std::uint64_t &sequence)
+{
+    AccountImage image;
+    accounts.snapshot(image);
+    sequence = image.sequence;
+
+    if (journal && !journal->commit(journal->lastSequence()))
+    {
+        std::cout << "@Bank@ Not writing " << file.string() << ": the journal has failed" << std::endl;
+        return false;
+    }
+
+    try
+    {
+        saveAccountFile(file, image);
+    }
+    catch (const std::exception &e)
+    {
+        std::cout << "@Bank@ Cannot write " << file.string() << ": " << e.what() << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// The openJournal method replays the Journal over the balances just
+// loaded, skipping the records already in the snapshot (if the
+// accounts came from one), and from then on records every change in
+// it. The commit window is how long the Journal may hold a
+// Transaction's changes in memory, hoping to flush them along with
+// others (see Journal.hpp).
+
+bool Bank::openJournal(const std::filesystem::path &file, std::chrono::microseconds window)
+{
+    try
+    {
+        journal = std::make_unique<Journal>(file, window);
+        const std::size_t replayed = journal->replay(accounts, snapshotSequence);
+        std::cout << "@Bank@ Replayed " << replayed << " journal records from " << file.string() << std::endl;
+    }
+    catch (const std::exception &e)
+    {
+        std::cout << "@Bank@ Cannot open the journal: " << e.what() << std::endl;
+        journal.reset();
+        return false;
+    }
+
+    accounts.setJournal(journal.get());
+    return true;
+}
+
+// The startSnapshots method starts a thread that takes a snapshot
+// every interval, if any Transaction has changed a balance since the
+// last one. It requires an open Journal.
+
+void Bank::startSnapshots(const std::filesystem::path &file, std::chrono::seconds interval)
+{
+    snapshotFile = file;
+    snapshotter = std::thread(&Bank::snapshotEvery, this, interval);
+}
+
+void Bank::snapshotEvery(std::chrono::seconds interval)
+{
+    std::unique_lock<std::mutex> lock(snapshotMutex);
+    while (!snapshotCondition.wait_for(lock, interval, [this]
+                                       { return stopping; }))
+    {
+        lock.unlock();
+        takeSnapshot();
+        lock.lock();
+    }
+}
+
+// The takeSnapshot method writes out every account as of the
+// Journal's latest record, and then drops the records up to that one
+// from the Journal. A snapshot is an account file like any other, so
+// the Bank starts from it the same way. Once the Journal has failed,
+// no more snapshots are taken.
+
+bool Bank::takeSnapshot()
+{
+    if (!journal->healthy())
+    {
+        return false;
+    }
+    if (journal->lastSequence() == snapshotSequence)
+    {
+        return true;
+    }
+
+    std::uint64_t sequence;
+    if (!saveAccounts(snapshotFile, sequence))
+    {
+        return false;
+    }
+
+    snapshotSequence = sequence;
+    try
+    {
+        journal->discardThrough(sequence);
+    }
+    catch (const std::exception &e)
+    {
+        std::cout << "@Bank@ Cannot trim the journal: " << e.what() << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+AccountList &Bank::getAccounts()
+{
+    return accounts;
+}
+
+// With a Journal, a Transaction is accepted only once everything
+// appended up to the end of its processing is durable, which includes
+// its own record. If the Journal can no longer be written, the Bank
+// refuses everything, since it could not keep any promise it made.
+
+bool Bank::process(Transaction &transaction)
+{
+    if (journal == NULL)
+    {
+        return transaction.process(accounts);
+    }
+
+    if (!journal->healthy())
+    {
+        return false;
+    }
+
+    if (!transaction.process(accounts))
+    {
+        return false;
+    }
+
+    if (!journal->commit(journal->lastSequence()))
+    {
+        logEvent(LogComponent::Bank, LogLevel::Error, LogEvent::JournalFailed);
+        return false;
+    }
+
+    return true;
+}
+
+// The serve method is the Bank's half of the conversation with one
+// ATM. Every request gets a reply, including one the Network could
+// not make sense of, so that the ATM is never left waiting. The
+// replies to a batch of requests go back as one batch, once the last
+// request in it is processed.
+
+void Bank::serve(std::unique_ptr<Transport> &transport)
+{
+    Network network(transport);
+    if (!network.negotiate())
+    {
+        logEvent(LogComponent::Bank, LogLevel::Warning, LogEvent::NegotiationFailed);
+        return;
+    }
+
+    std::uint32_t id;
+    std::unique_ptr<Transaction> transaction;
+    std::string batch;
+
+    while (network.receive(id, transaction))
+    {
+        const bool accepted = transaction != NULL && process(*transaction);
+
+        if (network.isBatched())
+        {
+            if (transaction == NULL)
+            {
+                network.refuse(id, batch);
+            }
+            else
+            {
+                network.send(accepted ? 1 : 0, *transaction, id, batch);
+            }
+            if (!network.hasRecords())
+            {
+                network.sendBatch(batch);
+                batch.clear();
+            }
+        }
+        else if (transaction == NULL)
+        {
+            network.refuse(id);
+        }
+        else
+        {
+            network.send(accepted ? 1 : 0, *transaction, id);
+        }
+    }
+}
@@ -0,0 +1,170 @@
+// Bank.hpp: The header file for the main classes of the Bank side of
+// the application: the Account, the AccountList that indexes all of
+// the Bank's accounts, and the Bank itself. Like the ATM classes,
+// these reside solely on one side of the application.
+
+#ifndef BANK_HPP
+#define BANK_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+
+#include "Money.hpp"
+
+class Journal;
+class MappedAccountFile;
+struct AccountImage;
+class Transaction;
+class Transport;
+
+// An account name is seven digits followed by S (savings) or C
+// (checking). The Bank never keeps the name as text: accountKey packs
+// it into a nonzero 32-bit key, or returns zero if the name is not a
+// valid account name.
+
+std::uint32_t accountKey(std::string_view);
+
+// The Account is a compact, fixed-size record (sixteen bytes), so
+// that the AccountList can keep its accounts in flat arrays. The PIN
+// is kept packed as well.
+
+class Account
+{
+    std::uint32_t key{0};
+    std::uint16_t pin{0};
+    Money balance;
+
+public:
+    Account() = default;
+    Account(std::uint32_t, std::uint16_t, Money);
+
+    std::uint32_t getKey() const;
+    bool checkPin(std::string_view) const;
+    Money getBalance() const;
+    void setBalance(Money);
+    bool canDeposit(Money) const;
+    bool deposit(Money);
+    bool withdraw(Money);
+};
+
+// A LockedAccount is what a search of the AccountList hands back. It
+// holds the lock that protects the account for as long as it lives,
+// so a Transaction can check the PIN and update the balance without
+// anyone else touching the account in between. An empty
+// LockedAccount (one that tests false) means there is no such
+// account.
+
+class LockedAccount
+{
+    std::unique_lock<std::mutex> lock;
+    Account *account{nullptr};
+
+public:
+    LockedAccount() = default;
+    LockedAccount(std::unique_lock<std::mutex>, Account *);
+
+    explicit operator bool() const;
+    Account &operator*() const;
+    Account *operator->() const;
+};
+
+// The AccountList is an open-addressing hash index over the
+// accounts. It is split into a fixed number of shards, each with its
+// own lock and its own table of Account records, so Transactions on
+// different accounts almost never wait for one another. Within a
+// shard, a table slot holds the Account itself (a zero key marks an
+// empty slot) and collisions are resolved by linear probing, which
+// keeps a search within a cache line or two. A shard doubles its
+// table when it becomes half full. Accounts are never removed.
+//
+// Whenever more than one shard must be locked at once (findPair for
+// a Transfer, total for an audit), the locks are taken in shard
+// index order. Since everyone agrees on that order, no two threads
+// can each hold a lock the other is waiting for.
+//
+// If the AccountList is given a Journal, every Transaction that
+// changes a balance records the change through the record method
+// before it lets go of its locks.
+
+const unsigned int DefaultAccountShards = 64;
+
+class AccountList
+{
+    struct Shard;
+
+    std::unique_ptr<Shard[]> shards;
+    unsigned int shardBits;
+    Journal *journal{nullptr};
+
+public:
+    AccountList(std::size_t, unsigned int = DefaultAccountShards);
+    ~AccountList();
+    AccountList(const AccountList &) = delete;
+    AccountList &operator=(const AccountList &) = delete;
+
+    bool addAccount(std::string_view, std::string_view, Money);
+    LockedAccount find(std::string_view);
+    bool findPair(std::string_view, std::string_view, LockedAccount &, LockedAccount &);
+    bool restore(std::uint32_t, Money);
+    void adopt(MappedAccountFile &);
+    void snapshot(AccountImage &) const;
+    void setJournal(Journal *);
+    void record(const Account &, const Account * = nullptr);
+    std::size_t size() const;
+    bool total(Money &) const;
+
+private:
+    std::size_t shardIndex(std::uint64_t) const;
+    void grow(Shard &, std::size_t);
+};
+
+// The Bank owns the AccountList and serves the ATMs that connect to
+// it. The process method carries out one Transaction, from whichever
+// thread; the serve method runs one ATM's connection until the ATM
+// goes away. If the Bank has opened a Journal, process returns only
+// once the Transaction's changes are durable.
+//
+// The accounts come either from the accounts file, when the Bank
+// starts for the first time, or from its latest snapshot, which is a
+// binary account file (see AccountFile.hpp). Once the Journal is
+// open, the Bank may be asked to write a new snapshot every so often
+// on a thread of its own, after which the Journal keeps only the
+// records that follow it.
+
+class Bank
+{
+    std::unique_ptr<MappedAccountFile> accountFile;
+    AccountList accounts;
+    std::unique_ptr<Journal> journal;
+    std::uint64_t snapshotSequence{0};
+    std::filesystem::path snapshotFile;
+    bool stopping{false};
+    std::mutex snapshotMutex;
+    std::condition_variable snapshotCondition;
+    std::thread snapshotter;
+
+public:
+    Bank(std::size_t);
+    ~Bank();
+
+    bool loadAccounts(const std::filesystem::path &);
+    bool saveAccounts(const std::filesystem::path &, std::uint64_t &);
+    bool openJournal(const std::filesystem::path &, std::chrono::microseconds);
+    void startSnapshots(const std::filesystem::path &, std::chrono::seconds);
+    bool takeSnapshot();
+    AccountList &getAccounts();
+    bool process(Transaction &);
+    void serve(std::unique_ptr<Transport> &);
+
+private:
+    void snapshotEvery(std::chrono::seconds);
+};
+
+#endif
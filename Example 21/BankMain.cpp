@@ -0,0 +1,136 @@
+// BankMain.cpp: The main driving routine for the Bank side of the
+// application. It builds the Bank, loads its accounts from the file
+// named by the first command line argument, and then serves ATMs.
+// The optional second argument is the address to listen on
+// ("tcp:host:port" or "unix:path"); the ATMs that connect there are
+// all watched by one BankServer, whose requests are processed by the
+// number of worker threads given in the optional third argument (by
+// default, one per processor). Without an address, the user types in
+// the request packets to simulate a network of some kind. With the
+// leading -journal option, the Bank replays the named journal file
+// over the accounts it loaded, and then records every change of
+// balance there before answering; CommitWindow is how many
+// microseconds a change may wait to share a flush with others (see
+// Journal.hpp). The -snapshot option, which may follow it, names the
+// snapshot file: if that file exists, the Bank starts from it (and
+// the tail of the journal) rather than from the accounts file, and it
+// writes a new one every Interval seconds (never, if Interval is 0).
+// The accounts file and the snapshot may both be binary account files
+// (see AccountFile.hpp), which the Bank maps and uses in place; the
+// -convert option turns an accounts file into one and exits. The
+// ATM_LOG environment variable, if set, says which diagnostics are
+// printed (see Log.hpp).
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+#include <sys/resource.h>
+
+#include "Bank.hpp"
+#include "Log.hpp"
+#include "Server.hpp"
+#include "Transport.hpp"
+
+// The Bank's tables start out sized for this many accounts.
+
+const std::size_t ExpectedAccounts = 1024;
+
+int main(int argc, char **argv)
+{
+    const char *logSpec = std::getenv("ATM_LOG");
+    if (logSpec != NULL && !configureLog(logSpec))
+    {
+        std::cout << "Bad ATM_LOG specification: " << logSpec << std::endl;
+        return 1;
+    }
+
+    if (argc == 4 && std::strcmp(argv[1], "-convert") == 0)
+    {
+        Bank bank(ExpectedAccounts);
+        std::uint64_t sequence;
+        return bank.loadAccounts(argv[2]) && bank.saveAccounts(argv[3], sequence) ? 0 : 1;
+    }
+
+    const char *program = argv[0];
+    const char *journalFile = NULL;
+    long commitWindow = 0;
+    if (argc >= 4 && std::strcmp(argv[1], "-journal") == 0)
+    {
+        journalFile = argv[2];
+        commitWindow = std::atol(argv[3]);
+        argc -= 3;
+        argv += 3;
+    }
+
+    const char *snapshotFile = NULL;
+    long snapshotInterval = 0;
+    if (journalFile != NULL && argc >= 4 && std::strcmp(argv[1], "-snapshot") == 0)
+    {
+        snapshotFile = argv[2];
+        snapshotInterval = std::atol(argv[3]);
+        argc -= 3;
+        argv += 3;
+    }
+
+    if (argc < 2 || argc > 4 || commitWindow < 0 || snapshotInterval < 0)
+    {
+        std::cout << "Usage: " << program << " [-journal JournalFile CommitWindow [-snapshot SnapshotFile Interval]]"
+                  << " AccountsFile [tcp:host:port | unix:path [Workers]]" << std::endl;
+        std::cout << "       " << program << " -convert AccountsFile AccountFile" << std::endl;
+        return 1;
+    }
+
+    Bank bank(ExpectedAccounts);
+    if (!bank.loadAccounts(snapshotFile != NULL && std::filesystem::exists(snapshotFile) ? snapshotFile : argv[1]))
+    {
+        return 1;
+    }
+
+    if (journalFile != NULL && !bank.openJournal(journalFile, std::chrono::microseconds(commitWindow)))
+    {
+        return 1;
+    }
+
+    if (snapshotFile != NULL && snapshotInterval > 0)
+    {
+        bank.startSnapshots(snapshotFile, std::chrono::seconds(snapshotInterval));
+    }
+
+    if (argc == 2)
+    {
+        std::unique_ptr<Transport> console;
+        bank.serve(console);
+        return 0;
+    }
+
+    // Every ATM holds a descriptor open, so the Bank asks for as many
+    // descriptors as it is allowed.
+    rlimit limit;
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        ::setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    const unsigned int workers = argc == 4 ? static_cast<unsigned int>(std::atoi(argv[3]))
+                                           : std::thread::hardware_concurrency();
+
+    std::unique_ptr<BankServer> server;
+    try
+    {
+        std::unique_ptr<TransportListener> listener = listenTransport(argv[2]);
+        server = std::make_unique<BankServer>(bank, listener, workers);
+    }
+    catch (const std::exception &e)
+    {
+        std::cout << "Cannot listen: " << e.what() << std::endl;
+        return 1;
+    }
+
+    server->run();
+}
@@ -0,0 +1,467 @@
+// Bench.cpp: The benchmark suite for the Transaction and packet code.
+// Like the Network class, it is compiled into both sides of the
+// application. The ATM side (atmbench) times TimeStamp construction,
+// both kinds of Transaction::packetize, a TransactionList being
+// filled and cleaned up, and whole BankProxy::process round trips,
+// first against the Network simulation and then, if given a Bank's
+// address, over a real connection to it (a loopback address such as
+// unix:/tmp/bank.sock keeps the network itself out of the figures).
+// Over a real connection, the round trips are also timed pipelined,
+// with several outstanding on a tagged connection; before anything
+// is timed, the ATM side checks that pipelined answers reach the
+// right Transactions whatever their order, and fails if they do not.
+// The round trips use Balance Transactions, so they leave the Bank's
+// accounts as they were. The Bank side (bankbench) times parsing
+// both kinds of request packet and building both kinds of reply.
+//
+// Usage: atmbench [Milliseconds [tcp:host:port | unix:path [ascii | binary]]]
+//        bankbench [Milliseconds]
+//
+// Each benchmark first finds a batch size that takes a measurable
+// time, then times Repetitions batches spending about Milliseconds
+// (by default 200) in all. The results go to the standard output as
+// one JSON object per line, so that runs from one release and the
+// next can be compared by a script:
+//
+//   {"benchmark":"packetize/ascii/Tran","side":"atm","iterations":...,
+//    "ns_per_op":...,"ns_per_op_min":...,"ns_per_op_max":...}
+//
+// where ns_per_op is the median over the repetitions.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Log.hpp"
+#include "Trans.hpp"
+#include "Wire.hpp"
+
+#ifdef ATM_SIDE
+#include "Atm.hpp"
+#include "Network.hpp"
+#include "Script.hpp"
+#include "Transport.hpp"
+
+const char *const BenchSide = "atm";
+#endif
+
+#ifdef BANK_SIDE
+#include "Packet.hpp"
+
+const char *const BenchSide = "bank";
+#endif
+
+const unsigned int Repetitions = 5;
+
+static std::chrono::milliseconds benchTime{200};
+
+// Every operation returns a number derived from its result, and the
+// sum of them is stored here, so that the compiler cannot throw the
+// work away.
+
+static volatile std::uint64_t sink;
+
+template <typename Operation>
+static double timeBatch(Operation &operation, std::uint64_t batch)
+{
+    std::uint64_t sum = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (std::uint64_t i = 0; i < batch; ++i)
+    {
+        sum += operation();
+    }
+    const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    sink = sink + sum;
+
+    return elapsed.count();
+}
+
+template <typename Operation>
+static void bench(const std::string &name, Operation operation)
+{
+    const double repetitionNanos = std::chrono::duration<double, std::nano>(benchTime).count() / Repetitions;
+
+    std::uint64_t batch = 1;
+    double nanos = timeBatch(operation, batch);
+    while (nanos < repetitionNanos / 10 && batch < (std::uint64_t{1} << 40))
+    {
+        batch *= 2;
+        nanos = timeBatch(operation, batch);
+    }
+    batch = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(batch * repetitionNanos / std::max(nanos, 1.0)));
+
+    std::vector<double> perOp;
+    for (unsigned int r = 0; r < Repetitions; ++r)
+    {
+        perOp.push_back(timeBatch(operation, batch) / static_cast<double>(batch));
+    }
+    std::sort(perOp.begin(), perOp.end());
+
+    std::cout << "{\"benchmark\":\"" << name << "\",\"side\":\"" << BenchSide << "\",\"iterations\":" << batch * Repetitions
+              << ",\"ns_per_op\":" << perOp[Repetitions / 2] << ",\"ns_per_op_min\":" << perOp.front()
+              << ",\"ns_per_op_max\":" << perOp.back() << "}" << std::endl;
+}
+
+#ifdef ATM_SIDE
+
+// The same four Transactions are used throughout, one of each kind.
+
+static void benchTransactions(const std::vector<std::unique_ptr<Transaction>> &transactions)
+{
+    bench("timestamp/construct", []
+          {
+              TimeStamp timeStamp;
+              return static_cast<std::uint64_t>(timeStamp.getMonotonicNanos());
+          });
+
+    for (const std::unique_ptr<Transaction> &transaction : transactions)
+    {
+        const Transaction &t = *transaction;
+        bench("packetize/ascii/" + t.type(), [&t]
+              { return static_cast<std::uint64_t>(t.packetize().size()); });
+    }
+
+    for (const std::unique_ptr<Transaction> &transaction : transactions)
+    {
+        const Transaction &t = *transaction;
+        bench("packetize/binary/" + t.type(), [&t]
+              {
+                  WireRequest request;
+                  unsigned char buf[WireRequestSize];
+                  t.packetize(request);
+                  encodeRequest(request, buf);
+                  return static_cast<std::uint64_t>(buf[WireRequestSize - 1]);
+              });
+    }
+
+    // A session's worth of Transactions: the list is filled to the
+    // brim, then cleaned up for the next customer.
+    TransactionList list;
+    bench("transactionlist/fill-cleanup", [&list]
+          {
+              std::uint64_t added = 0;
+              Transaction *t;
+              while ((t = list.create<Withdraw>("1234567S", "1234", Money::fromDollars(20))) != NULL)
+              {
+                  list.addTransaction(t);
+                  ++added;
+              }
+              list.cleanup();
+              return added;
+          });
+}
+
+// A round trip builds a Balance Transaction, as the SuperKeypad
+// would, and has the BankProxy process it.
+
+static std::uint64_t roundTrip(BankProxy &bankProxy)
+{
+    Balance balance("1234567S", "1234");
+    return bankProxy.process(balance) ? 1 : 0;
+}
+
+static void benchSimulatedRoundTrips()
+{
+    InputScript script;
+    script.addReply("0001 125.00");
+
+    std::unique_ptr<Network> network{std::make_unique<Network>(script)};
+    BankProxy bankProxy(network);
+    bench("bankproxy/simulated/Balance", [&]
+          {
+              script.rewind();
+              return roundTrip(bankProxy);
+          });
+}
+
+// Before anything is timed, the pipelined BankProxy is checked
+// against a script that answers a window of Balances in reverse
+// order: each answer must reach the Balance it was meant for, and
+// complete must hand them back in the order they were answered.
+
+const unsigned int PipelineWindow = 16;
+
+static bool checkPipelinedAnswers()
+{
+    InputScript script;
+    for (unsigned int i = PipelineWindow; i-- > 0;)
+    {
+        script.addReply(std::to_string(i) + " 0001 " + std::to_string(i + 1) + ".00");
+    }
+
+    std::unique_ptr<Network> network{std::make_unique<Network>(script)};
+    network->negotiate(WireFormat::Ascii, true);
+    BankProxy bankProxy(network, PipelineWindow);
+
+    std::vector<std::unique_ptr<Balance>> balances;
+    for (unsigned int i = 0; i < PipelineWindow; ++i)
+    {
+        balances.push_back(std::make_unique<Balance>("1234567S", "1234"));
+        bankProxy.submit(*balances.back());
+    }
+
+    for (unsigned int i = PipelineWindow; i-- > 0;)
+    {
+        Transaction *t;
+        bool status;
+        if (!bankProxy.complete(t, status) || !status || t != balances[i].get() ||
+            balances[i]->getBalance() != Money::fromDollars(i + 1))
+        {
+            std::cerr << "A pipelined answer reached the wrong Transaction" << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// A pipelined round trip keeps the window full: it takes back the
+// earliest answered Balance, if every one is outstanding, and sends
+// it again.
+
+static std::uint64_t pipelinedRoundTrip(BankProxy &bankProxy, std::vector<Transaction *> &idle)
+{
+    std::uint64_t approved = 0;
+    if (idle.empty())
+    {
+        Transaction *t;
+        bool status;
+        if (!bankProxy.complete(t, status))
+        {
+            return 0;
+        }
+        idle.push_back(t);
+        approved = status ? 1 : 0;
+    }
+
+    Transaction *t = idle.back();
+    idle.pop_back();
+    if (!bankProxy.submit(*t))
+    {
+        idle.push_back(t);
+    }
+
+    return approved;
+}
+
+// The pipelined round trips run over a tagged connection of their
+// own, with PipelineWindow Balances outstanding at a time.
+
+static bool benchPipelinedRoundTrips(const char *address, WireFormat format)
+{
+    std::unique_ptr<Network> network;
+    try
+    {
+        std::unique_ptr<Transport> transport{connectTransport(address)};
+        network = std::make_unique<Network>(transport);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Cannot reach the Bank: " << e.what() << std::endl;
+        return false;
+    }
+
+    if (!network->negotiate(format, true) || !network->isTagged())
+    {
+        std::cerr << "The Bank did not accept a tagged connection" << std::endl;
+        return false;
+    }
+
+    const char *formatName = network->getFormat() == WireFormat::Binary ? "binary" : "ascii";
+    BankProxy bankProxy(network, PipelineWindow);
+    std::vector<std::unique_ptr<Balance>> balances;
+    std::vector<Transaction *> idle;
+    for (unsigned int i = 0; i < PipelineWindow; ++i)
+    {
+        balances.push_back(std::make_unique<Balance>("1234567S", "1234"));
+        idle.push_back(balances.back().get());
+    }
+
+    bench(std::string("bankproxy/") + formatName + "/pipelined/Balance", [&bankProxy, &idle]
+          { return pipelinedRoundTrip(bankProxy, idle); });
+
+    // The Balances still outstanding must be answered before they go.
+    Transaction *t;
+    bool status;
+    while (bankProxy.complete(t, status))
+    {
+    }
+
+    return true;
+}
+
+static bool benchLoopbackRoundTrips(const char *address, WireFormat format)
+{
+    std::unique_ptr<Network> network;
+    try
+    {
+        std::unique_ptr<Transport> transport{connectTransport(address)};
+        network = std::make_unique<Network>(transport);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Cannot reach the Bank: " << e.what() << std::endl;
+        return false;
+    }
+
+    if (!network->negotiate(format, false))
+    {
+        std::cerr << "The Bank did not accept the connection" << std::endl;
+        return false;
+    }
+
+    const char *formatName = network->getFormat() == WireFormat::Binary ? "binary" : "ascii";
+    BankProxy bankProxy(network);
+    bench(std::string("bankproxy/") + formatName + "/Balance", [&bankProxy]
+          { return roundTrip(bankProxy); });
+
+    return benchPipelinedRoundTrips(address, format);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 4 || (argc > 1 && std::atol(argv[1]) <= 0) ||
+        (argc == 4 && std::strcmp(argv[3], "ascii") != 0 && std::strcmp(argv[3], "binary") != 0))
+    {
+        std::cout << "Usage: " << argv[0] << " [Milliseconds [tcp:host:port | unix:path [ascii | binary]]]" << std::endl;
+        return 1;
+    }
+    if (argc > 1)
+    {
+        benchTime = std::chrono::milliseconds(std::atol(argv[1]));
+    }
+
+    // The simulation would otherwise log every packet it sends.
+    configureLog("off");
+
+    std::vector<std::unique_ptr<Transaction>> transactions;
+    transactions.push_back(std::make_unique<Withdraw>("1234567S", "1234", Money::fromDollars(20)));
+    transactions.push_back(std::make_unique<Deposit>("1234567S", "1234", Money::fromCents(12345)));
+    transactions.push_back(std::make_unique<Balance>("1234567S", "1234"));
+    transactions.push_back(std::make_unique<Transfer>("1234567S", "1234", "7654321C", Money::fromDollars(100)));
+
+    benchTransactions(transactions);
+    if (!checkPipelinedAnswers())
+    {
+        return 1;
+    }
+    benchSimulatedRoundTrips();
+
+    if (argc > 2)
+    {
+        const WireFormat format = argc == 4 && std::strcmp(argv[3], "ascii") == 0 ? WireFormat::Ascii : WireFormat::Binary;
+        if (!benchLoopbackRoundTrips(argv[2], format))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+#endif
+
+#ifdef BANK_SIDE
+
+// The request packets are the ones an ATM sends for each kind of
+// Transaction, in both formats.
+
+struct BenchRequest
+{
+    const char *kind;
+    const char *ascii;
+    WireRequest binary;
+};
+
+static WireRequest makeRequest(std::uint8_t type, Money amount, std::uint32_t target)
+{
+    WireRequest request;
+    request.type = type;
+    request.accountType = 'S';
+    request.account = 1234567;
+    request.pin = 1234;
+    request.amount = amount;
+    if (target != 0)
+    {
+        request.targetType = 'C';
+        request.targetAccount = target;
+    }
+    return request;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2 || (argc > 1 && std::atol(argv[1]) <= 0))
+    {
+        std::cout << "Usage: " << argv[0] << " [Milliseconds]" << std::endl;
+        return 1;
+    }
+    if (argc > 1)
+    {
+        benchTime = std::chrono::milliseconds(std::atol(argv[1]));
+    }
+
+    const BenchRequest requests[] = {
+        {"Withdraw", "With1234567S 1234 20.00", makeRequest(WireWithdraw, Money::fromDollars(20), 0)},
+        {"Deposit", "Depo1234567S 1234 123.45", makeRequest(WireDeposit, Money::fromCents(12345), 0)},
+        {"Balance", "Bala1234567S 1234 0.00", makeRequest(WireBalance, Money(), 0)},
+        {"Transfer", "Tran1234567S 1234 100.00 7654321C", makeRequest(WireTransfer, Money::fromDollars(100), 7654321)},
+    };
+
+    for (const BenchRequest &request : requests)
+    {
+        const std::string_view packet{request.ascii};
+        ParsedPacket parsed;
+        if (parsePacket(packet, parsed) != PacketError::None)
+        {
+            std::cerr << "Bad benchmark packet: " << request.ascii << std::endl;
+            return 1;
+        }
+
+        bench(std::string("parse/ascii/") + request.kind, [packet]
+              {
+                  ParsedPacket p;
+                  return static_cast<std::uint64_t>(parsePacket(packet, p)) + p.amount.getCents();
+              });
+    }
+
+    for (const BenchRequest &request : requests)
+    {
+        unsigned char buf[WireRequestSize];
+        encodeRequest(request.binary, buf);
+        WireRequest decoded;
+        if (!decodeRequest(buf, WireRequestSize, decoded))
+        {
+            std::cerr << "Bad benchmark request: " << request.kind << std::endl;
+            return 1;
+        }
+
+        bench(std::string("parse/binary/") + request.kind, [&buf]
+              {
+                  WireRequest r;
+                  return static_cast<std::uint64_t>(decodeRequest(buf, WireRequestSize, r)) + r.account;
+              });
+    }
+
+    const Balance balance("1234567S", "1234");
+    bench("reply/ascii/Balance", [&balance]
+          { return static_cast<std::uint64_t>(balance.packetize(1).size()); });
+    bench("reply/binary/Balance", [&balance]
+          {
+              WireReply reply;
+              unsigned char buf[WireReplySize];
+              balance.packetize(reply, 1);
+              encodeReply(reply, buf);
+              return static_cast<std::uint64_t>(buf[WireReplySize - 1]);
+          });
+
+    return 0;
+}
+
+#endif
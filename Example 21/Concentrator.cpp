@@ -0,0 +1,454 @@
+// Concentrator.cpp: The source file of the Concentrator class, which
+// batches the requests of many ATMs onto one connection to the Bank,
+// and of the Ports through which the ATMs' Networks reach it.
+
+#include "Concentrator.hpp"
+#include "Log.hpp"
+#include "Transport.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <deque>
+#include <system_error>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+// A Port is one ATM's end of the Concentrator. Replies wait in its
+// inbox until the ATM's Network receives them. Its pipe holds one
+// byte whenever the inbox holds a reply (or the Port has failed), so
+// the pipe's descriptor is readable exactly when a receive would not
+// wait.
+
+class Concentrator::Port : public Transport
+{
+    Concentrator &concentrator;
+    bool negotiated{false};
+    bool tagged{false};
+    std::mutex mutex;
+    std::deque<std::string> inbox;
+    bool failed{false};
+    bool signalled{false};
+    int wakeRead{-1};
+    int wakeWrite{-1};
+    Deadline *deadline{nullptr};
+
+public:
+    explicit Port(Concentrator &);
+    ~Port() override;
+    Port(const Port &) = delete;
+    Port &operator=(const Port &) = delete;
+
+    bool sendFrame(std::string_view) override;
+    bool receiveFrame(std::string &) override;
+    void setDeadline(Deadline *) override;
+    int getDescriptor() const override;
+
+    void deliver(std::uint32_t, std::string_view);
+    void fail();
+
+private:
+    void signal();
+};
+
+Concentrator::Port::Port(Concentrator &c) : concentrator(c)
+{
+    int fds[2];
+    if (::pipe(fds) != 0)
+    {
+        throw std::system_error(errno, std::generic_category(), "Cannot make a port's pipe");
+    }
+
+    wakeRead = fds[0];
+    wakeWrite = fds[1];
+    for (const int fd : fds)
+    {
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+}
+
+Concentrator::Port::~Port()
+{
+    concentrator.detach(*this);
+    ::close(wakeRead);
+    ::close(wakeWrite);
+}
+
+// The first frame the Network sends is its hello, which the Port
+// answers itself with the format the Concentrator agreed on with the
+// Bank, tagged if the Network asked for tags. Every other frame is a
+// request, tagged or not, for the Concentrator's next batch.
+
+bool Concentrator::Port::sendFrame(std::string_view frame)
+{
+    if (!negotiated)
+    {
+        WireFormat proposed;
+        std::uint8_t version;
+        std::uint8_t options;
+        if (!decodeHello(reinterpret_cast<const unsigned char *>(frame.data()), frame.size(), proposed, version, options))
+        {
+            return false;
+        }
+
+        negotiated = true;
+        tagged = (options & WireTagged) != 0;
+
+        unsigned char hello[WireHelloSize];
+        encodeHello(concentrator.format, tagged ? WireTagged : 0, hello);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        inbox.emplace_back(reinterpret_cast<const char *>(hello), sizeof(hello));
+        signal();
+        return true;
+    }
+
+    std::uint32_t tag = 0;
+    if (tagged)
+    {
+        if (frame.size() < WireTagSize)
+        {
+            return false;
+        }
+        tag = decodeTag(reinterpret_cast<const unsigned char *>(frame.data()));
+        frame.remove_prefix(WireTagSize);
+    }
+
+    return concentrator.submit(*this, tag, frame);
+}
+
+// Like a SocketTransport, the Port gives up once its Deadline expires.
+
+bool Concentrator::Port::receiveFrame(std::string &frame)
+{
+    while (true)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!inbox.empty())
+            {
+                frame.swap(inbox.front());
+                inbox.pop_front();
+                signal();
+                return true;
+            }
+            if (failed)
+            {
+                return false;
+            }
+        }
+
+        if (deadline != nullptr)
+        {
+            if (!deadline->wait(wakeRead))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            pollfd ready{wakeRead, POLLIN, 0};
+            if (::poll(&ready, 1, -1) < 0 && errno != EINTR)
+            {
+                return false;
+            }
+        }
+    }
+}
+
+void Concentrator::Port::setDeadline(Deadline *d)
+{
+    deadline = d;
+}
+
+int Concentrator::Port::getDescriptor() const
+{
+    return wakeRead;
+}
+
+// The deliver method puts a reply in the inbox, under the tag the
+// Network gave its request.
+
+void Concentrator::Port::deliver(std::uint32_t tag, std::string_view packet)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    inbox.emplace_back();
+    std::string &frame = inbox.back();
+    if (tagged)
+    {
+        unsigned char buf[WireTagSize];
+        encodeTag(tag, buf);
+        frame.append(reinterpret_cast<const char *>(buf), sizeof(buf));
+    }
+    frame.append(packet);
+
+    signal();
+}
+
+void Concentrator::Port::fail()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    failed = true;
+    signal();
+}
+
+// The signal method brings the pipe in line with the inbox. It is
+// called with the Port locked.
+
+void Concentrator::Port::signal()
+{
+    const bool wanted = failed || !inbox.empty();
+    if (wanted == signalled)
+    {
+        return;
+    }
+
+    char byte = 1;
+    if ((wanted ? ::write(wakeWrite, &byte, 1) : ::read(wakeRead, &byte, 1)) == 1)
+    {
+        signalled = wanted;
+    }
+}
+
+// The Transport is the connection to the Bank. A batch is sent once
+// it holds batchLimit requests, or once its first request has waited
+// for linger.
+
+Concentrator::Concentrator(std::unique_ptr<Transport> &t, std::chrono::microseconds l, std::size_t limit)
+    : transport(std::move(t)), linger(l), batchLimit(std::max<std::size_t>(limit, 1))
+{
+}
+
+// Stopping the receiver cancels the Deadline it waits with; the
+// sender is woken by its condition.
+
+Concentrator::~Concentrator()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    batchCondition.notify_all();
+    stop.cancel();
+
+    if (sender.joinable())
+    {
+        sender.join();
+    }
+    if (receiver.joinable())
+    {
+        receiver.join();
+    }
+}
+
+// The negotiate method proposes the given format, with tagged and
+// batched frames, to the Bank, and starts the threads that send the
+// batches and hand out the replies. It returns false if the Bank does
+// not answer with a valid hello frame, or will not batch.
+
+bool Concentrator::negotiate(WireFormat proposed)
+{
+    unsigned char hello[WireHelloSize];
+    encodeHello(proposed, WireTagged | WireBatched, hello);
+
+    std::string frame;
+    if (!transport->sendFrame(std::string_view(reinterpret_cast<const char *>(hello), sizeof(hello))) ||
+        !transport->receiveFrame(frame))
+    {
+        return false;
+    }
+
+    WireFormat accepted;
+    std::uint8_t version;
+    std::uint8_t options;
+    if (!decodeHello(reinterpret_cast<const unsigned char *>(frame.data()), frame.size(), accepted, version, options) ||
+        (accepted == WireFormat::Binary && version != WireVersion) ||
+        (options & (WireTagged | WireBatched)) != (WireTagged | WireBatched))
+    {
+        return false;
+    }
+
+    format = accepted;
+    transport->setDeadline(&stop);
+    sender = std::thread(&Concentrator::send, this);
+    receiver = std::thread(&Concentrator::receive, this);
+    return true;
+}
+
+// The connect method makes a Port for one more ATM, to build its
+// Network on.
+
+std::unique_ptr<Transport> Concentrator::connect()
+{
+    std::unique_ptr<Port> port{std::make_unique<Port>(*this)};
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ports.push_back(port.get());
+    if (lost)
+    {
+        port->fail();
+    }
+
+    return port;
+}
+
+// The submit method adds a request to the batch, waiting while the
+// batch is full. The request is routed back to the Port by a fresh
+// correlation ID, which is never zero: that is what the Bank answers
+// a request it could not make out with.
+
+bool Concentrator::submit(Port &port, std::uint32_t tag, std::string_view packet)
+{
+    const std::size_t size = WireRecordHeaderSize + WireTagSize + packet.size();
+    if (size > MaxFrameSize)
+    {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!lost && (records >= batchLimit || batch.size() + size > MaxFrameSize))
+    {
+        flushNow = true;
+        batchCondition.notify_one();
+        roomCondition.wait(lock);
+    }
+    if (lost)
+    {
+        return false;
+    }
+
+    const std::uint32_t id = nextId;
+    nextId = nextId == UINT32_MAX ? 1 : nextId + 1;
+    routes[id] = Route{&port, tag};
+    appendRecord(batch, id, packet);
+
+    if (records++ == 0)
+    {
+        due = std::chrono::steady_clock::now() + linger;
+        batchCondition.notify_one();
+    }
+    else if (records == batchLimit)
+    {
+        batchCondition.notify_one();
+    }
+
+    return true;
+}
+
+// A Port that goes away takes its routes with it; a reply that comes
+// for it later is dropped.
+
+void Concentrator::detach(Port &port)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    ports.erase(std::remove(ports.begin(), ports.end(), &port), ports.end());
+    for (auto i = routes.begin(); i != routes.end();)
+    {
+        if (i->second.port == &port)
+        {
+            i = routes.erase(i);
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
+
+// The fail method gives the connection up. It is called with the
+// Concentrator locked.
+
+void Concentrator::fail()
+{
+    lost = true;
+    routes.clear();
+    for (Port *port : ports)
+    {
+        port->fail();
+    }
+    roomCondition.notify_all();
+}
+
+// The send method is the sender's thread. The batch is swapped with
+// a spare buffer before it is sent, so the next batch can gather
+// while this one is on its way, and neither buffer is ever freed.
+
+void Concentrator::send()
+{
+    std::string frame;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping && !lost)
+    {
+        if (records == 0)
+        {
+            batchCondition.wait(lock);
+            continue;
+        }
+        if (records < batchLimit && !flushNow && std::chrono::steady_clock::now() < due)
+        {
+            batchCondition.wait_until(lock, due);
+            continue;
+        }
+
+        frame.swap(batch);
+        batch.clear();
+        records = 0;
+        flushNow = false;
+        roomCondition.notify_all();
+
+        lock.unlock();
+        const bool sent = transport->sendFrame(frame);
+        lock.lock();
+
+        if (!sent)
+        {
+            logEvent(LogComponent::Network, LogLevel::Error, LogEvent::LostBank);
+            fail();
+        }
+    }
+}
+
+// The receive method is the receiver's thread. It hands each reply in
+// a batch to the Port whose request it answers.
+
+void Concentrator::receive()
+{
+    std::string frame;
+
+    while (transport->receiveFrame(frame))
+    {
+        std::string_view rest{frame};
+        std::uint32_t id;
+        std::string_view packet;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        while (nextRecord(rest, id, packet))
+        {
+            const auto found = routes.find(id);
+            if (found == routes.end())
+            {
+                logEvent(LogComponent::Network, LogLevel::Warning, LogEvent::UnroutedAnswer, {}, id);
+                continue;
+            }
+
+            found->second.port->deliver(found->second.tag, packet);
+            routes.erase(found);
+        }
+        if (!rest.empty())
+        {
+            logEvent(LogComponent::Network, LogLevel::Warning, LogEvent::BadReply);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!stopping)
+    {
+        logEvent(LogComponent::Network, LogLevel::Error, LogEvent::LostBank);
+    }
+    fail();
+}
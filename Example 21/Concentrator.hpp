@@ -0,0 +1,101 @@
+// Concentrator.hpp: The header file for the Concentrator class, which
+// lets the ATMs of one process share a single connection to the Bank
+// and ship their requests to it in batches. An ATM's BankProxy sends
+// each Transaction as a frame of its own, so a Fleet of hundreds of
+// ATMs costs the Bank (and the ATMs' host) a system call and a wakeup
+// per request and per reply, however little each frame carries.
+//
+// A Concentrator instead hands each ATM's Network a Port, a Transport
+// that goes no further than the Concentrator. A request sent through
+// a Port is tagged with a correlation ID of the Concentrator's own and
+// added to the batch being gathered. The batch is sent as one frame
+// (see Wire.hpp) once it holds the given number of requests, or once
+// the first request in it has waited the given linger time, whichever
+// comes first; a linger of zero sends whatever has gathered while the
+// previous batch was being sent. The Bank answers with batches too,
+// and the Concentrator hands each reply back to the Port that sent
+// the request, under the tag (if any) that the ATM's Network gave it.
+// Nothing above the Network needs to know: the BankProxy, the ATM and
+// the SessionLoop (which waits on a Port's descriptor) work as they
+// do over a connection of their own.
+//
+// The Concentrator negotiates with the Bank first, asking for tagged,
+// batched frames in the given format, and each ATM's Network then
+// negotiates with its Port, which answers on the Bank's behalf. A
+// Port's Deadline limits how long its Network waits for a reply, as
+// with a SocketTransport. The Networks ask their Ports for tagged
+// frames, so a reply that comes after its Deadline is simply not
+// recognized, and the ATM carries on with its next request. If the
+// connection to the Bank is lost, every Port fails. The Ports must
+// be destroyed before their Concentrator.
+
+#ifndef CONCENTRATOR_HPP
+#define CONCENTRATOR_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "TimerWheel.hpp"
+#include "Wire.hpp"
+
+class Transport;
+
+class Concentrator
+{
+    class Port;
+
+    // A Route says where the reply to a request in flight goes.
+
+    struct Route
+    {
+        Port *port;
+        std::uint32_t tag;
+    };
+
+    std::unique_ptr<Transport> transport;
+    std::chrono::microseconds linger;
+    std::size_t batchLimit;
+    WireFormat format{WireFormat::Ascii};
+    std::string batch;
+    std::size_t records{0};
+    bool flushNow{false};
+    std::chrono::steady_clock::time_point due;
+    std::uint32_t nextId{1};
+    std::unordered_map<std::uint32_t, Route> routes;
+    std::vector<Port *> ports;
+    bool lost{false};
+    bool stopping{false};
+    Deadline stop;
+    std::mutex mutex;
+    std::condition_variable batchCondition;
+    std::condition_variable roomCondition;
+    std::thread sender;
+    std::thread receiver;
+
+public:
+    Concentrator(std::unique_ptr<Transport> &, std::chrono::microseconds, std::size_t);
+    ~Concentrator();
+    Concentrator(const Concentrator &) = delete;
+    Concentrator &operator=(const Concentrator &) = delete;
+
+    bool negotiate(WireFormat);
+    std::unique_ptr<Transport> connect();
+
+private:
+    bool submit(Port &, std::uint32_t, std::string_view);
+    void detach(Port &);
+    void fail();
+    void send();
+    void receive();
+};
+
+#endif
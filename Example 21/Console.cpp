@@ -0,0 +1,159 @@
+// Console.cpp: The source file of the ConsoleInput class, the line
+// reader for the ATM's console.
+
+#include "Console.hpp"
+#include "Log.hpp"
+#include "TimerWheel.hpp"
+
+#include <cerrno>
+
+#include <poll.h>
+#include <unistd.h>
+
+const std::size_t ConsoleReadSize = 4096;
+
+ConsoleInput::ConsoleInput(int f) : fd(f)
+{
+}
+
+ConsoleInput &ConsoleInput::shared()
+{
+    static ConsoleInput console(STDIN_FILENO);
+    return console;
+}
+
+int ConsoleInput::getDescriptor() const
+{
+    return fd;
+}
+
+// The lineReady method tells whether readLine would return at once:
+// a whole line is buffered, or the input has ended. If not, it takes
+// whatever the descriptor has to offer without waiting for more, and
+// looks again.
+
+bool ConsoleInput::lineReady()
+{
+    if (ended || buffer.find('\n', scanned) != std::string::npos)
+    {
+        return true;
+    }
+    scanned = buffer.size();
+
+    pollfd ready{fd, POLLIN, 0};
+    if (::poll(&ready, 1, 0) != 0)
+    {
+        buffer.erase(0, start);
+        scanned -= start;
+        start = 0;
+        take();
+    }
+
+    return ended || buffer.find('\n', scanned) != std::string::npos;
+}
+
+// The readLine method returns the next line, without its end (a
+// newline, or a carriage return and a newline). The view stays valid
+// until the next call. If the input ends in the middle of a line, the
+// method returns what there was of the line and false, as it does
+// (with an empty line) once the input has ended altogether. It also
+// returns false, with an empty line, if the Deadline expires first.
+
+bool ConsoleInput::readLine(std::string_view &line, Deadline *deadline)
+{
+    while (true)
+    {
+        const std::string::size_type end = buffer.find('\n', scanned);
+        if (end != std::string::npos)
+        {
+            line = std::string_view(buffer).substr(start, end - start);
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.remove_suffix(1);
+            }
+            start = end + 1;
+            scanned = start;
+            return true;
+        }
+
+        scanned = buffer.size();
+        if (ended || !fill(deadline))
+        {
+            if (!ended)
+            {
+                line = std::string_view{};
+                return false;
+            }
+
+            line = std::string_view(buffer).substr(start);
+            start = buffer.size();
+            scanned = start;
+            return false;
+        }
+    }
+}
+
+// The fill method drops the lines already handed out and appends
+// whatever the descriptor has to offer, waiting for it if need be.
+// Whoever is prompting has the log flushed first. It returns false
+// at the end of the input, or if the descriptor cannot be read, or if
+// the Deadline expires while it waits.
+
+bool ConsoleInput::fill(Deadline *deadline)
+{
+    buffer.erase(0, start);
+    scanned -= start;
+    start = 0;
+
+    flushLog();
+
+    while (true)
+    {
+        if (deadline != nullptr)
+        {
+            if (!deadline->wait(fd))
+            {
+                ended = !deadline->hasExpired();
+                return false;
+            }
+        }
+        else
+        {
+            pollfd ready{fd, POLLIN, 0};
+            if (::poll(&ready, 1, -1) < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                ended = true;
+                return false;
+            }
+        }
+
+        if (take())
+        {
+            return !ended;
+        }
+    }
+}
+
+// The take method appends what one read of the descriptor gives. It
+// returns false if the read should simply be tried again; otherwise
+// something was read, or the input has ended.
+
+bool ConsoleInput::take()
+{
+    const std::size_t size = buffer.size();
+    buffer.resize(size + ConsoleReadSize);
+    const ssize_t n = ::read(fd, &buffer[size], ConsoleReadSize);
+    buffer.resize(size + (n > 0 ? static_cast<std::size_t>(n) : 0));
+
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+    {
+        return false;
+    }
+
+    ended = n <= 0;
+    return true;
+}
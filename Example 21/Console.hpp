@@ -0,0 +1,57 @@
+// Console.hpp: The header file for the ConsoleInput class, which
+// reads the ATM's console a line at a time. The person at the ATM
+// types whole lines at the Keypad (and, in the Network simulation,
+// the Bank's replies as well), so there is no point in fetching the
+// console one character at a time. A ConsoleInput reads whatever is
+// waiting on the standard input into a buffer that it keeps and
+// reuses, and hands out the lines in it one after another. A piped
+// session is therefore read a buffer at a time, and typing at a
+// terminal works as it always did.
+//
+// The standard input is shared by the Keypad and the Network
+// simulation, so both read it through the one ConsoleInput returned
+// by shared. The descriptor is only read once poll says there is
+// something to read, so a read never blocks (and the file status
+// flags of the descriptor, which the shell may share, are left
+// alone). A read may be given the ATM's Deadline (see
+// TimerWheel.hpp), in which case it gives up once the Deadline
+// expires, leaving whatever part of a line had arrived for the next
+// read. A caller that must not block at all (see SessionLoop.hpp)
+// asks lineReady first, and waits for the descriptor itself.
+
+#ifndef CONSOLE_HPP
+#define CONSOLE_HPP
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Forward references
+class Deadline;
+
+class ConsoleInput
+{
+    int fd;
+    std::string buffer;
+    std::size_t start{0};
+    std::size_t scanned{0};
+    bool ended{false};
+
+    explicit ConsoleInput(int);
+
+public:
+    ConsoleInput(const ConsoleInput &) = delete;
+    ConsoleInput &operator=(const ConsoleInput &) = delete;
+
+    static ConsoleInput &shared();
+
+    int getDescriptor() const;
+    bool lineReady();
+    bool readLine(std::string_view &, Deadline * = nullptr);
+
+private:
+    bool fill(Deadline *);
+    bool take();
+};
+
+#endif
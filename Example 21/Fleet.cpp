@@ -0,0 +1,270 @@
+// Fleet.cpp: The source file of the Fleet class, which multiplexes
+// many ATMs onto a small pool of worker threads, or onto one
+// SessionLoop.
+
+#include "Fleet.hpp"
+#include "Network.hpp"
+#include "Trans.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+// Without a working CardSlotMonitor watch, the dispatcher falls back
+// to looking in every idle ATM's slot, backing off the same way a
+// lone card reader does. With a watch, it still rescans whenever the
+// monitor times out, in case an event was missed.
+
+const std::chrono::milliseconds FirstFleetPoll{1};
+const std::chrono::milliseconds MaxFleetPoll{64};
+const std::chrono::milliseconds FleetRescan{1000};
+
+// No workers means the Fleet's own thread serves every session.
+
+Fleet::Fleet(const std::filesystem::path &c, unsigned int workers) : cardSlots(c), workerCount(workers)
+{
+}
+
+// ATMs must all be added before the Fleet runs. Each ATM's name is
+// the name of the card it accepts, which is how the dispatcher knows
+// whose slot a card was inserted into.
+
+void Fleet::addATM(std::unique_ptr<ATM> &atm)
+{
+    slotByName[atm->getName()] = slots.size();
+    slots.push_back(Slot{std::move(atm)});
+}
+
+// The run method never returns. It greets the customers at every
+// ATM, starts the workers, and then spends the rest of its life
+// dispatching ATMs whose slots have cards in them.
+
+void Fleet::run()
+{
+    for (Slot &slot : slots)
+    {
+        slot.atm->welcome();
+    }
+
+    if (workerCount == 0)
+    {
+        serve();
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < workerCount; ++i)
+    {
+        workers.emplace_back(&Fleet::work, this);
+    }
+
+    std::chrono::milliseconds delay{FirstFleetPoll};
+    std::vector<std::string> arrivals;
+
+    // Cards inserted before the Fleet started produce no events.
+    scan();
+
+    while (true)
+    {
+        arrivals.clear();
+        if (cardSlotMonitor.waitForArrivals(cardSlots, arrivals))
+        {
+            dispatch(arrivals);
+        }
+        else if (scan())
+        {
+            delay = FirstFleetPoll;
+        }
+        else
+        {
+            std::this_thread::sleep_for(delay);
+            delay = std::min(delay * 2, MaxFleetPoll);
+        }
+    }
+}
+
+// The dispatch method notifies the ATMs whose cards arrived. No
+// arrivals at all means the monitor timed out, or lost track, so
+// every slot is looked in.
+
+void Fleet::dispatch(const std::vector<std::string> &arrivals)
+{
+    if (arrivals.empty())
+    {
+        scan();
+    }
+
+    for (const std::string &card : arrivals)
+    {
+        auto found = slotByName.find(card);
+        if (found != slotByName.end())
+        {
+            notify(found->second);
+        }
+    }
+}
+
+// Without workers, notifying an idle ATM starts its session in the
+// loop there and then; it is busy only if there was a card to start
+// a session with.
+
+void Fleet::notify(std::size_t index)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Slot &slot = slots[index];
+    if (slot.busy)
+    {
+        slot.again = true;
+        return;
+    }
+
+    if (loop)
+    {
+        slot.busy = loop->start(*slot.atm);
+        return;
+    }
+
+    slot.busy = true;
+    ready.push_back(index);
+    readyCondition.notify_one();
+}
+
+// The scan method queues every idle ATM with a card in its slot, and
+// returns true if it found any.
+
+bool Fleet::scan()
+{
+    bool found = false;
+
+    for (std::size_t i = 0; i < slots.size(); ++i)
+    {
+        bool busy;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy = slots[i].busy;
+        }
+
+        if (!busy && slots[i].atm->cardPresent())
+        {
+            notify(i);
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+// A worker serves one customer at a time, at whichever ATM is next in
+// line. Only the worker that dequeued an ATM touches it until the ATM
+// is marked idle again, so the ATM itself needs no locking.
+
+void Fleet::work()
+{
+    while (true)
+    {
+        std::size_t index;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            readyCondition.wait(lock, [this]
+                                { return !ready.empty(); });
+            index = ready.front();
+            ready.pop_front();
+        }
+
+        slots[index].atm->serveWaitingCustomer();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        Slot &slot = slots[index];
+        if (slot.again)
+        {
+            slot.again = false;
+            ready.push_back(index);
+            readyCondition.notify_one();
+        }
+        else
+        {
+            slot.busy = false;
+        }
+    }
+}
+
+// The serve method is run's loop when there are no workers. Between
+// polls of the SessionLoop, which waits for the CardSlotMonitor along
+// with the sessions in progress, it starts the sessions of ATMs whose
+// cards arrived, and greets the next customer at those whose sessions
+// are over.
+
+void Fleet::serve()
+{
+    loop = std::make_unique<SessionLoop>();
+    const int notifyFd = cardSlotMonitor.getDescriptor(cardSlots);
+    if (notifyFd >= 0)
+    {
+        loop->watch(notifyFd);
+    }
+
+    std::chrono::milliseconds delay{FirstFleetPoll};
+    std::chrono::steady_clock::time_point nextScan{std::chrono::steady_clock::now() + FleetRescan};
+    std::vector<std::string> arrivals;
+    std::vector<ATM *> finished;
+
+    // Cards inserted before the Fleet started produce no events.
+    scan();
+
+    while (true)
+    {
+        finished.clear();
+        const bool arrived = loop->poll(notifyFd >= 0 ? FleetRescan : delay, finished);
+        for (ATM *atm : finished)
+        {
+            finish(*atm);
+        }
+
+        if (notifyFd >= 0)
+        {
+            arrivals.clear();
+            if (arrived && cardSlotMonitor.waitForArrivals(cardSlots, arrivals) && !arrivals.empty())
+            {
+                dispatch(arrivals);
+            }
+            else if (arrived || std::chrono::steady_clock::now() >= nextScan)
+            {
+                scan();
+                nextScan = std::chrono::steady_clock::now() + FleetRescan;
+            }
+        }
+        else if (scan())
+        {
+            delay = FirstFleetPoll;
+        }
+        else
+        {
+            delay = std::min(delay * 2, MaxFleetPoll);
+        }
+    }
+}
+
+// The finish method greets the next customer at an ATM whose session
+// in the loop is over, and starts the next session at once if a card
+// arrived in the meantime.
+
+void Fleet::finish(ATM &atm)
+{
+    atm.welcome();
+
+    const std::size_t index = slotByName[atm.getName()];
+    bool again;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Slot &slot = slots[index];
+        again = slot.again;
+        slot.again = false;
+        slot.busy = false;
+    }
+
+    if (again)
+    {
+        notify(index);
+    }
+}
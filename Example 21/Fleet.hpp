@@ -0,0 +1,76 @@
+// Fleet.hpp: The header file for the Fleet class, which runs many
+// ATMs in one process. An ATM left to its own activate method keeps a
+// thread to itself for as long as it lives, although it spends almost
+// all of that time waiting for a card. The Fleet instead watches the
+// shared CardSlots directory on behalf of all of its ATMs, and hands
+// an ATM to one of a small pool of worker threads only when a card
+// shows up in that ATM's slot. A hundred ATMs can therefore share a
+// handful of threads, as long as no more than a handful of customers
+// are in the middle of a session at once.
+//
+// With no workers at all, the Fleet serves every session on its own
+// thread instead, with a SessionLoop (see SessionLoop.hpp): it starts
+// the session of an ATM whose card has arrived, and goes on watching
+// for cards while the loop waits for that session's customer and
+// Bank along with everyone else's. The number of customers in the
+// middle of a session is then no longer bounded by the number of
+// threads.
+
+#ifndef FLEET_HPP
+#define FLEET_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Atm.hpp"
+#include "SessionLoop.hpp"
+
+class Fleet
+{
+    // Each ATM is busy from the time it is queued for a worker (or
+    // started in the loop) until its session is over. A card that
+    // arrives for a busy ATM sets again, so that the ATM is queued
+    // once more when it is done.
+
+    struct Slot
+    {
+        std::unique_ptr<ATM> atm;
+        bool busy{false};
+        bool again{false};
+    };
+
+    std::filesystem::path cardSlots;
+    unsigned int workerCount;
+    std::vector<Slot> slots;
+    std::unordered_map<std::string, std::size_t> slotByName;
+    std::deque<std::size_t> ready;
+    std::mutex mutex;
+    std::condition_variable readyCondition;
+    CardSlotMonitor cardSlotMonitor;
+    std::unique_ptr<SessionLoop> loop;
+
+public:
+    Fleet(const std::filesystem::path &, unsigned int);
+    Fleet(const Fleet &) = delete;
+    Fleet &operator=(const Fleet &) = delete;
+
+    void addATM(std::unique_ptr<ATM> &);
+    void run();
+
+private:
+    void dispatch(const std::vector<std::string> &);
+    void notify(std::size_t);
+    bool scan();
+    void work();
+    void serve();
+    void finish(ATM &);
+};
+
+#endif
@@ -0,0 +1,433 @@
+// Journal.cpp: The source file of the Journal class, the Bank's
+// write-ahead log with group commit.
+
+#include "Journal.hpp"
+#include "Bank.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The checksum is 32-bit FNV-1a. It is there to find the end of the
+// Journal after a crash, which may have left a partly written record
+// (or garbage) behind the last complete one, not to stand up to
+// deliberate tampering.
+
+static std::uint32_t checksum(const unsigned char *p, std::size_t length)
+{
+    std::uint32_t hash = 2166136261u;
+    for (std::size_t i = 0; i < length; ++i)
+    {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void encodeRecord(unsigned char *buf, std::uint64_t sequence, std::uint32_t firstKey, std::uint32_t secondKey,
+                         std::int64_t firstCents, std::int64_t secondCents)
+{
+    std::memcpy(buf, &sequence, 8);
+    std::memcpy(buf + 8, &firstKey, 4);
+    std::memcpy(buf + 12, &secondKey, 4);
+    std::memcpy(buf + 16, &firstCents, 8);
+    std::memcpy(buf + 24, &secondCents, 8);
+    const std::uint32_t sum = checksum(buf, 32);
+    std::memcpy(buf + 32, &sum, 4);
+    std::memset(buf + 36, 0, 4);
+}
+
+// The Journal is opened for appending, so that every write lands at
+// its end whatever replay has done to the file offset.
+
+static int openJournal(const std::filesystem::path &file)
+{
+    const int fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(), file.string());
+    }
+    return fd;
+}
+
+static void readAll(int fd, unsigned char *buf, std::size_t length, std::size_t offset)
+{
+    std::size_t have = 0;
+    while (have < length)
+    {
+        const ssize_t n = ::pread(fd, buf + have, length - have, static_cast<off_t>(offset + have));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            throw std::system_error(n < 0 ? errno : EIO, std::generic_category(), "pread");
+        }
+        have += static_cast<std::size_t>(n);
+    }
+}
+
+static std::size_t fileSize(int fd)
+{
+    struct stat status;
+    if (::fstat(fd, &status) < 0)
+    {
+        throw std::system_error(errno, std::generic_category(), "fstat");
+    }
+    return static_cast<std::size_t>(status.st_size);
+}
+
+void writeAll(int fd, const void *data, std::size_t length)
+{
+    const char *p = static_cast<const char *>(data);
+    while (length > 0)
+    {
+        const ssize_t n = ::write(fd, p, length);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            throw std::system_error(n < 0 ? errno : EIO, std::generic_category(), "write");
+        }
+        p += n;
+        length -= static_cast<std::size_t>(n);
+    }
+}
+
+void renameDurably(const std::filesystem::path &from, const std::filesystem::path &to)
+{
+    std::filesystem::rename(from, to);
+
+    const std::filesystem::path directory = to.has_parent_path() ? to.parent_path() : std::filesystem::path(".");
+    const int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || ::fsync(fd) < 0)
+    {
+        const int error = errno;
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        throw std::system_error(error, std::generic_category(), directory.string());
+    }
+    ::close(fd);
+}
+
+Journal::Journal(const std::filesystem::path &file, std::chrono::microseconds w)
+    : path(file), fd(openJournal(file)), window(w)
+{
+    flusher = std::thread(&Journal::flush, this);
+}
+
+// Destroying the Journal flushes whatever is still pending.
+
+Journal::~Journal()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    appendedCondition.notify_one();
+    flusher.join();
+    ::close(fd);
+}
+
+// The replay method restores the balances recorded in the Journal,
+// oldest first, and returns the number of records replayed. Records
+// up to the given sequence number are already in the snapshot the
+// accounts came from, and are skipped. Replay must be done before
+// anything is appended. It stops at the first record that is
+// incomplete, fails its checksum, or is out of sequence; that record
+// and everything after it was never acknowledged to an ATM, and is
+// cut off so that new records follow the last good one. Replay
+// refuses, by throwing, a Journal whose records do not carry on from
+// the snapshot, or that names an account the Bank does not have;
+// either means the Journal belongs to some other Bank.
+
+std::size_t Journal::replay(AccountList &accounts, std::uint64_t after)
+{
+    std::vector<unsigned char> contents(fileSize(fd));
+    readAll(fd, contents.data(), contents.size(), 0);
+
+    std::size_t offset = 0;
+    std::size_t replayed = 0;
+    std::uint64_t sequence = 0;
+    while (offset + JournalRecordSize <= contents.size())
+    {
+        const unsigned char *record = contents.data() + offset;
+        std::uint64_t recordSequence;
+        std::uint32_t keys[2], sum, reserved;
+        std::int64_t cents[2];
+        std::memcpy(&recordSequence, record, 8);
+        std::memcpy(keys, record + 8, 8);
+        std::memcpy(cents, record + 16, 16);
+        std::memcpy(&sum, record + 32, 4);
+        std::memcpy(&reserved, record + 36, 4);
+
+        if (sum != checksum(record, 32) || reserved != 0 || keys[0] == 0 ||
+            (offset > 0 && recordSequence != sequence + 1))
+        {
+            break;
+        }
+
+        if (offset == 0 && (recordSequence == 0 || recordSequence > after + 1))
+        {
+            throw std::runtime_error("the journal does not carry on from the snapshot");
+        }
+
+        if (recordSequence > after)
+        {
+            for (int i = 0; i < 2; ++i)
+            {
+                if (keys[i] != 0 && !accounts.restore(keys[i], Money::fromCents(cents[i])))
+                {
+                    throw std::runtime_error("the journal names an account that does not exist");
+                }
+            }
+            ++replayed;
+        }
+
+        sequence = recordSequence;
+        offset += JournalRecordSize;
+    }
+
+    if (offset < contents.size() && ::ftruncate(fd, static_cast<off_t>(offset)) < 0)
+    {
+        throw std::system_error(errno, std::generic_category(), "ftruncate");
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    appendedSequence = durableSequence = std::max(sequence, after);
+
+    return replayed;
+}
+
+// The append method records the new balance of one account, or of
+// two for a Transfer, and returns the record's sequence number. The
+// caller must still hold the accounts' locks, so that the records of
+// any one account are appended in the order its changes were made.
+// The flusher is woken by the first record of a batch, and again if
+// the batch grows too large to wait out the commit window.
+
+std::uint64_t Journal::append(const Account &first, const Account *second)
+{
+    unsigned char record[JournalRecordSize];
+    std::uint64_t sequence;
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        sequence = ++appendedSequence;
+        encodeRecord(record, sequence, first.getKey(), second != NULL ? second->getKey() : 0,
+                     first.getBalance().getCents(), second != NULL ? second->getBalance().getCents() : 0);
+        pending.insert(pending.end(), record, record + JournalRecordSize);
+        wake = pending.size() == JournalRecordSize || pending.size() == MaxJournalBatch * JournalRecordSize;
+    }
+
+    if (wake)
+    {
+        appendedCondition.notify_one();
+    }
+
+    return sequence;
+}
+
+std::uint64_t Journal::lastSequence()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return appendedSequence;
+}
+
+// The commit method waits until the record with the given sequence
+// number (and so every record before it) is durable. It returns false
+// if the Journal could not be written.
+
+bool Journal::commit(std::uint64_t sequence)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    durableCondition.wait(lock, [this, sequence]
+                          { return failed || durableSequence >= sequence; });
+    return !failed;
+}
+
+bool Journal::healthy()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return !failed;
+}
+
+// The copyRecords function copies the records after the one numbered
+// from through the one numbered to, out of a Journal file whose first
+// record is numbered first, onto the end of another file. The records
+// are numbered consecutively and all the same size, so where they lie
+// follows from their numbers.
+
+static void copyRecords(int from, std::uint64_t first, std::uint64_t after, std::uint64_t through, int to)
+{
+    if (through <= after)
+    {
+        return;
+    }
+
+    const std::size_t skipped = static_cast<std::size_t>(after - first + 1) * JournalRecordSize;
+    std::vector<unsigned char> records(static_cast<std::size_t>(through - after) * JournalRecordSize);
+    readAll(from, records.data(), records.size(), skipped);
+    writeAll(to, records.data(), records.size());
+}
+
+// The discardThrough method drops the records up to the given
+// sequence number, once a snapshot holds their balances. The records
+// kept are copied into a new file in two rounds. The first copies and
+// syncs every record that was durable once those to drop were,
+// without the mutex, while Transactions carry on. The second holds
+// the flusher back (Transactions may still append, but not commit)
+// and copies whatever it wrote in the meantime. Only then is the new
+// file synced again and renamed over the old one, so no record is
+// ever durable in the one file but not in the other. The mutex is held only to read and
+// set the Journal's state, never across a write or a sync. If anything
+// fails, the old Journal stays in place; replay will skip the records
+// the snapshot already holds. Only one thread may discard at a time.
+
+void Journal::discardThrough(std::uint64_t sequence)
+{
+    std::uint64_t copied;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        durableCondition.wait(lock, [this, sequence]
+                              { return failed || durableSequence >= sequence; });
+        if (failed)
+        {
+            return;
+        }
+        copied = durableSequence;
+    }
+
+    // Only this method replaces the file, so it may be read without
+    // the mutex; the flusher only ever adds to it.
+    if (fileSize(fd) < JournalRecordSize)
+    {
+        return;
+    }
+
+    std::uint64_t first;
+    readAll(fd, reinterpret_cast<unsigned char *>(&first), 8, 0);
+    if (first > sequence)
+    {
+        return;
+    }
+
+    std::filesystem::path temporary{path};
+    temporary += ".tmp";
+    const int newFd = ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (newFd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(), temporary.string());
+    }
+
+    try
+    {
+        copyRecords(fd, first, sequence, copied, newFd);
+        if (::fdatasync(newFd) < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), temporary.string());
+        }
+
+        std::uint64_t written;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            replacing = true;
+            durableCondition.wait(lock, [this]
+                                  { return !flushing; });
+            if (failed)
+            {
+                throw std::runtime_error("the journal has failed");
+            }
+            written = durableSequence;
+        }
+
+        copyRecords(fd, first, copied, written, newFd);
+        if (::fdatasync(newFd) < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), temporary.string());
+        }
+        renameDurably(temporary, path);
+    }
+    catch (...)
+    {
+        ::close(newFd);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            replacing = false;
+        }
+        appendedCondition.notify_one();
+        throw;
+    }
+
+    const int oldFd = fd;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        fd = newFd;
+        replacing = false;
+    }
+    appendedCondition.notify_one();
+    ::close(oldFd);
+}
+
+// The flush method is the flusher thread. It writes and syncs a
+// batch without holding the mutex, so Transactions keep appending to
+// the next batch meanwhile. Once a write or sync has failed, nothing
+// more is written, since the records after the failure could no
+// longer be replayed in order.
+
+void Journal::flush()
+{
+    std::vector<unsigned char> batch;
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true)
+    {
+        appendedCondition.wait(lock, [this]
+                               { return stopping || !pending.empty(); });
+        if (pending.empty())
+        {
+            return;
+        }
+
+        appendedCondition.wait_for(lock, window, [this]
+                                   { return stopping || pending.size() >= MaxJournalBatch * JournalRecordSize; });
+        appendedCondition.wait(lock, [this]
+                               { return !replacing; });
+
+        batch.swap(pending);
+        const std::uint64_t sequence = appendedSequence;
+        bool written = !failed;
+        flushing = true;
+        lock.unlock();
+
+        std::size_t done = 0;
+        while (written && done < batch.size())
+        {
+            const ssize_t n = ::write(fd, batch.data() + done, batch.size() - done);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            written = n > 0;
+            done += written ? static_cast<std::size_t>(n) : 0;
+        }
+        written = written && ::fdatasync(fd) == 0;
+        batch.clear();
+
+        lock.lock();
+        failed = failed || !written;
+        flushing = false;
+        durableSequence = sequence;
+        durableCondition.notify_all();
+    }
+}
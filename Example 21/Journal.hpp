@@ -0,0 +1,104 @@
+// Journal.hpp: The header file for the Journal class, the Bank's
+// write-ahead log. The AccountList lives only in memory, so without
+// the Journal a crash of the Bank would lose every balance changed
+// since the accounts file was loaded. Each Transaction that changes
+// an account appends a record of the new balances while it still
+// holds the accounts' locks; the Bank replies to the ATM only once
+// the record is on disk.
+//
+// Flushing the disk for every Transaction would limit the Bank to a
+// few hundred Transactions a second, so the Journal uses group
+// commit. Appending only copies the record into a buffer in memory.
+// A flusher thread writes out whatever has gathered and makes it
+// durable with a single fdatasync, then wakes every thread whose
+// record was in the batch. The commit window is how long the flusher
+// lingers after the first record of a batch arrives, letting more
+// records join it; a longer window means fewer flushes but a longer
+// wait for each Transaction. With a window of zero, records still
+// share a flush whenever they arrive while the previous one is in
+// progress.
+//
+// Once a snapshot holds every balance up to some record (see
+// AccountFile.hpp), discardThrough rewrites the Journal without the
+// records up to that one, and replay skips any that are left over
+// because the Bank stopped in between.
+//
+// A record holds the new balances of the one or two accounts it
+// changed, so replaying the Journal simply overwrites balances, in
+// order. The file is read back only on the machine that wrote it, so
+// its records are laid out in the host's byte order.
+//
+// Record (JournalRecordSize bytes):
+//   0-7    sequence number (one more than the record before)
+//   8-11   first account key
+//   12-15  second account key (0 if only one account changed)
+//   16-23  first account's balance in cents
+//   24-31  second account's balance in cents (0 if unused)
+//   32-35  checksum of bytes 0-31
+//   36-39  reserved, zero
+
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Account;
+class AccountList;
+
+const std::size_t JournalRecordSize = 40;
+
+// The flusher stops waiting out the commit window once a batch holds
+// this many records.
+
+const std::size_t MaxJournalBatch = 4096;
+
+class Journal
+{
+    std::filesystem::path path;
+    int fd;
+    std::chrono::microseconds window;
+    std::vector<unsigned char> pending;
+    std::uint64_t appendedSequence{0};
+    std::uint64_t durableSequence{0};
+    bool failed{false};
+    bool flushing{false};
+    bool replacing{false};
+    bool stopping{false};
+    std::mutex mutex;
+    std::condition_variable appendedCondition;
+    std::condition_variable durableCondition;
+    std::thread flusher;
+
+public:
+    Journal(const std::filesystem::path &, std::chrono::microseconds);
+    ~Journal();
+    Journal(const Journal &) = delete;
+    Journal &operator=(const Journal &) = delete;
+
+    std::size_t replay(AccountList &, std::uint64_t);
+    std::uint64_t append(const Account &, const Account *);
+    std::uint64_t lastSequence();
+    bool commit(std::uint64_t);
+    bool healthy();
+    void discardThrough(std::uint64_t);
+
+private:
+    void flush();
+};
+
+// The writeAll function writes the whole of a buffer, however many
+// writes that takes, and throws if it cannot. The renameDurably
+// function renames a file that has already been synced, and then
+// syncs the directory, so that the rename survives a crash as well.
+
+void writeAll(int, const void *, std::size_t);
+void renameDurably(const std::filesystem::path &, const std::filesystem::path &);
+
+#endif
@@ -0,0 +1,339 @@
+// Latency.cpp: The source file of the ATM's latency histograms and of
+// the LatencyReport that writes them out.
+
+#include "Latency.hpp"
+#include "Wire.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <csignal>
+#include <fstream>
+#include <system_error>
+
+static const char *const PhaseNames[SessionPhaseCount] = {"CardRead", "PinVerify", "GetTransaction", "Preprocess",
+                                                          "BankProcess", "Postprocess", "ReceiptPrint"};
+
+static const char *const KindNames[TransactionKindCount] = {"Withdraw", "Deposit", "Balance", "Transfer"};
+
+// A value of 2^e nanoseconds or more (but less than 2^(e+1)) goes in
+// one of the 2^LatencySubBucketBits buckets of its power of two,
+// chosen by its top LatencySubBucketBits + 1 bits.
+
+static std::size_t bucketOf(std::uint64_t value)
+{
+    const std::uint64_t subBuckets = std::uint64_t{1} << LatencySubBucketBits;
+    if (value < subBuckets)
+    {
+        return static_cast<std::size_t>(value);
+    }
+
+    value = std::min(value, (std::uint64_t{1} << LatencyMaxBits) - 1);
+    unsigned int exponent = LatencySubBucketBits;
+    while ((value >> (exponent + 1)) != 0)
+    {
+        ++exponent;
+    }
+
+    const unsigned int shift = exponent - LatencySubBucketBits;
+    return static_cast<std::size_t>((std::uint64_t{shift} << LatencySubBucketBits) + (value >> shift));
+}
+
+// The highest value that falls in the given bucket.
+
+static std::uint64_t bucketLimit(std::size_t bucket)
+{
+    const std::size_t subBuckets = std::size_t{1} << LatencySubBucketBits;
+    if (bucket < 2 * subBuckets)
+    {
+        return bucket;
+    }
+
+    const unsigned int shift = static_cast<unsigned int>(bucket >> LatencySubBucketBits) - 1;
+    const std::uint64_t sub = bucket - (std::size_t{shift} << LatencySubBucketBits);
+    return ((sub + 1) << shift) - 1;
+}
+
+// Only one thread records into a histogram, so a relaxed load and
+// store are all an increment needs.
+
+void LatencyHistogram::record(std::uint64_t value)
+{
+    std::atomic<std::uint64_t> &count = counts[bucketOf(value)];
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (value > maximum.load(std::memory_order_relaxed))
+    {
+        maximum.store(value, std::memory_order_relaxed);
+    }
+}
+
+// The add method merges another histogram into this one; like record,
+// it must be called only by the thread that records into this one.
+
+void LatencyHistogram::add(const LatencyHistogram &other)
+{
+    for (std::size_t i = 0; i < LatencyBucketCount; ++i)
+    {
+        counts[i].store(counts[i].load(std::memory_order_relaxed) + other.counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    if (other.getMax() > maximum.load(std::memory_order_relaxed))
+    {
+        maximum.store(other.getMax(), std::memory_order_relaxed);
+    }
+}
+
+std::uint64_t LatencyHistogram::count() const
+{
+    std::uint64_t total = 0;
+    for (const std::atomic<std::uint64_t> &c : counts)
+    {
+        total += c.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+// The percentile method returns the highest value of the bucket that
+// holds the given fraction of the recorded values, but never more
+// than the largest value recorded.
+
+std::uint64_t LatencyHistogram::percentile(double fraction) const
+{
+    const std::uint64_t total = count();
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    const std::uint64_t target = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(std::ceil(fraction * static_cast<double>(total))));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < LatencyBucketCount; ++i)
+    {
+        seen += counts[i].load(std::memory_order_relaxed);
+        if (seen >= target)
+        {
+            return std::min(bucketLimit(i), getMax());
+        }
+    }
+
+    return getMax();
+}
+
+std::uint64_t LatencyHistogram::getMax() const
+{
+    return maximum.load(std::memory_order_relaxed);
+}
+
+SessionLatency::SessionLatency(const std::string &n) : name(n)
+{
+}
+
+// The kind is a Transaction's wire type; it is ignored for the phases
+// that do not belong to a Transaction.
+
+void SessionLatency::record(SessionPhase phase, std::uint8_t kind, std::chrono::steady_clock::duration elapsed)
+{
+    const std::uint64_t nanos = static_cast<std::uint64_t>(std::max<std::int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+    phases[static_cast<std::size_t>(phase)].record(nanos);
+
+    if (phase >= SessionPhase::Preprocess && phase <= SessionPhase::Postprocess && kind >= WireWithdraw && kind <= WireTransfer)
+    {
+        kinds[kind - WireWithdraw][static_cast<std::size_t>(phase) - static_cast<std::size_t>(SessionPhase::Preprocess)].record(nanos);
+    }
+}
+
+// Both formats give times in nanoseconds. The text format has one
+// line per phase (and per phase and kind) that has been recorded.
+
+static void writeTextLine(std::ostream &os, const std::string &name, const char *phase, const char *kind, const LatencyHistogram &histogram)
+{
+    const std::uint64_t count = histogram.count();
+    if (count == 0)
+    {
+        return;
+    }
+
+    os << name << ' ' << phase << ' ' << kind << " count=" << count << " p50=" << histogram.percentile(0.5)
+       << " p99=" << histogram.percentile(0.99) << " p999=" << histogram.percentile(0.999) << " max=" << histogram.getMax() << '\n';
+}
+
+void SessionLatency::writeText(std::ostream &os) const
+{
+    for (std::size_t p = 0; p < SessionPhaseCount; ++p)
+    {
+        writeTextLine(os, name, PhaseNames[p], "all", phases[p]);
+    }
+    for (std::size_t k = 0; k < TransactionKindCount; ++k)
+    {
+        for (std::size_t p = 0; p < TransactionPhaseCount; ++p)
+        {
+            writeTextLine(os, name, PhaseNames[p + static_cast<std::size_t>(SessionPhase::Preprocess)], KindNames[k], kinds[k][p]);
+        }
+    }
+}
+
+static void writeJsonHistogram(std::ostream &os, const LatencyHistogram &histogram)
+{
+    os << "{\"count\":" << histogram.count() << ",\"p50\":" << histogram.percentile(0.5) << ",\"p99\":" << histogram.percentile(0.99)
+       << ",\"p999\":" << histogram.percentile(0.999) << ",\"max\":" << histogram.getMax() << '}';
+}
+
+// ATM names are made by the application (ATM1, ATM2, ...), so they
+// need no escaping.
+
+void SessionLatency::writeJson(std::ostream &os) const
+{
+    os << "{\"atm\":\"" << name << "\",\"phases\":{";
+    for (std::size_t p = 0; p < SessionPhaseCount; ++p)
+    {
+        os << (p == 0 ? "\"" : ",\"") << PhaseNames[p] << "\":";
+        writeJsonHistogram(os, phases[p]);
+    }
+    os << "},\"kinds\":{";
+    for (std::size_t k = 0; k < TransactionKindCount; ++k)
+    {
+        os << (k == 0 ? "\"" : ",\"") << KindNames[k] << "\":{";
+        for (std::size_t p = 0; p < TransactionPhaseCount; ++p)
+        {
+            os << (p == 0 ? "\"" : ",\"") << PhaseNames[p + static_cast<std::size_t>(SessionPhase::Preprocess)] << "\":";
+            writeJsonHistogram(os, kinds[k][p]);
+        }
+        os << '}';
+    }
+    os << "}}";
+}
+
+// SIGUSR1 only raises a flag; the reporter thread notices it within
+// a tenth of a second and writes the report.
+
+static std::atomic<bool> reportRequested{false};
+
+static void requestReport(int)
+{
+    reportRequested.store(true, std::memory_order_relaxed);
+}
+
+LatencyReport &LatencyReport::shared()
+{
+    static LatencyReport report;
+    return report;
+}
+
+// The last report is written by the destructor, after every ATM has
+// finished with its histograms.
+
+LatencyReport::~LatencyReport()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    stopCondition.notify_one();
+
+    if (reporter.joinable())
+    {
+        reporter.join();
+        save();
+    }
+}
+
+// The enable method turns recording on for the ATMs built after it,
+// and starts writing reports to the given file every interval (only
+// on SIGUSR1 and at exit, if the interval is zero).
+
+void LatencyReport::enable(const std::filesystem::path &f, std::chrono::seconds i)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (enabled)
+    {
+        return;
+    }
+
+    file = f;
+    interval = i;
+    enabled = true;
+    std::signal(SIGUSR1, requestReport);
+    reporter = std::thread(&LatencyReport::report, this);
+}
+
+// The track method returns the histograms for a new ATM of the given
+// name, or NULL if recording is off.
+
+SessionLatency *LatencyReport::track(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!enabled)
+    {
+        return NULL;
+    }
+
+    sessions.push_back(std::make_unique<SessionLatency>(name));
+    return sessions.back().get();
+}
+
+void LatencyReport::write(std::ostream &os, bool json) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (json)
+    {
+        os << "{\"unit\":\"ns\",\"atms\":[";
+        for (std::size_t i = 0; i < sessions.size(); ++i)
+        {
+            os << (i == 0 ? "" : ",");
+            sessions[i]->writeJson(os);
+        }
+        os << "]}\n";
+    }
+    else
+    {
+        os << "# atm phase kind count p50 p99 p999 max (ns)\n";
+        for (const std::unique_ptr<SessionLatency> &session : sessions)
+        {
+            session->writeText(os);
+        }
+    }
+}
+
+// The save method writes the report beside the file and renames it
+// into place, so that whoever reads the file never sees half a report.
+
+bool LatencyReport::save() const
+{
+    std::filesystem::path temporary{file};
+    temporary += ".tmp";
+    {
+        std::ofstream ofs(temporary, std::ios::trunc);
+        write(ofs, file.extension() == ".json");
+        if (!ofs.flush())
+        {
+            return false;
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temporary, file, error);
+    return !error;
+}
+
+void LatencyReport::report()
+{
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now() + interval;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping)
+    {
+        stopCondition.wait_for(lock, std::chrono::milliseconds(100));
+        const bool requested = reportRequested.exchange(false, std::memory_order_relaxed);
+        const bool due = interval.count() > 0 && std::chrono::steady_clock::now() >= next;
+        if (stopping || (!requested && !due))
+        {
+            continue;
+        }
+
+        if (due)
+        {
+            next = std::chrono::steady_clock::now() + interval;
+        }
+        lock.unlock();
+        save();
+        lock.lock();
+    }
+}
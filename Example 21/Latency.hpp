@@ -0,0 +1,164 @@
+// Latency.hpp: The header file for the ATM's latency histograms. An
+// ATM session goes through the same phases for every customer: the
+// card is read, the PIN is verified, and then, for each Transaction,
+// the SuperKeypad builds it, the Transaction preprocesses it, the
+// BankProxy has the Bank process it, and the Transaction
+// postprocesses it; finally the receipt is printed. The ATM times
+// each phase with a PhaseTimer and records the time in a histogram,
+// one per phase per ATM. The three phases that belong to a
+// Transaction are also recorded per kind of Transaction, since a
+// Transfer and a Balance have little in common once they reach the
+// Bank.
+//
+// A LatencyHistogram is laid out like an HDR histogram: values below
+// 2^LatencySubBucketBits nanoseconds each have a bucket, and every
+// power of two above that is split into 2^LatencySubBucketBits
+// buckets, so a value is known to within about 3% whatever its size.
+// Recording a value costs two clock readings and a few adds to the
+// ATM's own buckets; only the ATM's worker thread ever records into
+// its histograms, so no atomic read-modify-write is needed, and
+// readers see counts that may be a session or so behind.
+//
+// Recording is off unless the process enables the shared
+// LatencyReport before it builds its ATMs. The report owns every
+// ATM's histograms, writes all of them to a file every so often (in
+// text, or in JSON if the file name ends in .json), and again
+// whenever the process receives SIGUSR1, and when the process exits.
+
+#ifndef LATENCY_HPP
+#define LATENCY_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class SessionPhase : std::uint8_t
+{
+    CardRead,
+    PinVerify,
+    GetTransaction,
+    Preprocess,
+    BankProcess,
+    Postprocess,
+    ReceiptPrint,
+    Count
+};
+
+const std::size_t SessionPhaseCount = static_cast<std::size_t>(SessionPhase::Count);
+
+// The phases from Preprocess through Postprocess are also kept per
+// kind of Transaction, indexed by its wire type (see Wire.hpp).
+
+const std::size_t TransactionPhaseCount = 3;
+const std::size_t TransactionKindCount = 4;
+
+const unsigned int LatencySubBucketBits = 5;
+const unsigned int LatencyMaxBits = 38;
+const std::size_t LatencyBucketCount = std::size_t{LatencyMaxBits - LatencySubBucketBits + 1} << LatencySubBucketBits;
+
+class LatencyHistogram
+{
+    std::atomic<std::uint64_t> counts[LatencyBucketCount]{};
+    std::atomic<std::uint64_t> maximum{0};
+
+public:
+    void record(std::uint64_t);
+    void add(const LatencyHistogram &);
+
+    std::uint64_t count() const;
+    std::uint64_t percentile(double) const;
+    std::uint64_t getMax() const;
+};
+
+// A SessionLatency holds the histograms of one ATM.
+
+class SessionLatency
+{
+    std::string name;
+    LatencyHistogram phases[SessionPhaseCount];
+    LatencyHistogram kinds[TransactionKindCount][TransactionPhaseCount];
+
+public:
+    explicit SessionLatency(const std::string &);
+
+    void record(SessionPhase, std::uint8_t, std::chrono::steady_clock::duration);
+    void writeText(std::ostream &) const;
+    void writeJson(std::ostream &) const;
+};
+
+// A PhaseTimer measures consecutive phases: each lap records the time
+// since the previous lap (or since the timer was made) and starts the
+// next phase. Without a SessionLatency, it never reads the clock.
+
+class PhaseTimer
+{
+    SessionLatency *latency;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit PhaseTimer(SessionLatency *l) : latency(l)
+    {
+        if (latency != NULL)
+        {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    void lap(SessionPhase phase, std::uint8_t kind = 0)
+    {
+        if (latency != NULL)
+        {
+            const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            latency->record(phase, kind, now - start);
+            start = now;
+        }
+    }
+
+    void restart()
+    {
+        if (latency != NULL)
+        {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+};
+
+class LatencyReport
+{
+    std::vector<std::unique_ptr<SessionLatency>> sessions;
+    std::filesystem::path file;
+    std::chrono::seconds interval{0};
+    bool enabled{false};
+    bool stopping{false};
+    mutable std::mutex mutex;
+    std::condition_variable stopCondition;
+    std::thread reporter;
+
+    LatencyReport() = default;
+
+public:
+    ~LatencyReport();
+    LatencyReport(const LatencyReport &) = delete;
+    LatencyReport &operator=(const LatencyReport &) = delete;
+
+    static LatencyReport &shared();
+
+    void enable(const std::filesystem::path &, std::chrono::seconds);
+    SessionLatency *track(const std::string &);
+    void write(std::ostream &, bool) const;
+    bool save() const;
+
+private:
+    void report();
+};
+
+#endif
@@ -0,0 +1,628 @@
+// LoadGen.cpp: A closed-loop load generator for the ATM side of the
+// application. It builds a number of ATMs, each driven by an
+// InputScript of synthetic customers: every customer has a card for a
+// random account, types its PIN, and then asks for a few random
+// Transactions, chosen by the given mix of Withdrawals, Deposits,
+// Balances and Transfers, with amounts drawn from the given
+// distribution. Each ATM gets a thread of its own, and serves one
+// customer after another, pacing the sessions so that all of the ATMs
+// together start the target number per second (or as many as they
+// can, if that is more than they manage). With -loop, one thread
+// carries on the sessions of all of the ATMs instead, with a
+// SessionLoop (see SessionLoop.hpp), paced the same way.
+//
+// By default the Bank is the Network simulation, which approves
+// every Transaction from the script at once, so the figures are
+// those of the ATM side alone. With -bank, every ATM connects to the
+// Bank at the given address instead; over a loopback address this
+// measures the whole application on one machine. The -accountsfile
+// option writes an accounts file holding the accounts the customers
+// use, to start that Bank with. With -batch as well, the ATMs share
+// one connection to the Bank through a Concentrator, which sends
+// their requests in batches (see Concentrator.hpp).
+//
+// Usage: loadgen ATMs SessionsPerSecond Seconds [options]
+//        loadgen -accountsfile AccountsFile Accounts
+//
+// Options:
+//   -mix W:D:B:T          relative weights of the kinds of Transaction (40:20:30:10)
+//   -amounts uniform:Min:Max | exponential:Mean
+//                         the distribution of amounts, in dollars (uniform:20:200)
+//   -transactions N       Transactions per session, 1 to MaxTransactionAtm (2)
+//   -accounts N           distinct accounts the customers use (1000)
+//   -badpins Percent      share of customers who get their PIN wrong (0)
+//   -seed N               the random seed (1)
+//   -bank Address [ascii | binary]
+//   -banktimeout Ms       how long an ATM waits for the Bank's answer (for ever)
+//   -batch LingerUs Records
+//                         batch the requests to the Bank (not batched)
+//   -latency ReportFile   per-phase histograms of every ATM (see Latency.hpp)
+//   -loop                 serve every ATM on one thread
+//
+// A SessionsPerSecond of 0 runs every ATM flat out. The results go to
+// the standard output as one line of name=value pairs, in the manner
+// of the transferbench: the session and Transaction throughput, the
+// session latency percentiles (in microseconds, from the customer's
+// card being read to its ejection), and how many Transactions were
+// refused by the Bank or declined by the ATM, how many cards were
+// eaten, and how many sessions the Bank left waiting too long. (The
+// rest of a timed-out customer's keys go to the next customer, who
+// may then get the PIN wrong.) The ATMs' own logging is turned off
+// unless ATM_LOG says otherwise.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Atm.hpp"
+#include "Concentrator.hpp"
+#include "Latency.hpp"
+#include "Log.hpp"
+#include "Network.hpp"
+#include "Script.hpp"
+#include "SessionLoop.hpp"
+#include "Trans.hpp"
+#include "Transport.hpp"
+
+// The customers' accounts are numbered from FirstAccount up, each
+// with a savings and a checking account, all with the same PIN and
+// plenty of money. The ATMs have enough cash never to run out.
+
+const unsigned int FirstAccount = 1000000;
+const char *const LoadPin = "1234";
+const Money OpeningBalance = Money::fromDollars(1000000);
+const unsigned int LoadCash = 1000000000;
+
+// Each ATM's script holds this many customers, and starts over when
+// they have all been served.
+
+const unsigned int CustomersPerScript = 256;
+
+struct LoadOptions
+{
+    unsigned int atms{0};
+    double rate{0};
+    unsigned int seconds{0};
+    unsigned int weights[4]{40, 20, 30, 10};
+    bool exponential{false};
+    double amountMin{20};
+    double amountMax{200};
+    unsigned int transactions{2};
+    unsigned int accounts{1000};
+    unsigned int badPins{0};
+    unsigned int seed{1};
+    const char *bank{NULL};
+    WireFormat format{WireFormat::Binary};
+    std::chrono::milliseconds bankTimeout{0};
+    std::chrono::microseconds batchLinger{0};
+    std::size_t batchRecords{0};
+    const char *latencyFile{NULL};
+    bool loop{false};
+};
+
+static std::string accountNumber(unsigned int index)
+{
+    return std::to_string(FirstAccount + index);
+}
+
+static bool writeAccountsFile(const char *file, unsigned int accounts)
+{
+    std::ofstream ofs(file, std::ios::trunc);
+    for (unsigned int i = 0; i < accounts; ++i)
+    {
+        ofs << accountNumber(i) << "S " << LoadPin << " " << OpeningBalance << '\n';
+        ofs << accountNumber(i) << "C " << LoadPin << " " << OpeningBalance << '\n';
+    }
+
+    if (!ofs.flush())
+    {
+        std::cout << "Cannot write " << file << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// The makeScript function writes CustomersPerScript customers into
+// an ATM's script. A customer with a bad PIN tries it three times
+// (and has the card eaten); the others type their Transactions and
+// then Q. Every Transaction gets an approving reply, for the Network
+// simulation to hand back.
+
+static void makeScript(InputScript &script, const LoadOptions &options, std::mt19937 &random)
+{
+    std::discrete_distribution<int> kind(std::begin(options.weights), std::end(options.weights));
+    std::uniform_int_distribution<unsigned int> account(0, options.accounts - 1);
+    std::uniform_int_distribution<unsigned int> percent(0, 99);
+    std::uniform_int_distribution<int> accountType(0, 1);
+    std::uniform_real_distribution<double> uniform(options.amountMin, options.amountMax);
+    std::exponential_distribution<double> exponential(1.0 / options.amountMax);
+
+    for (unsigned int c = 0; c < CustomersPerScript; ++c)
+    {
+        script.addCard(accountNumber(account(random)) + " " + LoadPin);
+
+        if (percent(random) < options.badPins)
+        {
+            for (int i = 0; i < 4; ++i)
+            {
+                script.addKeys("0000");
+            }
+            continue;
+        }
+
+        script.addKeys(LoadPin);
+        for (unsigned int t = 0; t < options.transactions; ++t)
+        {
+            const double dollars = options.exponential ? exponential(random) : uniform(random);
+            const Money amount = Money::fromCents(std::max<std::int64_t>(1, static_cast<std::int64_t>(dollars * 100)));
+            const char *type = accountType(random) == 0 ? "S" : "C";
+
+            switch (kind(random))
+            {
+            case 0:
+                script.addKeys("W");
+                script.addKeys(type);
+                script.addKeys(amount.toString());
+                break;
+            case 1:
+                script.addKeys("D");
+                script.addKeys(type);
+                script.addKeys(amount.toString());
+                break;
+            case 2:
+                script.addKeys("B");
+                script.addKeys(type);
+                break;
+            default:
+                script.addKeys("T");
+                script.addKeys(type);
+                script.addKeys(amount.toString());
+                script.addKeys(accountNumber(account(random)));
+                script.addKeys(accountType(random) == 0 ? "S" : "C");
+                break;
+            }
+            script.addReply("0001 " + amount.toString());
+        }
+        script.addKeys("Q");
+    }
+}
+
+// As with the ATM's -fleet, an ATM behind a Concentrator asks for
+// tagged frames, so one late batch does not take it out of service.
+
+static std::unique_ptr<Network> connectBank(const LoadOptions &options, InputScript &script, Concentrator *concentrator)
+{
+    if (options.bank == NULL)
+    {
+        return std::make_unique<Network>(script);
+    }
+
+    std::unique_ptr<Network> network;
+    try
+    {
+        std::unique_ptr<Transport> transport{concentrator != NULL ? concentrator->connect() : connectTransport(options.bank)};
+        network = std::make_unique<Network>(transport);
+    }
+    catch (const std::exception &e)
+    {
+        std::cout << "Cannot reach the Bank: " << e.what() << std::endl;
+        return NULL;
+    }
+
+    if (!network->negotiate(options.format, concentrator != NULL))
+    {
+        std::cout << "The Bank did not accept the connection" << std::endl;
+        return NULL;
+    }
+
+    return network;
+}
+
+// Each driver thread serves its ATM's customers until the end of the
+// run. A session that should have started already starts at once,
+// but the driver never tries to catch up on the sessions it missed.
+// Under -loop, the Driver also keeps the time its session started
+// and the time its next one is due.
+
+struct Driver
+{
+    InputScript script;
+    std::unique_ptr<ATM> atm;
+    LatencyHistogram sessionLatency;
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point next;
+};
+
+static void drive(Driver &driver, std::chrono::steady_clock::duration period, std::chrono::steady_clock::time_point end)
+{
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+    while (true)
+    {
+        if (period.count() > 0)
+        {
+            std::this_thread::sleep_until(next);
+            next = std::max(next + period, std::chrono::steady_clock::now());
+        }
+
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (start >= end)
+        {
+            return;
+        }
+
+        if (!driver.atm->serveWaitingCustomer())
+        {
+            driver.script.rewind();
+            continue;
+        }
+
+        const std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+        driver.sessionLatency.record(static_cast<std::uint64_t>(elapsed.count()));
+    }
+}
+
+// The driveLoop function is the one thread of a -loop run. It starts
+// each idle ATM's next session when it falls due, and otherwise polls
+// the SessionLoop until then. The ATMs' first sessions are spread
+// over one period, so that the sessions start at an even rate rather
+// than in a burst every period. Sessions still going at the end of
+// the run are seen through to their end.
+
+static void driveLoop(std::vector<std::unique_ptr<Driver>> &drivers, std::chrono::steady_clock::duration period,
+                      std::chrono::steady_clock::time_point end)
+{
+    typedef std::pair<std::chrono::steady_clock::time_point, std::size_t> Due;
+
+    SessionLoop loop;
+    std::unordered_map<const ATM *, std::size_t> driverByAtm;
+    std::priority_queue<Due, std::vector<Due>, std::greater<Due>> idle;
+    std::vector<ATM *> finished;
+    std::size_t running = 0;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < drivers.size(); ++i)
+    {
+        driverByAtm[drivers[i]->atm.get()] = i;
+        idle.emplace(now + period * i / drivers.size(), i);
+    }
+
+    while (true)
+    {
+        now = std::chrono::steady_clock::now();
+        while (now < end && !idle.empty() && idle.top().first <= now)
+        {
+            const Due due = idle.top();
+            idle.pop();
+
+            Driver &driver = *drivers[due.second];
+            driver.started = std::chrono::steady_clock::now();
+            if (!loop.start(*driver.atm))
+            {
+                driver.script.rewind();
+                idle.emplace(now, due.second);
+                continue;
+            }
+            driver.next = std::max(due.first + period, now);
+            ++running;
+        }
+
+        if (now >= end && running == 0)
+        {
+            return;
+        }
+
+        std::chrono::milliseconds timeout{100};
+        if (now < end && !idle.empty())
+        {
+            timeout = std::min(timeout, std::chrono::ceil<std::chrono::milliseconds>(std::min(idle.top().first, end) - now));
+        }
+
+        finished.clear();
+        loop.poll(timeout, finished);
+
+        now = std::chrono::steady_clock::now();
+        for (ATM *atm : finished)
+        {
+            const std::size_t index = driverByAtm[atm];
+            Driver &driver = *drivers[index];
+            const std::chrono::nanoseconds elapsed = now - driver.started;
+            driver.sessionLatency.record(static_cast<std::uint64_t>(elapsed.count()));
+            idle.emplace(driver.next, index);
+            --running;
+        }
+    }
+}
+
+static bool parseMix(const char *text, unsigned int *weights)
+{
+    unsigned int total = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        char *end;
+        weights[i] = static_cast<unsigned int>(std::strtoul(text, &end, 10));
+        if (end == text || *end != (i < 3 ? ':' : '\0'))
+        {
+            return false;
+        }
+        total += weights[i];
+        text = end + 1;
+    }
+    return total > 0;
+}
+
+static bool parseAmounts(const char *text, LoadOptions &options)
+{
+    char *end;
+    if (std::strncmp(text, "uniform:", 8) == 0)
+    {
+        options.exponential = false;
+        options.amountMin = std::strtod(text + 8, &end);
+        if (*end != ':')
+        {
+            return false;
+        }
+        options.amountMax = std::strtod(end + 1, &end);
+        return *end == '\0' && options.amountMin > 0 && options.amountMax >= options.amountMin;
+    }
+    if (std::strncmp(text, "exponential:", 12) == 0)
+    {
+        options.exponential = true;
+        options.amountMax = std::strtod(text + 12, &end);
+        return *end == '\0' && options.amountMax > 0;
+    }
+    return false;
+}
+
+static bool parseOptions(int argc, char **argv, LoadOptions &options)
+{
+    if (argc < 4)
+    {
+        return false;
+    }
+
+    options.atms = static_cast<unsigned int>(std::atoi(argv[1]));
+    options.rate = std::atof(argv[2]);
+    options.seconds = static_cast<unsigned int>(std::atoi(argv[3]));
+    if (options.atms == 0 || options.rate < 0 || options.seconds == 0)
+    {
+        return false;
+    }
+
+    for (int i = 4; i < argc; ++i)
+    {
+        const bool hasValue = i + 1 < argc;
+        if (std::strcmp(argv[i], "-mix") == 0 && hasValue)
+        {
+            if (!parseMix(argv[++i], options.weights))
+            {
+                return false;
+            }
+        }
+        else if (std::strcmp(argv[i], "-amounts") == 0 && hasValue)
+        {
+            if (!parseAmounts(argv[++i], options))
+            {
+                return false;
+            }
+        }
+        else if (std::strcmp(argv[i], "-transactions") == 0 && hasValue)
+        {
+            options.transactions = static_cast<unsigned int>(std::atoi(argv[++i]));
+            if (options.transactions == 0 || options.transactions > MaxTransactionAtm)
+            {
+                return false;
+            }
+        }
+        else if (std::strcmp(argv[i], "-accounts") == 0 && hasValue)
+        {
+            options.accounts = static_cast<unsigned int>(std::atoi(argv[++i]));
+            if (options.accounts == 0 || options.accounts > 9000000)
+            {
+                return false;
+            }
+        }
+        else if (std::strcmp(argv[i], "-badpins") == 0 && hasValue)
+        {
+            options.badPins = static_cast<unsigned int>(std::atoi(argv[++i]));
+            if (options.badPins > 100)
+            {
+                return false;
+            }
+        }
+        else if (std::strcmp(argv[i], "-seed") == 0 && hasValue)
+        {
+            options.seed = static_cast<unsigned int>(std::atoi(argv[++i]));
+        }
+        else if (std::strcmp(argv[i], "-bank") == 0 && hasValue)
+        {
+            options.bank = argv[++i];
+            if (i + 1 < argc && (std::strcmp(argv[i + 1], "ascii") == 0 || std::strcmp(argv[i + 1], "binary") == 0))
+            {
+                options.format = std::strcmp(argv[++i], "ascii") == 0 ? WireFormat::Ascii : WireFormat::Binary;
+            }
+        }
+        else if (std::strcmp(argv[i], "-banktimeout") == 0 && hasValue)
+        {
+            options.bankTimeout = std::chrono::milliseconds(std::atol(argv[++i]));
+            if (options.bankTimeout.count() < 0)
+            {
+                return false;
+            }
+        }
+        else if (std::strcmp(argv[i], "-batch") == 0 && i + 2 < argc)
+        {
+            options.batchLinger = std::chrono::microseconds(std::atol(argv[++i]));
+            options.batchRecords = static_cast<std::size_t>(std::atol(argv[++i]));
+            if (options.batchLinger.count() < 0 || options.batchRecords == 0)
+            {
+                return false;
+            }
+        }
+        else if (std::strcmp(argv[i], "-latency") == 0 && hasValue)
+        {
+            options.latencyFile = argv[++i];
+        }
+        else if (std::strcmp(argv[i], "-loop") == 0)
+        {
+            options.loop = true;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 4 && std::strcmp(argv[1], "-accountsfile") == 0)
+    {
+        const int accounts = std::atoi(argv[3]);
+        if (accounts <= 0 || accounts > 9000000)
+        {
+            std::cout << "The number of accounts must be from 1 to 9000000" << std::endl;
+            return 1;
+        }
+        return writeAccountsFile(argv[2], static_cast<unsigned int>(accounts)) ? 0 : 1;
+    }
+
+    LoadOptions options;
+    if (!parseOptions(argc, argv, options))
+    {
+        std::cout << "Usage: " << argv[0] << " ATMs SessionsPerSecond Seconds [-mix W:D:B:T]"
+                  << " [-amounts uniform:Min:Max | exponential:Mean] [-transactions N] [-accounts N]"
+                  << " [-badpins Percent] [-seed N] [-bank Address [ascii | binary]] [-banktimeout Ms] [-batch LingerUs Records] [-latency ReportFile] [-loop]" << std::endl;
+        std::cout << "       " << argv[0] << " -accountsfile AccountsFile Accounts" << std::endl;
+        return 1;
+    }
+
+    configureLog("off");
+    const char *logSpec = std::getenv("ATM_LOG");
+    if (logSpec != NULL && !configureLog(logSpec))
+    {
+        std::cout << "Bad ATM_LOG specification: " << logSpec << std::endl;
+        return 1;
+    }
+
+    if (options.latencyFile != NULL)
+    {
+        LatencyReport::shared().enable(options.latencyFile, std::chrono::seconds(0));
+    }
+
+    // The Concentrator must outlive the drivers, whose Networks hold
+    // its Ports.
+    std::unique_ptr<Concentrator> concentrator;
+    if (options.bank != NULL && options.batchRecords > 0)
+    {
+        try
+        {
+            std::unique_ptr<Transport> transport{connectTransport(options.bank)};
+            concentrator = std::make_unique<Concentrator>(transport, options.batchLinger, options.batchRecords);
+        }
+        catch (const std::exception &e)
+        {
+            std::cout << "Cannot reach the Bank: " << e.what() << std::endl;
+            return 1;
+        }
+
+        if (!concentrator->negotiate(options.format))
+        {
+            std::cout << "The Bank did not agree to batching" << std::endl;
+            return 1;
+        }
+    }
+
+    std::mt19937 random(options.seed);
+    std::vector<std::unique_ptr<Driver>> drivers;
+    for (unsigned int i = 1; i <= options.atms; ++i)
+    {
+        drivers.push_back(std::make_unique<Driver>());
+        Driver &driver = *drivers.back();
+        makeScript(driver.script, options, random);
+
+        std::unique_ptr<Network> network{connectBank(options, driver.script, concentrator.get())};
+        if (network == NULL)
+        {
+            return 1;
+        }
+        std::unique_ptr<BankProxy> bankProxy{std::make_unique<BankProxy>(network)};
+        driver.atm = std::make_unique<ATM>(bankProxy, "ATM" + std::to_string(i), LoadCash, driver.script);
+        driver.atm->setTimeouts(std::chrono::milliseconds(0), options.bankTimeout);
+    }
+
+    // Each ATM paces itself to its share of the rate.
+    const std::chrono::steady_clock::duration period =
+        options.rate > 0 ? std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(options.atms / options.rate))
+                         : std::chrono::steady_clock::duration::zero();
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const std::chrono::steady_clock::time_point end = start + std::chrono::seconds(options.seconds);
+    if (options.loop)
+    {
+        driveLoop(drivers, period, end);
+    }
+    else
+    {
+        std::vector<std::thread> threads;
+        for (std::unique_ptr<Driver> &driver : drivers)
+        {
+            threads.emplace_back(drive, std::ref(*driver), period, end);
+        }
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    LatencyHistogram sessionLatency;
+    SessionCounts total;
+    for (const std::unique_ptr<Driver> &driver : drivers)
+    {
+        sessionLatency.add(driver->sessionLatency);
+        const SessionCounts &counts = driver->atm->getCounts();
+        total.sessions += counts.sessions;
+        total.cardsEaten += counts.cardsEaten;
+        total.approved += counts.approved;
+        total.refused += counts.refused;
+        total.declined += counts.declined;
+        total.timedOut += counts.timedOut;
+    }
+
+    const std::uint64_t transactions = total.approved + total.refused + total.declined;
+    std::cout << "atms=" << options.atms
+              << " target_sessions_per_second=" << options.rate
+              << " seconds=" << elapsed.count()
+              << " sessions=" << total.sessions
+              << " sessions_per_second=" << static_cast<std::uint64_t>(total.sessions / elapsed.count())
+              << " transactions=" << transactions
+              << " transactions_per_second=" << static_cast<std::uint64_t>(transactions / elapsed.count())
+              << " p50_us=" << sessionLatency.percentile(0.5) / 1000.0
+              << " p99_us=" << sessionLatency.percentile(0.99) / 1000.0
+              << " p999_us=" << sessionLatency.percentile(0.999) / 1000.0
+              << " max_us=" << sessionLatency.getMax() / 1000.0
+              << " refused=" << total.refused
+              << " declined=" << total.declined
+              << " cards_eaten=" << total.cardsEaten
+              << " timed_out=" << total.timedOut << std::endl;
+
+    return 0;
+}
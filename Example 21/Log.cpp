@@ -0,0 +1,391 @@
+// Log.cpp: The source file of the diagnostic log: the ring buffer
+// the application's threads log into, and the background thread that
+// prints what they logged. This code is compiled into both sides of
+// the application.
+
+#include "Log.hpp"
+#include "Money.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+std::atomic<LogLevel> logThresholds[LogComponentCount] = {LogLevel::Info, LogLevel::Info, LogLevel::Info, LogLevel::Info,
+                                                          LogLevel::Info, LogLevel::Info, LogLevel::Info, LogLevel::Info};
+
+static_assert(LogComponentCount == 8, "every component needs a threshold");
+
+static const char *const ComponentNames[LogComponentCount] = {"display", "cashdispenser", "depositslot", "receiptprinter",
+                                                              "bankproxy", "network", "bank", "bankserver"};
+
+static const char *const LevelNames[] = {"debug", "info", "warning", "error", "off"};
+
+// A record fills two cache lines exactly. Its turn tells producers
+// and the consumer whose turn it is to use the record: a producer may
+// fill the record at ring position p when its turn is p, and the
+// consumer may take it when its turn is p + 1. The consumer then
+// hands it on to position p + LogRingSize. (This is Dmitry Vyukov's
+// bounded queue, with a single consumer.)
+
+const std::size_t LogRingSize = 4096;
+const std::size_t LogTextSize = 109;
+
+struct LogRecord
+{
+    std::atomic<std::uint64_t> turn;
+    std::int64_t number;
+    LogComponent component;
+    LogEvent event;
+    std::uint8_t length;
+    char text[LogTextSize];
+};
+
+static_assert(sizeof(LogRecord) == 128, "a record should fill two cache lines");
+
+// The ring, its positions, and the printing thread live in one
+// Logger, which is made on the first use of the log. Its destructor
+// prints whatever is left when the process exits.
+
+class Logger
+{
+    LogRecord ring[LogRingSize];
+    alignas(64) std::atomic<std::uint64_t> head{0};
+    alignas(64) std::atomic<std::uint64_t> printed{0};
+    std::atomic<std::uint64_t> dropped{0};
+    std::atomic<bool> stopping{false};
+    std::thread printer;
+
+public:
+    Logger();
+    ~Logger();
+    Logger(const Logger &) = delete;
+    Logger &operator=(const Logger &) = delete;
+
+    void write(LogComponent, LogEvent, std::string_view, std::int64_t);
+    void flush();
+
+private:
+    void print();
+};
+
+static std::atomic<Logger *> activeLogger{nullptr};
+
+static Logger &logger()
+{
+    static Logger instance;
+    return instance;
+}
+
+Logger::Logger()
+{
+    for (std::size_t i = 0; i < LogRingSize; ++i)
+    {
+        ring[i].turn.store(i, std::memory_order_relaxed);
+    }
+
+    printer = std::thread(&Logger::print, this);
+    activeLogger.store(this, std::memory_order_release);
+}
+
+Logger::~Logger()
+{
+    activeLogger.store(nullptr, std::memory_order_release);
+    stopping.store(true, std::memory_order_release);
+    printer.join();
+}
+
+// A producer claims the next position by advancing the head, but only
+// once it has seen that the record there is free. If it is not, the
+// ring is full and the record is dropped.
+
+void Logger::write(LogComponent component, LogEvent event, std::string_view text, std::int64_t number)
+{
+    std::uint64_t position = head.load(std::memory_order_relaxed);
+    LogRecord *record;
+
+    while (true)
+    {
+        record = &ring[position % LogRingSize];
+        const std::uint64_t turn = record->turn.load(std::memory_order_acquire);
+        if (turn == position)
+        {
+            if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (turn < position)
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            position = head.load(std::memory_order_relaxed);
+        }
+    }
+
+    record->number = number;
+    record->component = component;
+    record->event = event;
+    record->length = static_cast<std::uint8_t>(std::min(text.size(), LogTextSize));
+    text.copy(record->text, record->length);
+    record->turn.store(position + 1, std::memory_order_release);
+}
+
+// The flush method waits until everything logged before it was
+// called has been printed.
+
+void Logger::flush()
+{
+    const std::uint64_t target = head.load(std::memory_order_acquire);
+    while (printed.load(std::memory_order_acquire) < target)
+    {
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+    }
+}
+
+static void appendNumber(std::string &out, std::int64_t number)
+{
+    char buf[24];
+    const std::to_chars_result result = std::to_chars(buf, buf + sizeof(buf), number);
+    out.append(buf, result.ptr);
+}
+
+// The format function prints one record as the line the application
+// has always printed for it.
+
+static void format(std::string &out, const LogRecord &record)
+{
+    const std::string_view text(record.text, record.length);
+
+    switch (record.event)
+    {
+    case LogEvent::DisplayMessage:
+        out += "@ATM Display@ ";
+        out += text;
+        break;
+    case LogEvent::CashDispensed:
+    {
+        char buf[MoneyMaxChars];
+        const std::to_chars_result result = Money::fromCents(record.number).toChars(buf, buf + sizeof(buf));
+        out += "@CashDispenser@ Giving the user ";
+        out.append(buf, result.ptr);
+        out += " cash";
+        break;
+    }
+    case LogEvent::EnvelopeRetrieved:
+        out += "@DepositSlot@ Getting an envelope from the user";
+        break;
+    case LogEvent::ReceiptPrinted:
+        out += "@@ReceiptPrinter@ Your receipt is as follows:";
+        break;
+    case LogEvent::UnknownAnswer:
+        out += "@BankProxy@ Answer for unknown transaction ";
+        appendNumber(out, record.number);
+        break;
+    case LogEvent::SimulatedRequest:
+        out += "@Network Simulation@ Sending from the ATM to the Bank: '";
+        out += text;
+        out += "'";
+        break;
+    case LogEvent::BadReply:
+        out += "@Network@ Bad packet received at the ATM";
+        break;
+    case LogEvent::LostBank:
+        out += "@Network@ Lost the connection to the Bank";
+        break;
+    case LogEvent::BankTimeout:
+        out += "@Network@ The Bank did not answer in time";
+        break;
+    case LogEvent::ReplyPrompt:
+        out += "@Network Simulation@ Enter Status (4 characters), a space,\nand the account baqlance:";
+        break;
+    case LogEvent::UntaggedReply:
+        out += "@Network@ Untagged packet received at the ATM";
+        break;
+    case LogEvent::BadSimulatedReply:
+        out += "@Network Simulation@ Bad packet recedived at the ATM";
+        break;
+    case LogEvent::UnknownPacketType:
+        out += "@Bank Application@ Unknown packet type!";
+        break;
+    case LogEvent::BadBinaryPacket:
+        out += "@Bank Application@ Bad binary packet!";
+        break;
+    case LogEvent::RequestPrompt:
+        out += "@Network Simulation@ Enter type (4 characters), an account (7 digits),\n"
+               "@Network Simulation@ a space, a PIN (4 characters), a space, and an amount:";
+        break;
+    case LogEvent::UntaggedRequest:
+        out += "@Bank Application@ Untagged packet!";
+        break;
+    case LogEvent::BadRequest:
+        out += "@Bank Application@ Bad packet: ";
+        out += text;
+        break;
+    case LogEvent::SimulatedReply:
+        out += "@Network Simulation@ Packet Sent to ATM: '";
+        out += text;
+        out += "'";
+        break;
+    case LogEvent::NegotiationFailed:
+        out += record.component == LogComponent::BankServer ? "@Bank Server@" : "@Bank@";
+        out += " An ATM failed to negotiate";
+        break;
+    case LogEvent::JournalFailed:
+        out += "@Bank@ The journal cannot be written";
+        break;
+    case LogEvent::EpollFailed:
+        out += "@Bank Server@ epoll_wait failed: ";
+        appendNumber(out, record.number);
+        break;
+    case LogEvent::ServerError:
+        out += "@Bank Server@ ";
+        out += text;
+        break;
+    case LogEvent::CannotWatch:
+        out += "@Bank Server@ Cannot watch a new ATM: ";
+        appendNumber(out, record.number);
+        break;
+    case LogEvent::BadBatch:
+        out += "@Bank Application@ Bad batch!";
+        break;
+    case LogEvent::UnroutedAnswer:
+        out += "@Network@ Batched answer for no waiting ATM: ";
+        appendNumber(out, record.number);
+        break;
+    }
+
+    out += '\n';
+}
+
+// The print method is the printing thread. It takes every record that
+// is ready, prints the lot with one write, and then sleeps for a
+// little longer each time it finds nothing to do.
+
+void Logger::print()
+{
+    std::string out;
+    std::uint64_t tail = 0;
+    std::chrono::microseconds idle{50};
+
+    while (true)
+    {
+        bool found = false;
+        while (true)
+        {
+            LogRecord &record = ring[tail % LogRingSize];
+            if (record.turn.load(std::memory_order_acquire) != tail + 1)
+            {
+                break;
+            }
+
+            format(out, record);
+            record.turn.store(tail + LogRingSize, std::memory_order_release);
+            ++tail;
+            found = true;
+        }
+
+        const std::uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+        if (lost > 0)
+        {
+            out += "@Log@ ";
+            appendNumber(out, static_cast<std::int64_t>(lost));
+            out += " messages were dropped\n";
+        }
+
+        if (!out.empty())
+        {
+            std::fwrite(out.data(), 1, out.size(), stdout);
+            std::fflush(stdout);
+            out.clear();
+        }
+        printed.store(tail, std::memory_order_release);
+
+        if (found)
+        {
+            idle = std::chrono::microseconds(50);
+        }
+        else if (stopping.load(std::memory_order_acquire) && head.load(std::memory_order_acquire) == tail)
+        {
+            return;
+        }
+        else
+        {
+            std::this_thread::sleep_for(idle);
+            idle = std::min(idle * 2, std::chrono::microseconds(2000));
+        }
+    }
+}
+
+// The configureLog function applies a specification (see Log.hpp)
+// from left to right. It returns false, leaving the thresholds as far
+// as it got, if an item names an unknown component or level.
+
+static bool parseLevel(std::string_view name, LogLevel &level)
+{
+    for (std::size_t i = 0; i < sizeof(LevelNames) / sizeof(LevelNames[0]); ++i)
+    {
+        if (name == LevelNames[i])
+        {
+            level = static_cast<LogLevel>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool configureLog(std::string_view spec)
+{
+    while (!spec.empty())
+    {
+        const std::string_view::size_type comma = spec.find(',');
+        const std::string_view item = spec.substr(0, comma);
+        spec = comma == std::string_view::npos ? std::string_view{} : spec.substr(comma + 1);
+
+        const std::string_view::size_type equals = item.find('=');
+        LogLevel level;
+        if (!parseLevel(equals == std::string_view::npos ? item : item.substr(equals + 1), level))
+        {
+            return false;
+        }
+
+        bool matched = equals == std::string_view::npos;
+        for (std::size_t i = 0; i < LogComponentCount; ++i)
+        {
+            if (equals == std::string_view::npos || item.substr(0, equals) == ComponentNames[i])
+            {
+                logThresholds[i].store(level, std::memory_order_relaxed);
+                matched = true;
+            }
+        }
+
+        if (!matched)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void writeLog(LogComponent component, LogEvent event, std::string_view text, std::int64_t number)
+{
+    logger().write(component, event, text, number);
+}
+
+// Flushing a log that was never written to has nothing to wait for,
+// and does not start the Logger.
+
+void flushLog()
+{
+    Logger *active = activeLogger.load(std::memory_order_acquire);
+    if (active != nullptr)
+    {
+        active->flush();
+    }
+}
@@ -0,0 +1,122 @@
+// Log.hpp: The header file for the application's diagnostic log.
+// The simulated devices and the Network used to report everything
+// they did on the console as it happened, and every one of those
+// reports waited for the console. With a Fleet of ATMs (or a busy
+// Bank), the waiting took longer than the work being reported.
+//
+// Reporting something now costs a thread no more than filling in a
+// fixed-size record in a ring buffer: which event happened, and at
+// most one piece of text and one number to go with it. Any number of
+// threads may log at once without taking a lock. A background thread
+// takes the records out of the ring, turns them into the same lines
+// of text the application has always printed, and writes them out a
+// batch at a time. If the ring is ever full, the record is dropped
+// rather than making the thread wait, and the number of dropped
+// records is reported later.
+//
+// Every event belongs to a component and has a severity, and each
+// component has a threshold below which its events are not logged at
+// all. A suppressed event costs one relaxed atomic load and a
+// comparison; an event below LOG_MIN_LEVEL (a compile-time define,
+// 0 for Debug up to 3 for Error) is not even compiled in. The
+// thresholds are set with a specification such as
+//
+//   warning,display=info,network=off
+//
+// where a bare level applies to every component and name=level
+// applies to one. By default, every component logs Info and above,
+// which prints what the application always printed.
+//
+// Whoever is about to read from the console calls flushLog first, so
+// that the prompts of the simulation are not still sitting in the
+// ring while the user is expected to answer them.
+
+#ifndef LOG_HPP
+#define LOG_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+enum class LogLevel : std::uint8_t
+{
+    Debug,
+    Info,
+    Warning,
+    Error,
+    Off
+};
+
+enum class LogComponent : std::uint8_t
+{
+    Display,
+    CashDispenser,
+    DepositSlot,
+    ReceiptPrinter,
+    BankProxy,
+    Network,
+    Bank,
+    BankServer,
+    Count
+};
+
+// Each event is printed by its own format (see Log.cpp), from the
+// text and number logged with it.
+
+enum class LogEvent : std::uint8_t
+{
+    DisplayMessage,
+    CashDispensed,
+    EnvelopeRetrieved,
+    ReceiptPrinted,
+    UnknownAnswer,
+    SimulatedRequest,
+    BadReply,
+    LostBank,
+    BankTimeout,
+    ReplyPrompt,
+    UntaggedReply,
+    BadSimulatedReply,
+    UnknownPacketType,
+    BadBinaryPacket,
+    RequestPrompt,
+    UntaggedRequest,
+    BadRequest,
+    SimulatedReply,
+    NegotiationFailed,
+    JournalFailed,
+    EpollFailed,
+    ServerError,
+    CannotWatch,
+    BadBatch,
+    UnroutedAnswer
+};
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+const std::size_t LogComponentCount = static_cast<std::size_t>(LogComponent::Count);
+
+extern std::atomic<LogLevel> logThresholds[LogComponentCount];
+
+bool configureLog(std::string_view);
+void writeLog(LogComponent, LogEvent, std::string_view, std::int64_t);
+void flushLog();
+
+inline bool logEnabled(LogComponent component, LogLevel level)
+{
+    return level >= static_cast<LogLevel>(LOG_MIN_LEVEL) &&
+           level >= logThresholds[static_cast<std::size_t>(component)].load(std::memory_order_relaxed);
+}
+
+inline void logEvent(LogComponent component, LogLevel level, LogEvent event, std::string_view text = {}, std::int64_t number = 0)
+{
+    if (logEnabled(component, level))
+    {
+        writeLog(component, event, text, number);
+    }
+}
+
+#endif
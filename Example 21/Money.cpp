@@ -0,0 +1,136 @@
+// Money.cpp: The text conversions of the Money class. This code is
+// compiled into both sides of the application.
+
+#include "Money.hpp"
+
+#include <cstring>
+#include <limits>
+
+// The digits are produced from the right into a scratch buffer, so
+// that the length is known before anything is copied to the caller.
+// The magnitude is taken as unsigned so that the most negative
+// amount does not overflow.
+
+std::to_chars_result Money::toChars(char *first, char *last) const
+{
+    const bool negative = cents < 0;
+    std::uint64_t magnitude = negative ? 0 - static_cast<std::uint64_t>(cents) : static_cast<std::uint64_t>(cents);
+
+    char buf[MoneyMaxChars];
+    char *p = buf + sizeof(buf);
+    *--p = static_cast<char>('0' + magnitude % 10);
+    magnitude /= 10;
+    *--p = static_cast<char>('0' + magnitude % 10);
+    magnitude /= 10;
+    *--p = '.';
+    do
+    {
+        *--p = static_cast<char>('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (negative)
+    {
+        *--p = '-';
+    }
+
+    const std::size_t length = static_cast<std::size_t>(buf + sizeof(buf) - p);
+    if (static_cast<std::size_t>(last - first) < length)
+    {
+        return {last, std::errc::value_too_large};
+    }
+
+    std::memcpy(first, p, length);
+    return {first + length, std::errc{}};
+}
+
+static bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// On failure the value is left alone, as std::from_chars does. An
+// amount too large for the representation is reported as
+// result_out_of_range, with the pointer past all of its digits.
+
+std::from_chars_result Money::fromChars(const char *first, const char *last, Money &value)
+{
+    const char *p = first;
+    const bool negative = p != last && *p == '-';
+    if (negative)
+    {
+        ++p;
+    }
+
+    const std::uint64_t limit = static_cast<std::uint64_t>(std::numeric_limits<std::int64_t>::max());
+    const char *digits = p;
+    std::uint64_t units = 0;
+    bool overflow = false;
+
+    while (p != last && isDigit(*p))
+    {
+        units = units * 10 + static_cast<std::uint64_t>(*p - '0');
+        overflow = overflow || units > limit / 100;
+        ++p;
+    }
+
+    if (p == digits)
+    {
+        return {first, std::errc::invalid_argument};
+    }
+
+    std::uint64_t fraction = 0;
+    if (p != last && *p == '.')
+    {
+        ++p;
+        for (unsigned int decimals = 0; decimals < 2; ++decimals)
+        {
+            fraction *= 10;
+            if (p != last && isDigit(*p))
+            {
+                fraction += static_cast<std::uint64_t>(*p - '0');
+                ++p;
+            }
+        }
+    }
+
+    const std::uint64_t magnitude = units * 100 + fraction;
+    if (overflow || magnitude > limit)
+    {
+        while (p != last && isDigit(*p))
+        {
+            ++p;
+        }
+        return {p, std::errc::result_out_of_range};
+    }
+
+    const std::int64_t signedMagnitude = static_cast<std::int64_t>(magnitude);
+    value = Money(negative ? -signedMagnitude : signedMagnitude);
+    return {p, std::errc{}};
+}
+
+bool Money::parse(std::string_view text, Money &value)
+{
+    Money parsed;
+    const std::from_chars_result result = fromChars(text.data(), text.data() + text.size(), parsed);
+    if (result.ec != std::errc{} || result.ptr != text.data() + text.size())
+    {
+        return false;
+    }
+
+    value = parsed;
+    return true;
+}
+
+std::string Money::toString() const
+{
+    char buf[MoneyMaxChars];
+    const std::to_chars_result result = toChars(buf, buf + sizeof(buf));
+    return std::string(buf, result.ptr);
+}
+
+std::ostream &operator<<(std::ostream &stream, Money amount)
+{
+    char buf[MoneyMaxChars];
+    const std::to_chars_result result = amount.toChars(buf, buf + sizeof(buf));
+    return stream.write(buf, result.ptr - buf);
+}
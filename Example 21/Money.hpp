@@ -0,0 +1,124 @@
+// Money.hpp: The header file for the Money class, the one way an
+// amount of money is represented anywhere in the application. A
+// Money value is a whole number of cents in a 64-bit integer, so
+// that adding up deposits and withdrawals never rounds, and so that
+// "0.10" means ten cents rather than the nearest double to it.
+//
+// The text form is an optional minus sign, one or more digits, and
+// optionally a decimal point followed by at most two decimals (no
+// exponents, no grouping, and no dependence on the locale). The
+// conversions follow std::to_chars and std::from_chars: they work on
+// a caller's buffer, never allocate, and report failure through the
+// returned std::errc.
+
+#ifndef MONEY_HPP
+#define MONEY_HPP
+
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+class Money
+{
+    std::int64_t cents{0};
+
+    constexpr explicit Money(std::int64_t c) : cents(c)
+    {
+    }
+
+public:
+    constexpr Money() = default;
+
+    static constexpr Money fromCents(std::int64_t c)
+    {
+        return Money(c);
+    }
+
+    static constexpr Money fromDollars(std::int64_t d)
+    {
+        return Money(d * 100);
+    }
+
+    constexpr std::int64_t getCents() const
+    {
+        return cents;
+    }
+
+    constexpr bool isNegative() const
+    {
+        return cents < 0;
+    }
+
+    constexpr Money &operator+=(Money other)
+    {
+        cents += other.cents;
+        return *this;
+    }
+
+    constexpr Money &operator-=(Money other)
+    {
+        cents -= other.cents;
+        return *this;
+    }
+
+    friend constexpr Money operator+(Money a, Money b)
+    {
+        return Money(a.cents + b.cents);
+    }
+
+    friend constexpr Money operator-(Money a, Money b)
+    {
+        return Money(a.cents - b.cents);
+    }
+
+    friend constexpr bool operator==(Money a, Money b)
+    {
+        return a.cents == b.cents;
+    }
+
+    friend constexpr bool operator!=(Money a, Money b)
+    {
+        return a.cents != b.cents;
+    }
+
+    friend constexpr bool operator<(Money a, Money b)
+    {
+        return a.cents < b.cents;
+    }
+
+    friend constexpr bool operator<=(Money a, Money b)
+    {
+        return a.cents <= b.cents;
+    }
+
+    friend constexpr bool operator>(Money a, Money b)
+    {
+        return a.cents > b.cents;
+    }
+
+    friend constexpr bool operator>=(Money a, Money b)
+    {
+        return a.cents >= b.cents;
+    }
+
+    // The toChars method always writes two decimals. fromChars stops
+    // at the first character that cannot continue an amount; parse
+    // insists that the whole string is one.
+
+    std::to_chars_result toChars(char *, char *) const;
+    static std::from_chars_result fromChars(const char *, const char *, Money &);
+    static bool parse(std::string_view, Money &);
+    std::string toString() const;
+};
+
+// The longest text form is that of the most negative amount,
+// "-92233720368547758.08".
+
+const std::size_t MoneyMaxChars = 21;
+
+std::ostream &operator<<(std::ostream &, Money);
+
+#endif
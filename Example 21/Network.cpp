@@ -5,10 +5,73 @@
 // Each side of the network class has both a send and receive pair,
 // which match the formats of the corresponding application side.
 
-#include "network.hpp"
-#include "trans.hpp"
+#include "Console.hpp"
+#include "Log.hpp"
+#include "Network.hpp"
+#include "Packet.hpp"
+#include "Script.hpp"
+#include "TimerWheel.hpp"
+#include "Trans.hpp"
+#include "Transport.hpp"
 
+#include <charconv>
+#include <cstdlib>
 #include <iostream>
+#include <string>
+#include <string_view>
+
+#include <poll.h>
+
+// A Network without a Transport runs the console simulation; one
+// with a Transport ships length-prefixed frames through it.
+
+Network::Network()
+{
+}
+
+Network::Network(std::unique_ptr<Transport> &t)
+{
+    transport = std::move(t);
+}
+
+#ifdef ATM_SIDE
+Network::Network(InputScript &s) : script(&s)
+{
+}
+#endif
+
+Network::~Network()
+{
+}
+
+WireFormat Network::getFormat() const
+{
+    return format;
+}
+
+bool Network::isTagged() const
+{
+    return tagged;
+}
+
+bool Network::isBatched() const
+{
+    return batched;
+}
+
+// Binary packets are built in small arrays on the stack; these
+// helpers let them be handed to (and taken from) the Transport
+// without copying.
+
+static std::string_view asFrame(const unsigned char *buf, std::size_t length)
+{
+    return std::string_view(reinterpret_cast<const char *>(buf), length);
+}
+
+static const unsigned char *asBytes(const std::string &frame)
+{
+    return reinterpret_cast<const unsigned char *>(frame.data());
+}
 
 // The send method, which takes a Transaction, is used by the ATM
 // side of the application to send a transaction to the Bank side of
@@ -22,21 +85,175 @@
 // record, e.g. the Transfer transaction adds the target account
 // to the end of the string for later retrieval by the Network::receive()
 // method below (which takes zero arguments).
-// In this simulation, the method simply prints the packet it would
+// In the simulation, the method simply prints the packet it would
 // send through the reader's favorite mechanism.
 
 #ifdef ATM_SIDE
 
+// The Deadline is handed down to the Transport, which does the
+// waiting. The console simulation waits on the console itself, and
+// a script never keeps anyone waiting.
+
+void Network::setDeadline(Deadline *d)
+{
+    deadline = d;
+    if (transport)
+    {
+        transport->setDeadline(d);
+    }
+}
+
+// The getDescriptor method says what to wait on for the Bank's answer
+// (-1 if there is nothing to wait on), and answerReady tells whether
+// receive would return without waiting. A script always has its reply
+// ready, and a lost connection fails at once.
+
+int Network::getDescriptor() const
+{
+    if (transport)
+    {
+        return transport->getDescriptor();
+    }
+    return script != nullptr ? -1 : ConsoleInput::shared().getDescriptor();
+}
+
+bool Network::answerReady()
+{
+    if (lost || script != nullptr)
+    {
+        return true;
+    }
+    if (!transport)
+    {
+        return ConsoleInput::shared().lineReady();
+    }
+
+    pollfd ready{transport->getDescriptor(), POLLIN, 0};
+    return ready.fd < 0 || ::poll(&ready, 1, 0) != 0;
+}
+
+// The negotiate method is the ATM's half of connection setup. The ATM
+// proposes a packet format and the Bank answers with the one it will
+// use; a Bank that does not speak the ATM's binary version answers
+// with the ASCII format. The ATM may also ask for tagged frames,
+// which BankProxy needs in order to pipeline requests. The console
+// simulation only understands untagged ASCII; a script's replies can
+// be tagged as well (see Script.hpp). The method returns false if the
+// Bank does not answer with a valid hello frame.
+
+bool Network::negotiate(WireFormat proposed, bool tagging)
+{
+    format = WireFormat::Ascii;
+    tagged = false;
+
+    if (!transport)
+    {
+        tagged = tagging && script != nullptr;
+        return true;
+    }
+
+    unsigned char hello[WireHelloSize];
+    encodeHello(proposed, tagging ? WireTagged : 0, hello);
+    if (!transport->sendFrame(asFrame(hello, sizeof(hello))) || !transport->receiveFrame(frame))
+    {
+        return false;
+    }
+
+    WireFormat accepted;
+    std::uint8_t version;
+    std::uint8_t options;
+    if (!decodeHello(asBytes(frame), frame.size(), accepted, version, options))
+    {
+        return false;
+    }
+
+    if (accepted == WireFormat::Binary && version != WireVersion)
+    {
+        return false;
+    }
+
+    format = accepted;
+    tagged = (options & WireTagged) != 0;
+    return true;
+}
+
 bool Network::send(const Transaction &t)
 {
+    return send(t, 0);
+}
+
+// When frames are tagged, the correlation ID goes in front of the
+// packet; otherwise it is ignored.
+
+bool Network::send(const Transaction &t, std::uint32_t id)
+{
+    if (lost)
+    {
+        return false;
+    }
+
+    if (transport && format == WireFormat::Binary)
+    {
+        WireRequest request;
+        t.packetize(request);
+
+        unsigned char buf[WireTagSize + WireRequestSize];
+        const std::size_t skip = tagged ? 0 : WireTagSize;
+        encodeTag(id, buf);
+        encodeRequest(request, buf + WireTagSize);
+
+        return transport->sendFrame(asFrame(buf + skip, sizeof(buf) - skip));
+    }
+
     std::string buffer{t.packetize()};
-    std::cout << "@Network Simulation@ Sending from the ATM to the Bank: '" << buffer << "'" << std::endl;
+
+    if (transport)
+    {
+        if (tagged)
+        {
+            unsigned char tag[WireTagSize];
+            encodeTag(id, tag);
+            buffer.insert(0, reinterpret_cast<const char *>(tag), sizeof(tag));
+        }
+
+        return transport->sendFrame(buffer);
+    }
+
+    if (tagged)
+    {
+        buffer.insert(0, std::to_string(id) + ' ');
+    }
+
+    logEvent(LogComponent::Network, LogLevel::Info, LogEvent::SimulatedRequest, buffer);
 
     // The reader would not send this string through their favorite
     // byte sending mechanism.
     return true;
 }
 
+// A binary reply carries the amount as whole cents. It is handed to
+// the Transaction's update method in the same text form the ASCII
+// reply uses, so Transactions need not care which format was used.
+
+static std::string receiveBinary(std::string_view buffer, int &status)
+{
+    WireReply reply;
+    if (!decodeReply(reinterpret_cast<const unsigned char *>(buffer.data()), buffer.size(), reply))
+    {
+        logEvent(LogComponent::Network, LogLevel::Warning, LogEvent::BadReply);
+        status = 0;
+        return std::string{};
+    }
+
+    status = reply.status;
+    if ((reply.flags & WireHasAmount) == 0)
+    {
+        return std::string{};
+    }
+
+    return reply.amount.toString();
+}
+
 // The receive method for the Network class on the ATM side of the
 // application waits for a buffer to be sent from the Bank. This
 // buffer is expected to have the return status (0 or 1) in the first
@@ -48,6 +265,24 @@ bool Network::send(const Transaction &t)
 // field.
 
 std::string Network::receive(int &status)
+{
+    std::uint32_t id;
+    std::string info;
+
+    if (!receive(status, id, info))
+    {
+        logEvent(LogComponent::Network, LogLevel::Error, LogEvent::LostBank);
+        status = 0;
+    }
+
+    return info;
+}
+
+// The second form of receive also reports the correlation ID of the
+// reply (zero if frames are not tagged). It returns false only if the
+// connection to the Bank is gone, or if the Deadline expired first.
+
+bool Network::receive(int &status, std::uint32_t &id, std::string &info)
 {
     // The reader would place his or her favorite byte-exchange
     // mechanism here and ask it to receive a byte string from the Bank
@@ -56,86 +291,305 @@ std::string Network::receive(int &status)
     // of transaction-specific inforamtion. In this simulation, the
     // balance of the account is passed as additional information.
 
-    std::cout << "@Network Simulation@ Enter Status (4 characters), a space," << std::endl;
-    std::cout << "and the account baqlance:" << std::endl;
-    std::string buffer;
-    std::getline(std::cin, buffer);
+    id = 0;
+    info.clear();
+
+    if (lost)
+    {
+        return false;
+    }
+
+    if (transport)
+    {
+        if (!transport->receiveFrame(frame))
+        {
+            if (deadline != nullptr && deadline->hasExpired())
+            {
+                logEvent(LogComponent::Network, LogLevel::Warning, LogEvent::BankTimeout);
+                lost = !tagged;
+            }
+            return false;
+        }
+    }
+    else if (script != nullptr)
+    {
+        // A script that has run out of replies is as good as a lost
+        // connection.
+        if (!script->getReply(frame))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        logEvent(LogComponent::Network, LogLevel::Info, LogEvent::ReplyPrompt);
+        std::string_view line;
+        if (!ConsoleInput::shared().readLine(line, deadline) && deadline != nullptr && deadline->hasExpired())
+        {
+            logEvent(LogComponent::Network, LogLevel::Warning, LogEvent::BankTimeout);
+            return false;
+        }
+        frame = line;
+    }
+
+    std::string_view buffer{frame};
+
+    if (tagged && !transport)
+    {
+        // A script gives the correlation ID in decimal, and a space.
+        const std::string_view::size_type space = buffer.find(' ');
+        if (space == std::string_view::npos ||
+            std::from_chars(buffer.data(), buffer.data() + space, id).ptr != buffer.data() + space)
+        {
+            logEvent(LogComponent::Network, LogLevel::Warning, LogEvent::UntaggedReply);
+            status = 0;
+            return true;
+        }
+        buffer.remove_prefix(space + 1);
+    }
+    else if (tagged)
+    {
+        if (buffer.size() < WireTagSize)
+        {
+            logEvent(LogComponent::Network, LogLevel::Warning, LogEvent::UntaggedReply);
+            status = 0;
+            return true;
+        }
+        id = decodeTag(asBytes(frame));
+        buffer.remove_prefix(WireTagSize);
+    }
+
+    if (transport && format == WireFormat::Binary)
+    {
+        info = receiveBinary(buffer, status);
+        return true;
+    }
+
     if (buffer.size() == 4)
     {
-        status = std::atoi(buffer.c_str());
-        return std::string{};
+        status = std::atoi(std::string{buffer}.c_str());
     }
-    else if (buffer.substr(4, 1) == " ")
+    else if (buffer.size() > 4 && buffer[4] == ' ')
     {
-        status = std::atoi(buffer.c_str());
-        return buffer.substr(5);
+        status = std::atoi(std::string{buffer.substr(0, 4)}.c_str());
+        info = buffer.substr(5);
     }
     else
     {
-        // TODO: Throw BadPacket exception?
-        std::cout << "@Network Simulation@ Bad packet recedived at the ATM" << std::endl;
-        status = 1;
+        // A reply that cannot be made out approves nothing, as with
+        // a bad binary reply.
+        logEvent(LogComponent::Network, LogLevel::Warning,
+                 transport ? LogEvent::BadReply : LogEvent::BadSimulatedReply);
+        status = 0;
     }
 
-    return std::string{};
+    return true;
 }
 
 #endif
 
 #ifdef BANK_SIDE
 
+// The negotiate method is the Bank's half of connection setup. It
+// waits for the ATM's hello frame and agrees to the binary format
+// only if the ATM speaks the same binary version. Tagged frames are
+// always agreed to if asked for, and so are batched ones, as long as
+// they are tagged too.
+
+bool Network::negotiate()
+{
+    format = WireFormat::Ascii;
+    tagged = false;
+    batched = false;
+
+    if (!transport)
+    {
+        return true;
+    }
+
+    WireFormat proposed;
+    std::uint8_t version;
+    std::uint8_t options;
+    if (!transport->receiveFrame(frame) || !decodeHello(asBytes(frame), frame.size(), proposed, version, options))
+    {
+        return false;
+    }
+
+    if (proposed == WireFormat::Binary && version == WireVersion)
+    {
+        format = WireFormat::Binary;
+    }
+    tagged = (options & WireTagged) != 0;
+    batched = tagged && (options & WireBatched) != 0;
+    cursor = frame.size();
+
+    unsigned char hello[WireHelloSize];
+    encodeHello(format, static_cast<std::uint8_t>((tagged ? WireTagged : 0) | (batched ? WireBatched : 0)), hello);
+
+    return transport->sendFrame(asFrame(hello, sizeof(hello)));
+}
+
+// Both packet formats are reduced to the same fields, from which
+// the Transaction is built. The explicit case analysis on the type
+// of the transaction is necessary due to the absence of an
+// object-oriented network.
+
+static std::unique_ptr<Transaction> buildTransaction(std::uint8_t type, std::string_view account, std::string_view pin,
+                                                     Money amount, std::string_view targetAccount)
+{
+    switch (type)
+    {
+    case WireWithdraw:
+        return std::make_unique<Withdraw>(account, pin, amount);
+    case WireDeposit:
+        return std::make_unique<Deposit>(account, pin, amount);
+    case WireBalance:
+        return std::make_unique<Balance>(account, pin);
+    case WireTransfer:
+        return std::make_unique<Transfer>(account, pin, targetAccount, amount);
+    default:
+        logEvent(LogComponent::Network, LogLevel::Warning, LogEvent::UnknownPacketType);
+        return NULL;
+    }
+}
+
+// A binary request is decoded into its packed fields, whose digits
+// are unpacked into small buffers on the stack.
+
+static std::unique_ptr<Transaction> receiveBinary(std::string_view buffer)
+{
+    WireRequest request;
+    if (!decodeRequest(reinterpret_cast<const unsigned char *>(buffer.data()), buffer.size(), request))
+    {
+        logEvent(LogComponent::Network, LogLevel::Warning, LogEvent::BadBinaryPacket);
+        return NULL;
+    }
+
+    char account[8];
+    unpackDigits(request.account, 7, account);
+    account[7] = request.accountType;
+
+    char target[8];
+    unpackDigits(request.targetAccount, 7, target);
+    target[7] = request.targetType;
+
+    char pin[4];
+    unpackDigits(request.pin, 4, pin);
+
+    return buildTransaction(request.type, std::string_view(account, sizeof(account)), std::string_view(pin, sizeof(pin)),
+                            request.amount, std::string_view(target, sizeof(target)));
+}
+
 // The receive method on the Bank side of the application receives
-// a striong of the byte-transfer mechanism (in this case, a string
-// typed by the user). The string is then parsed by the Network
-// class, and an appropriate Transaction object is built. The
-// explicit case analysis on the type of the transaction is
-// necessary due to th e absence of an object-oriented network. The
+// a striong of the byte-transfer mechanism (in the simulation, a
+// string typed by the user). The string is then parsed by the
+// Network class, and an appropriate Transaction object is built. The
 // Network class provides the object-oriented interface so that
 // the rest of our model sees nothing but objercts. The case analysis
 // is hidden within this method.
 
-std::unique_ptr<Transaction> *Network::receive()
+std::unique_ptr<Transaction> Network::receive()
 {
-    // The reader may replace this call to getline with any
-    // appropriate byte-transfer mechanism.
+    std::uint32_t id;
+    return receive(id);
+}
 
-    std::cout << "@Network Simulation@ Enter type (4 characters), an account (7 digits)," << std::endl;
-    std::cout << "@Network Simulation@ a space, a PIN (4 characters), a space, and an amount:" << std::endl;
-    std::string buffer;
-    std::getline(std::cin, buffer);
+// The second form of receive also reports the correlation ID of the
+// request (zero if frames are not tagged), which must be handed back
+// with the reply.
 
-    // We parse the string by turning the whitespace into NULL
-    // terminators. We then build the appropriate object denoted by
-    // the first four characters of the buffer. This is the inverse
-    // routine for the send method on the ATM side of the application.
+std::unique_ptr<Transaction> Network::receive(std::uint32_t &id)
+{
+    std::unique_ptr<Transaction> transaction;
+    receive(id, transaction);
+    return transaction;
+}
+
+// The third form tells a packet that could not be understood (the
+// Transaction is NULL, and the ATM should be sent a refusal) from a
+// connection that is gone (the method returns false).
+
+bool Network::receive(std::uint32_t &id, std::unique_ptr<Transaction> &transaction)
+{
+    // Without a Transport, the packet is typed in by hand.
 
-    std::stringstream ss(buffer);
-    std::istream_iterator<std::string> begin(ss);
-    std::istream_iterator<std::string> end;
-    std::vector<std::string> vstrings(begin, end);
+    id = 0;
+    transaction.reset();
 
-    // TODO: Throw if if (vstrings.size() < 3)
-    if (vstrings[0] == "With")
+    if (hasRecords())
     {
-        return std::make_unique<Withdraw>(vstrings[0], vstrings[1], std::atof[vstrings[2]]);
+        // The rest of the batch has been read already.
     }
-    else if (vstrings[0] == "Depo")
+    else if (transport)
+    {
+        if (!transport->receiveFrame(frame))
+        {
+            return false;
+        }
+        cursor = 0;
+    }
+    else
     {
-        return std::make_unique<Deposit>(vstrings[0], vstrings[1], std::atof(vstrings[3]));
+        logEvent(LogComponent::Network, LogLevel::Info, LogEvent::RequestPrompt);
+        flushLog();
+        if (!std::getline(std::cin, frame))
+        {
+            return false;
+        }
     }
-    else if (vstrings[0] == "Bala")
+
+    std::string_view buffer{frame};
+
+    if (batched)
     {
-        return std::make_unique<Balance>(vstrings[0], std::atof(vstrings[1]));
+        std::string_view rest{buffer.substr(cursor)};
+        if (!nextRecord(rest, id, buffer))
+        {
+            logEvent(LogComponent::Network, LogLevel::Warning, LogEvent::BadBatch);
+            cursor = frame.size();
+            return true;
+        }
+        cursor = frame.size() - rest.size();
     }
-    else if (vstrings[1] == "Tran")
+    else if (tagged)
     {
-        return std::make_unique<Transfer>(vstrings[0], vstrings[1], vstrings[2], std::atof(vstrings[3]));
+        if (buffer.size() < WireTagSize)
+        {
+            logEvent(LogComponent::Network, LogLevel::Warning, LogEvent::UntaggedRequest);
+            return true;
+        }
+        id = decodeTag(asBytes(frame));
+        buffer.remove_prefix(WireTagSize);
     }
-    else
+
+    if (transport && format == WireFormat::Binary)
     {
-        std::cout << "@Bank Application@ Unknown packet type!" << std::endl;
-        return NULL;
+        transaction = receiveBinary(buffer);
+        return true;
+    }
+
+    // The parser is the inverse routine for the send method on the
+    // ATM side of the application. Its fields are views into the
+    // buffer, so nothing is copied until the Transaction is built.
+
+    ParsedPacket packet;
+    const PacketError error = parsePacket(buffer, packet);
+    if (error != PacketError::None)
+    {
+        logEvent(LogComponent::Network, LogLevel::Warning, LogEvent::BadRequest, describe(error));
+        return true;
     }
+
+    transaction = buildTransaction(packet.type, packet.account, packet.pin, packet.amount, packet.targetAccount);
+    return true;
+}
+
+// The hasRecords method tells whether a batched frame still holds
+// requests that receive has not yet handed out.
+
+bool Network::hasRecords() const
+{
+    return batched && cursor < frame.size();
 }
 
 // The send method of the Bank side of the applicaiton uses the
@@ -146,12 +600,90 @@ std::unique_ptr<Transaction> *Network::receive()
 
 void Network::send(int status, const Transaction &t)
 {
-    const std::string buffer{t.packetize(status)};
+    send(status, t, 0);
+}
 
-    // The reader can replace this output with the appropriate
-    // byte-transfer mechanism.
+void Network::send(int status, const Transaction &t, std::uint32_t id)
+{
+    reply(status, &t, id, nullptr);
+}
+
+// On a batched connection, the reply is added to the caller's batch
+// instead of being sent.
+
+void Network::send(int status, const Transaction &t, std::uint32_t id, std::string &batch)
+{
+    reply(status, &t, id, &batch);
+}
+
+// The refuse method answers a request that never became a
+// Transaction with a failure status and no amount.
+
+void Network::refuse(std::uint32_t id)
+{
+    reply(0, NULL, id, nullptr);
+}
+
+void Network::refuse(std::uint32_t id, std::string &batch)
+{
+    reply(0, NULL, id, &batch);
+}
+
+bool Network::sendBatch(const std::string &batch)
+{
+    return transport && transport->sendFrame(batch);
+}
+
+// The reply method builds the reply to a Transaction, or a refusal if
+// there is none, and sends it, or adds it to a batch.
+
+void Network::reply(int status, const Transaction *t, std::uint32_t id, std::string *batch)
+{
+    if (transport && format == WireFormat::Binary)
+    {
+        WireReply reply;
+        if (t != NULL)
+        {
+            t->packetize(reply, status);
+        }
+
+        unsigned char buf[WireTagSize + WireReplySize];
+        encodeTag(id, buf);
+        encodeReply(reply, buf + WireTagSize);
+
+        if (batch != nullptr)
+        {
+            appendRecord(*batch, id, asFrame(buf + WireTagSize, WireReplySize));
+            return;
+        }
+
+        const std::size_t skip = tagged ? 0 : WireTagSize;
+        transport->sendFrame(asFrame(buf + skip, sizeof(buf) - skip));
+        return;
+    }
+
+    std::string buffer{t != NULL ? t->packetize(status) : std::string{"0000"}};
+
+    if (batch != nullptr)
+    {
+        appendRecord(*batch, id, buffer);
+        return;
+    }
+
+    if (transport)
+    {
+        if (tagged)
+        {
+            unsigned char tag[WireTagSize];
+            encodeTag(id, tag);
+            buffer.insert(0, reinterpret_cast<const char *>(tag), sizeof(tag));
+        }
+
+        transport->sendFrame(buffer);
+        return;
+    }
 
-    std::cout << "@Network Simulation@ Packet Sent to ATM: '" << buffer << "'" << std::endl;
+    logEvent(LogComponent::Network, LogLevel::Info, LogEvent::SimulatedReply, buffer);
 }
 
 #endif
@@ -12,26 +12,89 @@
 #ifndef NETWORK_HPP
 #define NETWORK_HPP
 
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <string>
 
+#include "Wire.hpp"
+
 class Transaction;
+class Transport;
+class InputScript;
+class Deadline;
 
 class Network
 {
     // The user's favorite byte-transmission method goes here. See the
     // implementation of the four methods to determine where the send
-    // and receive for this method need to go.
+    // and receive for this method need to go. A Network built without
+    // a Transport keeps the original console simulation, in which the
+    // packets are printed and the replies are typed in by hand.
+    // The packet format, and whether frames carry a correlation ID,
+    // are chosen once per connection by negotiate; the frame buffer
+    // is reused for every packet received. On the ATM side, the
+    // simulation can take the Bank's replies from an InputScript
+    // (owned by the caller) instead of the console.
+    // The ATM side may also be given the ATM's Deadline, which limits
+    // how long receive waits for the Bank. A late reply on an untagged
+    // connection would be taken for the answer to the next request, so
+    // such a connection is given up as lost once a receive times out;
+    // a late reply on a tagged connection is simply not recognized.
+    // On the Bank side, a connection from a Concentrator batches its
+    // frames (see Wire.hpp). Its requests are received one at a time
+    // all the same, the frame being read only once every record in
+    // it has been; its replies are gathered into a batch of the
+    // caller's, which sendBatch then sends as one frame.
+
+    std::unique_ptr<Transport> transport;
+    WireFormat format{WireFormat::Ascii};
+    bool tagged{false};
+    bool batched{false};
+    bool lost{false};
+    std::string frame;
+    std::size_t cursor{0};
+    InputScript *script{nullptr};
+    Deadline *deadline{nullptr};
 
 public:
+    Network();
+    Network(std::unique_ptr<Transport> &);
 #ifdef ATM_SIDE
+    Network(InputScript &);
+#endif
+    ~Network();
+
+    WireFormat getFormat() const;
+    bool isTagged() const;
+    bool isBatched() const;
+
+#ifdef ATM_SIDE
+    void setDeadline(Deadline *);
+    int getDescriptor() const;
+    bool answerReady();
+    bool negotiate(WireFormat, bool);
     bool send(const Transaction &);
+    bool send(const Transaction &, std::uint32_t);
     std::string receive(int &);
+    bool receive(int &, std::uint32_t &, std::string &);
 #endif
 
-#ifndef BANK_SIDE
+#ifdef BANK_SIDE
+    bool negotiate();
     std::unique_ptr<Transaction> receive();
+    std::unique_ptr<Transaction> receive(std::uint32_t &);
+    bool receive(std::uint32_t &, std::unique_ptr<Transaction> &);
+    bool hasRecords() const;
     void send(int, const Transaction &);
+    void send(int, const Transaction &, std::uint32_t);
+    void send(int, const Transaction &, std::uint32_t, std::string &);
+    void refuse(std::uint32_t);
+    void refuse(std::uint32_t, std::string &);
+    bool sendBatch(const std::string &);
+
+private:
+    void reply(int, const Transaction *, std::uint32_t, std::string *);
 #endif
 };
 
@@ -0,0 +1,175 @@
+// Packet.cpp: The implementation of the ASCII request packet parser.
+
+#include "Packet.hpp"
+#include "Wire.hpp"
+
+// The four-character type tag is read as one 32-bit integer, so the
+// case analysis on the transaction type is a single switch rather
+// than a string comparison per candidate. The bytes are assembled
+// explicitly (instead of copied) so the value does not depend on the
+// host's byte order; compilers emit a single load for it.
+
+static constexpr std::uint32_t tagOf(char a, char b, char c, char d)
+{
+    return static_cast<std::uint32_t>(static_cast<unsigned char>(a)) |
+           static_cast<std::uint32_t>(static_cast<unsigned char>(b)) << 8 |
+           static_cast<std::uint32_t>(static_cast<unsigned char>(c)) << 16 |
+           static_cast<std::uint32_t>(static_cast<unsigned char>(d)) << 24;
+}
+
+const std::uint32_t WithTag = tagOf('W', 'i', 't', 'h');
+const std::uint32_t DepoTag = tagOf('D', 'e', 'p', 'o');
+const std::uint32_t BalaTag = tagOf('B', 'a', 'l', 'a');
+const std::uint32_t TranTag = tagOf('T', 'r', 'a', 'n');
+
+static bool isDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static bool allDigits(std::string_view s)
+{
+    for (char c : s)
+    {
+        if (!isDigit(c))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Fields are separated by runs of spaces (a hand-typed packet in the
+// simulation may have more than one). The nextField helper requires
+// at least one space, then returns everything up to the next space.
+
+static bool nextField(std::string_view &rest, std::string_view &field)
+{
+    if (rest.empty() || rest.front() != ' ')
+    {
+        return false;
+    }
+
+    const std::string_view::size_type start = rest.find_first_not_of(' ');
+    if (start == std::string_view::npos)
+    {
+        return false;
+    }
+
+    rest.remove_prefix(start);
+    const std::string_view::size_type end = rest.find(' ');
+    field = rest.substr(0, end);
+    rest.remove_prefix(field.size());
+
+    return true;
+}
+
+static bool validAccount(std::string_view account)
+{
+    return account.size() == 8 && allDigits(account.substr(0, 7)) &&
+           (account[7] == 'S' || account[7] == 'C');
+}
+
+// The amount is parsed straight into cents without going through
+// floating point. An ATM never sends a negative amount.
+
+static bool parseAmount(std::string_view text, Money &amount)
+{
+    return Money::parse(text, amount) && !amount.isNegative();
+}
+
+PacketError parsePacket(std::string_view buffer, ParsedPacket &packet)
+{
+    packet = ParsedPacket{};
+
+    if (buffer.size() < 4 + 8)
+    {
+        return PacketError::TooShort;
+    }
+
+    switch (tagOf(buffer[0], buffer[1], buffer[2], buffer[3]))
+    {
+    case WithTag:
+        packet.type = WireWithdraw;
+        break;
+    case DepoTag:
+        packet.type = WireDeposit;
+        break;
+    case BalaTag:
+        packet.type = WireBalance;
+        break;
+    case TranTag:
+        packet.type = WireTransfer;
+        break;
+    default:
+        return PacketError::UnknownType;
+    }
+
+    std::string_view rest = buffer.substr(4);
+    packet.account = rest.substr(0, rest.find(' '));
+    rest.remove_prefix(packet.account.size());
+    if (!validAccount(packet.account))
+    {
+        return PacketError::BadAccount;
+    }
+
+    if (!nextField(rest, packet.pin) || packet.pin.size() != 4 || !allDigits(packet.pin))
+    {
+        return PacketError::BadPin;
+    }
+
+    std::string_view amount;
+    if (!nextField(rest, amount) || !parseAmount(amount, packet.amount))
+    {
+        return PacketError::BadAmount;
+    }
+
+    if (packet.type == WireTransfer)
+    {
+        if (!nextField(rest, packet.targetAccount))
+        {
+            return PacketError::MissingTarget;
+        }
+        if (!validAccount(packet.targetAccount))
+        {
+            return PacketError::BadTarget;
+        }
+    }
+
+    // Trailing spaces (or a carriage return from a typed line) are
+    // tolerated; anything else is not.
+    if (rest.find_first_not_of(" \r") != std::string_view::npos)
+    {
+        return PacketError::TrailingData;
+    }
+
+    return PacketError::None;
+}
+
+const char *describe(PacketError error)
+{
+    switch (error)
+    {
+    case PacketError::None:
+        return "no error";
+    case PacketError::TooShort:
+        return "packet too short";
+    case PacketError::UnknownType:
+        return "unknown packet type";
+    case PacketError::BadAccount:
+        return "bad source account";
+    case PacketError::BadPin:
+        return "bad PIN";
+    case PacketError::BadAmount:
+        return "bad amount";
+    case PacketError::MissingTarget:
+        return "transfer without a target account";
+    case PacketError::BadTarget:
+        return "bad target account";
+    case PacketError::TrailingData:
+        return "unexpected data after the packet";
+    }
+
+    return "unknown error";
+}
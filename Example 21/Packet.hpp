@@ -0,0 +1,54 @@
+// Packet.hpp: The header file for the parser of the ASCII request
+// packets built by Transaction::packetize(). The Bank side receives
+// one of these for every transaction an ATM sends (unless the two
+// sides negotiated the binary format), so the parser works entirely
+// on views into the received frame. It never copies a field or
+// allocates memory, and it reports exactly what was wrong with a
+// malformed packet rather than indexing past the end of it.
+//
+// The packet is a four-character type tag immediately followed by
+// the source account (seven digits and an S or C), then the PIN
+// (four digits) and the amount (digits with an optional decimal
+// point and at most two decimals, see Money.hpp), each preceded by
+// one or more spaces. A Transfer adds the target account at the end,
+// in the same form as the source account.
+
+#ifndef PACKET_HPP
+#define PACKET_HPP
+
+#include <cstdint>
+#include <string_view>
+
+#include "Money.hpp"
+
+enum class PacketError
+{
+    None,
+    TooShort,
+    UnknownType,
+    BadAccount,
+    BadPin,
+    BadAmount,
+    MissingTarget,
+    BadTarget,
+    TrailingData
+};
+
+// The type uses the same tags as the binary format (WireWithdraw,
+// ...), so that the Bank builds Transactions the same way from
+// either kind of packet. The views point into the parsed buffer and
+// are valid only as long as it is.
+
+struct ParsedPacket
+{
+    std::uint8_t type{0};
+    std::string_view account;
+    std::string_view pin;
+    Money amount;
+    std::string_view targetAccount;
+};
+
+PacketError parsePacket(std::string_view, ParsedPacket &);
+const char *describe(PacketError);
+
+#endif
@@ -0,0 +1,169 @@
+// Script.cpp: The implementation of the InputScript class, which
+// replays keys, cards, and Bank replies to the ATM side of the
+// application.
+
+#include "Script.hpp"
+#include "consts.hpp"
+
+#include <fstream>
+#include <iostream>
+
+// The load method appends the events of a session file to the
+// script. It returns false if the file cannot be read or if a line
+// is not one of the four kinds of event; in the latter case it says
+// which line.
+
+bool InputScript::load(const std::filesystem::path &file)
+{
+    std::ifstream ifs(file);
+    if (!ifs)
+    {
+        std::cout << "@Script@ Cannot open " << file.string() << std::endl;
+        return false;
+    }
+
+    std::string line;
+    unsigned int number = 0;
+
+    while (std::getline(ifs, line))
+    {
+        ++number;
+
+        std::string_view text{line};
+        if (!text.empty() && text.back() == '\r')
+        {
+            text.remove_suffix(1);
+        }
+
+        if (text.empty() || text.front() == '#')
+        {
+            continue;
+        }
+
+        const std::string_view::size_type space = text.find(' ');
+        const std::string_view kind = text.substr(0, space);
+        const std::string_view rest = space == std::string_view::npos ? std::string_view{} : text.substr(space + 1);
+
+        if (kind == "keys")
+        {
+            addKeys(rest);
+        }
+        else if (kind == "card")
+        {
+            addCard(rest);
+        }
+        else if (kind == "reply")
+        {
+            addReply(rest);
+        }
+        else if (kind == "request")
+        {
+            addRequest(rest);
+        }
+        else
+        {
+            std::cout << "@Script@ " << file.string() << ":" << number << ": unknown event '" << kind << "'" << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void InputScript::addKeys(std::string_view typed)
+{
+    keys.append(typed);
+    keys += EnterKey;
+}
+
+void InputScript::addCard(std::string_view info)
+{
+    cards.emplace_back(info);
+}
+
+void InputScript::addReply(std::string_view reply)
+{
+    replies.emplace_back(reply);
+}
+
+void InputScript::addRequest(std::string_view text)
+{
+    requests.emplace_back(text);
+}
+
+// The rewind method makes the script start over from its first
+// event of each kind.
+
+void InputScript::rewind()
+{
+    nextKey = 0;
+    nextCard = 0;
+    nextReply = 0;
+}
+
+std::size_t InputScript::cardCount() const
+{
+    return cards.size();
+}
+
+std::size_t InputScript::requestCount() const
+{
+    return requests.size();
+}
+
+const std::string &InputScript::request(std::size_t i) const
+{
+    return requests[i];
+}
+
+// The getLine method returns the keys up to the next Enter key, which
+// it skips. The view points into the script, so it stays valid for as
+// long as the script does. Keys left over without an Enter key are
+// returned with false, as is an empty line once the keys run out.
+
+bool InputScript::getLine(std::string_view &line)
+{
+    const std::string::size_type end = keys.find(EnterKey, nextKey);
+    if (end == std::string::npos)
+    {
+        line = std::string_view(keys).substr(nextKey);
+        nextKey = keys.size();
+        return false;
+    }
+
+    line = std::string_view(keys).substr(nextKey, end - nextKey);
+    nextKey = end + 1;
+    return true;
+}
+
+// The current card stays in the slot until it is removed (ejected or
+// eaten), just like a BankCard file in the CardSlots directory.
+
+bool InputScript::cardPresent() const
+{
+    return nextCard < cards.size();
+}
+
+const std::string &InputScript::card() const
+{
+    return cards[nextCard];
+}
+
+void InputScript::removeCard()
+{
+    if (nextCard < cards.size())
+    {
+        ++nextCard;
+    }
+}
+
+bool InputScript::getReply(std::string &reply)
+{
+    if (nextReply == replies.size())
+    {
+        return false;
+    }
+
+    reply = replies[nextReply++];
+    return true;
+}
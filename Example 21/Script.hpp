@@ -0,0 +1,74 @@
+// Script.hpp: The header file for the InputScript class, the
+// non-interactive stand-in for the person at the ATM. Without it,
+// every key has to be typed at the console, every card has to be
+// copied into the CardSlots directory, and every Bank reply of the
+// Network simulation has to be typed in as well. An InputScript
+// holds all three kinds of input in memory, and the Keypad, the
+// PhysicalCardReader, and the Network each take theirs from it
+// instead of from the outside world. Since the script only moves
+// read positions forward, it can be rewound and replayed as often as
+// needed, which makes it suitable for regression runs and for timing
+// the ATM side of the application.
+//
+// A session file has one event per line; blank lines and lines
+// starting with '#' are ignored:
+//
+//   card 1234567 1234      a card (the text is the BankCard's line)
+//   keys 1234              keys typed, followed by the Enter key
+//   reply 0001 1234.56     the Bank's reply to the next packet
+//   request Bala 1234567S 1234
+//                          a queued Transaction, for the ATM's -settle
+//                          mode (see ATMMain.cpp)
+//
+// Each kind of event is consumed in order, independently of the
+// others, so a session file simply lists them in the order they
+// happen. When the cards run out, the ATM's activate method returns.
+// A request gives the Transaction's type and account and PIN, then,
+// for a Transfer, the target account, and for all but a Balance, the
+// amount. When requests are pipelined over tagged frames, each reply
+// starts with the correlation ID of the request it answers (the
+// requests are numbered from zero), and the replies may come in any
+// order.
+// The Keypad takes the keys a line at a time, straight out of the
+// script's buffer. When the keys run out, the Keypad reports that the
+// input has ended, which the SuperKeypad takes as the customer
+// walking away.
+
+#ifndef SCRIPT_HPP
+#define SCRIPT_HPP
+
+#include <cstddef>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class InputScript
+{
+    std::string keys;
+    std::string::size_type nextKey{0};
+    std::vector<std::string> cards;
+    std::size_t nextCard{0};
+    std::vector<std::string> replies;
+    std::size_t nextReply{0};
+    std::vector<std::string> requests;
+
+public:
+    bool load(const std::filesystem::path &);
+    void addKeys(std::string_view);
+    void addCard(std::string_view);
+    void addReply(std::string_view);
+    void addRequest(std::string_view);
+    void rewind();
+    std::size_t cardCount() const;
+    std::size_t requestCount() const;
+    const std::string &request(std::size_t) const;
+
+    bool getLine(std::string_view &);
+    bool cardPresent() const;
+    const std::string &card() const;
+    void removeCard();
+    bool getReply(std::string &);
+};
+
+#endif
@@ -0,0 +1,425 @@
+// Server.cpp: The source file of the BankServer class, which
+// multiplexes many ATM connections onto one epoll thread and a small
+// pool of worker threads.
+
+#include "Server.hpp"
+#include "Bank.hpp"
+#include "Log.hpp"
+#include "Network.hpp"
+#include "Trans.hpp"
+#include "Transport.hpp"
+#include "Wire.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <iostream>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// The epoll thread collects at most this many events per wait.
+
+const int MaxServerEvents = 256;
+
+// An ATM may have this many requests queued for (or being processed
+// by) the workers. Requests from one batched frame are all decoded
+// together, so a batch may take an ATM somewhat past the limit.
+
+const std::size_t MaxConnectionJobs = WireMaxOutstanding;
+
+// A Connection is one ATM's Network, along with the BufferedTransport
+// the Network owns; the epoll thread needs the latter to pull in the
+// ATM's bytes. Only the epoll thread receives on the Network, and
+// only after negotiation may the workers send on it. Since the packet
+// format is fixed by then, and the BufferedTransport serializes its
+// sends, the two never get in each other's way. The epoll thread
+// counts each request it decodes as outstanding, and the worker that
+// replies to it counts it off again. Whether the connection is paused
+// is guarded by the BankServer's mutex.
+
+struct BankServer::Connection
+{
+    BufferedTransport *transport;
+    Network network;
+    bool negotiated{false};
+    std::atomic<std::size_t> outstanding{0};
+    bool paused{false};
+
+    explicit Connection(std::unique_ptr<Transport> &);
+};
+
+// The Transport handed in must be a BufferedTransport.
+
+BankServer::Connection::Connection(std::unique_ptr<Transport> &t)
+    : transport(static_cast<BufferedTransport *>(t.get())), network(t)
+{
+}
+
+// Besides the listening socket, the epoll thread watches an eventfd,
+// through which the workers hand back connections they have unpaused.
+
+BankServer::BankServer(Bank &b, std::unique_ptr<TransportListener> &l, unsigned int workers)
+    : bank(b), listener(std::move(l)), workerCount(std::max(workers, 1u)), epollFd(::epoll_create1(EPOLL_CLOEXEC)),
+      wakeFd(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+{
+    if (epollFd < 0 || wakeFd < 0)
+    {
+        const std::system_error error{errno, std::generic_category(), epollFd < 0 ? "epoll_create1" : "eventfd"};
+        ::close(epollFd);
+        ::close(wakeFd);
+        throw error;
+    }
+
+    for (const int fd : {listener->getDescriptor(), wakeFd})
+    {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (::epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            const std::system_error error{errno, std::generic_category(), "epoll_ctl"};
+            ::close(epollFd);
+            ::close(wakeFd);
+            throw error;
+        }
+    }
+}
+
+BankServer::~BankServer()
+{
+    ::close(wakeFd);
+    ::close(epollFd);
+}
+
+// The run method never returns. It starts the workers and then
+// spends the rest of its life waiting for something to happen on the
+// listening socket or on one of the ATMs' connections. The requests
+// found in one pass are queued for the workers all at once.
+
+void BankServer::run()
+{
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < workerCount; ++i)
+    {
+        workers.emplace_back(&BankServer::work, this);
+    }
+
+    const int listenerFd = listener->getDescriptor();
+    epoll_event events[MaxServerEvents];
+    std::deque<Job> arrived;
+
+    while (true)
+    {
+        const int count = ::epoll_wait(epollFd, events, MaxServerEvents, -1);
+        if (count < 0)
+        {
+            if (errno != EINTR)
+            {
+                logEvent(LogComponent::BankServer, LogLevel::Error, LogEvent::EpollFailed, {}, errno);
+            }
+            continue;
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            const int fd = events[i].data.fd;
+            if (fd == listenerFd)
+            {
+                acceptAll();
+                continue;
+            }
+            if (fd == wakeFd)
+            {
+                resumeAll(arrived);
+                continue;
+            }
+
+            // A connection that has been shut down both ways (by a
+            // reply that could not be sent, say) is finished, paused
+            // or not.
+            auto found = connections.find(fd);
+            if (found != connections.end() &&
+                ((events[i].events & (EPOLLHUP | EPOLLERR)) != 0 || !receiveAll(found->second, arrived)))
+            {
+                drop(fd);
+            }
+        }
+
+        if (!arrived.empty())
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (Job &job : arrived)
+            {
+                jobs.push_back(std::move(job));
+            }
+            arrived.clear();
+
+            if (jobs.size() > 1)
+            {
+                jobCondition.notify_all();
+            }
+            else
+            {
+                jobCondition.notify_one();
+            }
+        }
+    }
+}
+
+// The acceptAll method takes every ATM that is waiting to connect
+// and starts watching its connection. The ATM's hello frame is dealt
+// with when it arrives, like any other.
+
+void BankServer::acceptAll()
+{
+    while (true)
+    {
+        std::unique_ptr<BufferedTransport> accepted;
+        try
+        {
+            accepted = listener->acceptReady();
+        }
+        catch (const std::exception &e)
+        {
+            logEvent(LogComponent::BankServer, LogLevel::Error, LogEvent::ServerError, e.what());
+            return;
+        }
+
+        if (accepted == NULL)
+        {
+            return;
+        }
+
+        const int fd = accepted->getDescriptor();
+        std::unique_ptr<Transport> transport{std::move(accepted)};
+        auto connection = std::make_shared<Connection>(transport);
+
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        if (::epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            logEvent(LogComponent::BankServer, LogLevel::Error, LogEvent::CannotWatch, {}, errno);
+            continue;
+        }
+
+        connections[fd] = std::move(connection);
+    }
+}
+
+// The receiveAll method reads everything an ATM has sent and decodes
+// each whole request into a Job. The first frame from an ATM is its
+// hello, which is answered right here. A batched frame becomes one
+// Job per request, all sharing a ReplyBatch. Decoding stops when the
+// ATM has as many requests outstanding as it may, and the connection
+// is paused, leaving the rest in its buffer (and in the socket) until
+// the workers catch up. The method returns false once the ATM is gone
+// (or has failed to negotiate), after decoding any requests it sent
+// before it went.
+
+bool BankServer::receiveAll(const std::shared_ptr<Connection> &connection, std::deque<Job> &arrived)
+{
+    const bool open = connection->transport->fill();
+
+    while (connection->transport->ready())
+    {
+        if (connection->outstanding >= MaxConnectionJobs)
+        {
+            if (pause(*connection))
+            {
+                return true;
+            }
+            continue;
+        }
+
+        if (!connection->negotiated)
+        {
+            if (!connection->network.negotiate())
+            {
+                logEvent(LogComponent::BankServer, LogLevel::Warning, LogEvent::NegotiationFailed);
+                return false;
+            }
+            connection->negotiated = true;
+            continue;
+        }
+
+        std::shared_ptr<ReplyBatch> batch;
+        if (connection->network.isBatched())
+        {
+            batch = std::make_shared<ReplyBatch>();
+        }
+
+        do
+        {
+            Job job{connection, 0, nullptr, batch};
+            if (!connection->network.receive(job.id, job.transaction))
+            {
+                return false;
+            }
+            if (batch)
+            {
+                ++batch->remaining;
+            }
+            ++connection->outstanding;
+            arrived.push_back(std::move(job));
+        } while (connection->network.hasRecords());
+    }
+
+    if (connection->outstanding >= MaxConnectionJobs && pause(*connection))
+    {
+        return true;
+    }
+
+    return open;
+}
+
+// The pause method stops watching a connection for input, unless the
+// workers have brought its outstanding requests back under the limit
+// in the meantime; it returns whether it did. The check is made under
+// the mutex, where the worker that takes the count back under the
+// limit looks for the pause, so the connection cannot be left paused
+// with nothing outstanding.
+
+bool BankServer::pause(Connection &connection)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (connection.outstanding < MaxConnectionJobs)
+    {
+        return false;
+    }
+
+    epoll_event event{};
+    event.data.fd = connection.transport->getDescriptor();
+    ::epoll_ctl(epollFd, EPOLL_CTL_MOD, event.data.fd, &event);
+    connection.paused = true;
+    return true;
+}
+
+// The resumeAll method watches again every connection the workers
+// have unpaused, and decodes whatever requests were left waiting in
+// its buffer; the socket may have nothing new to announce. A
+// connection that was dropped while paused is simply forgotten.
+
+void BankServer::resumeAll(std::deque<Job> &arrived)
+{
+    std::uint64_t count;
+    while (::read(wakeFd, &count, sizeof(count)) < 0 && errno == EINTR)
+    {
+    }
+
+    std::vector<std::shared_ptr<Connection>> ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready.swap(resumed);
+    }
+
+    for (const std::shared_ptr<Connection> &connection : ready)
+    {
+        const int fd = connection->transport->getDescriptor();
+        auto found = connections.find(fd);
+        if (found == connections.end() || found->second != connection)
+        {
+            continue;
+        }
+
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        ::epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+
+        if (!receiveAll(connection, arrived))
+        {
+            drop(fd);
+        }
+    }
+}
+
+// Removing a connection from the table does not close its socket
+// while Jobs still refer to it, so its descriptor cannot be reused
+// under a worker that is about to reply.
+
+void BankServer::drop(int fd)
+{
+    ::epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    connections.erase(fd);
+}
+
+// A worker processes one request at a time, from whichever ATM is
+// next in line. Replies to one ATM may leave in a different order
+// from its requests; an ATM that pipelines its requests tags them,
+// and an ATM that does not has only one outstanding at a time.
+
+void BankServer::work()
+{
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobCondition.wait(lock, [this]
+                              { return !jobs.empty(); });
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        Network &network = job.connection->network;
+        const bool accepted = job.transaction != NULL && bank.process(*job.transaction);
+
+        if (job.batch)
+        {
+            std::lock_guard<std::mutex> lock(job.batch->mutex);
+            if (job.transaction == NULL)
+            {
+                network.refuse(job.id, job.batch->replies);
+            }
+            else
+            {
+                network.send(accepted ? 1 : 0, *job.transaction, job.id, job.batch->replies);
+            }
+            if (--job.batch->remaining == 0)
+            {
+                network.sendBatch(job.batch->replies);
+            }
+        }
+        else if (job.transaction == NULL)
+        {
+            network.refuse(job.id);
+        }
+        else
+        {
+            network.send(accepted ? 1 : 0, *job.transaction, job.id);
+        }
+
+        finish(job.connection);
+    }
+}
+
+// The finish method counts off a request that has been answered. The
+// worker that takes a connection's count back under the limit hands
+// it to the epoll thread, if the epoll thread had paused it; only
+// that worker needs the mutex.
+
+void BankServer::finish(const std::shared_ptr<Connection> &connection)
+{
+    if (connection->outstanding-- != MaxConnectionJobs)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (connection->paused)
+    {
+        connection->paused = false;
+        resumed.push_back(connection);
+
+        const std::uint64_t one = 1;
+        while (::write(wakeFd, &one, sizeof(one)) < 0 && errno == EINTR)
+        {
+        }
+    }
+}
@@ -0,0 +1,86 @@
+// Server.hpp: The header file for the BankServer class, which lets
+// one Bank serve thousands of ATMs at once. Giving every ATM a thread
+// of its own (as the Bank once did) costs a stack and a scheduler
+// entry per ATM, although each ATM spends nearly all of its time
+// waiting for its customer. The BankServer instead has a single
+// thread watch every connection with epoll. That thread reads and
+// decodes whatever requests arrive, and hands the Transactions to a
+// fixed pool of worker threads, which process them against the
+// AccountList and send the replies back through the ATM's Network.
+// An ATM may have only so many requests waiting on the workers; the
+// epoll thread stops reading from one that reaches the limit until
+// the workers have caught up with it.
+
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class Bank;
+class Transaction;
+class TransportListener;
+
+class BankServer
+{
+    struct Connection;
+
+    // A Job is one request waiting for a worker. A request that could
+    // not be decoded has no Transaction, and is refused. The Job keeps
+    // its Connection alive even if the ATM hangs up in the meantime.
+    // The requests that arrived in one batched frame share a
+    // ReplyBatch: each worker adds its reply to it, and whichever adds
+    // the last one sends them all back in one frame.
+
+    struct ReplyBatch
+    {
+        std::mutex mutex;
+        std::string replies;
+        std::size_t remaining{0};
+    };
+
+    struct Job
+    {
+        std::shared_ptr<Connection> connection;
+        std::uint32_t id;
+        std::unique_ptr<Transaction> transaction;
+        std::shared_ptr<ReplyBatch> batch;
+    };
+
+    Bank &bank;
+    std::unique_ptr<TransportListener> listener;
+    unsigned int workerCount;
+    int epollFd;
+    int wakeFd;
+    std::unordered_map<int, std::shared_ptr<Connection>> connections;
+    std::deque<Job> jobs;
+    std::vector<std::shared_ptr<Connection>> resumed;
+    std::mutex mutex;
+    std::condition_variable jobCondition;
+
+public:
+    BankServer(Bank &, std::unique_ptr<TransportListener> &, unsigned int);
+    ~BankServer();
+    BankServer(const BankServer &) = delete;
+    BankServer &operator=(const BankServer &) = delete;
+
+    void run();
+
+private:
+    void acceptAll();
+    bool receiveAll(const std::shared_ptr<Connection> &, std::deque<Job> &);
+    bool pause(Connection &);
+    void resumeAll(std::deque<Job> &);
+    void drop(int);
+    void finish(const std::shared_ptr<Connection> &);
+    void work();
+};
+
+#endif
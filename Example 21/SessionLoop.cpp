@@ -0,0 +1,252 @@
+// SessionLoop.cpp: The source file of the SessionLoop class, which
+// carries on the sessions of many ATMs with one epoll set.
+
+#include "SessionLoop.hpp"
+#include "Atm.hpp"
+#include "Console.hpp"
+#include "Log.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+// The loop collects at most this many events per wait. A session with
+// nothing to wait on (see suspend) is advanced again this often.
+
+const int MaxSessionEvents = 256;
+const std::chrono::milliseconds SessionRetry{1};
+
+SessionLoop::SessionLoop() : epollFd(::epoll_create1(EPOLL_CLOEXEC)),
+                             consoleFd(ConsoleInput::shared().getDescriptor())
+{
+    if (epollFd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(), "epoll_create1");
+    }
+}
+
+SessionLoop::~SessionLoop()
+{
+    ::close(epollFd);
+}
+
+// The watch method adds a descriptor the caller waits on too (the
+// Fleet's CardSlotMonitor, say); poll returns true when it is
+// readable. It stays in the set until the loop is destroyed.
+
+void SessionLoop::watch(int fd)
+{
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.ptr = this;
+    if (::epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+    }
+}
+
+// The start method begins the session of an ATM with a card in its
+// slot, and advances it as far as it goes without waiting. It returns
+// false if there was no session to begin. The ATM must not be started
+// again until poll has handed it back.
+
+bool SessionLoop::start(ATM &atm)
+{
+    if (!atm.cardPresent() || !atm.beginSession())
+    {
+        return false;
+    }
+
+    std::unique_ptr<Entry> &entry = entries[&atm];
+    if (!entry)
+    {
+        entry.reset(new Entry{&atm});
+    }
+
+    ++active;
+    if (entry->atm->advance(false) == SessionWait::Done)
+    {
+        --active;
+        done.push_back(&atm);
+    }
+    else
+    {
+        suspend(*entry);
+    }
+    return true;
+}
+
+std::size_t SessionLoop::getActive() const
+{
+    return active;
+}
+
+// The poll method waits up to the given time for any waiting session
+// (or watched descriptor) to become readable, advances every session
+// that can go on, and adds the ATMs whose sessions are over to its
+// second argument. It returns true if a watched descriptor is
+// readable.
+
+bool SessionLoop::poll(std::chrono::milliseconds timeout, std::vector<ATM *> &finished)
+{
+    finished.insert(finished.end(), done.begin(), done.end());
+    if (!done.empty())
+    {
+        timeout = std::chrono::milliseconds(0);
+    }
+    else if (!ready.empty())
+    {
+        timeout = std::min(timeout, SessionRetry);
+    }
+    done.clear();
+
+    // Prompts are buffered like everything else the ATMs print, and
+    // the customers must see them before the loop waits for answers.
+    flushLog();
+
+    epoll_event events[MaxSessionEvents];
+    int count = ::epoll_wait(epollFd, events, MaxSessionEvents, static_cast<int>(timeout.count()));
+    if (count < 0)
+    {
+        count = 0;
+    }
+
+    bool watched = false;
+    for (int i = 0; i < count; ++i)
+    {
+        void *const owner = events[i].data.ptr;
+        if (owner == this)
+        {
+            watched = true;
+        }
+        else if (owner == nullptr)
+        {
+            // Every session waiting on the console tries for its line;
+            // those still without one go back on the list.
+            consoleAdded = false;
+            std::vector<Entry *> waiters;
+            waiters.swap(consoleWaiters);
+            for (Entry *entry : waiters)
+            {
+                entry->onConsole = false;
+            }
+            for (Entry *entry : waiters)
+            {
+                if (entry->waiting)
+                {
+                    resume(*entry, finished);
+                }
+            }
+        }
+        else
+        {
+            Entry &entry = *static_cast<Entry *>(owner);
+            if (entry.waiting)
+            {
+                resume(entry, finished);
+            }
+        }
+    }
+
+    std::vector<Entry *> retry;
+    retry.swap(ready);
+    for (Entry *entry : retry)
+    {
+        if (entry->waiting)
+        {
+            resume(*entry, finished);
+        }
+    }
+
+    return watched;
+}
+
+// The resume method advances a session that something it waits for
+// has woken. The Deadline's pipe is emptied first: whether the
+// Deadline has really expired is up to its flags, and a byte left
+// over from an earlier expiry would otherwise wake the session again
+// and again.
+
+void SessionLoop::resume(Entry &entry, std::vector<ATM *> &finished)
+{
+    char drain[64];
+    while (::read(entry.atm->getDeadlineDescriptor(), drain, sizeof(drain)) > 0)
+    {
+    }
+
+    entry.waiting = false;
+    if (entry.atm->advance(false) == SessionWait::Done)
+    {
+        --active;
+        finished.push_back(entry.atm);
+    }
+    else
+    {
+        suspend(entry);
+    }
+}
+
+// The suspend method watches what a session waits on, and its
+// Deadline, for one event each. A session that waits on the console
+// joins the console's waiters. One with no descriptor to wait on (a
+// Transport without one), or whose descriptor another session already
+// watches (ATMs sharing one tagged Network), is simply advanced again
+// on the next poll.
+
+void SessionLoop::suspend(Entry &entry)
+{
+    entry.waiting = true;
+
+    const int fd = entry.atm->getDescriptor();
+    if (fd >= 0 && fd == consoleFd)
+    {
+        if (!entry.onConsole)
+        {
+            entry.onConsole = true;
+            consoleWaiters.push_back(&entry);
+        }
+        arm(consoleFd, nullptr, consoleAdded);
+    }
+    else if (fd >= 0)
+    {
+        if (fd != entry.waitFd && entry.waitAdded)
+        {
+            ::epoll_ctl(epollFd, EPOLL_CTL_DEL, entry.waitFd, NULL);
+            entry.waitAdded = false;
+        }
+        entry.waitFd = fd;
+        if (!arm(fd, &entry, entry.waitAdded))
+        {
+            ready.push_back(&entry);
+        }
+    }
+    else
+    {
+        ready.push_back(&entry);
+    }
+
+    arm(entry.atm->getDeadlineDescriptor(), &entry, entry.deadlineAdded);
+}
+
+// The arm method watches a descriptor for its next event, adding it
+// to the set the first time. A descriptor that was closed (and so
+// left the set) since it was last armed is added again. It returns
+// false if the descriptor cannot be watched at all, as happens when
+// another session already watches the same one.
+
+bool SessionLoop::arm(int fd, void *owner, bool &added)
+{
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = owner;
+
+    if (added && ::epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event) == 0)
+    {
+        return true;
+    }
+    added = ::epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+    return added;
+}
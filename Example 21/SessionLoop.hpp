@@ -0,0 +1,70 @@
+// SessionLoop.hpp: The header file for the SessionLoop class, which
+// carries on the sessions of many ATMs on one thread. An ATM session
+// spends nearly all of its time waiting: for the customer to type
+// the next line, and for the Bank to answer. A thread per session
+// (even one borrowed from the Fleet's pool for the length of the
+// session) is therefore mostly a stack doing nothing. The SessionLoop
+// instead advances each session (see the ATM's advance method) until
+// it would have to wait, and watches what every waiting session waits
+// on, along with its Deadline, with a single epoll set. Whichever of
+// those becomes readable, the loop advances that session again.
+//
+// A descriptor can be in an epoll set only once, but the sessions of
+// ATMs whose Keypads (or simulated Networks) share the console all
+// wait on the same descriptor. The loop therefore watches the console
+// on behalf of all of them, and advances them all when it is
+// readable; those whose line has not arrived simply wait again.
+
+#ifndef SESSIONLOOP_HPP
+#define SESSIONLOOP_HPP
+
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class ATM;
+
+class SessionLoop
+{
+    // Each descriptor is watched for one event at a time, so a session
+    // is never advanced for something it stopped waiting for long ago.
+    // An ATM keeps its Entry from one session to the next.
+
+    struct Entry
+    {
+        ATM *atm;
+        int waitFd{-1};
+        bool waitAdded{false};
+        bool deadlineAdded{false};
+        bool onConsole{false};
+        bool waiting{false};
+    };
+
+    int epollFd;
+    int consoleFd;
+    bool consoleAdded{false};
+    std::unordered_map<const ATM *, std::unique_ptr<Entry>> entries;
+    std::vector<Entry *> consoleWaiters;
+    std::vector<Entry *> ready;
+    std::vector<ATM *> done;
+    std::size_t active{0};
+
+public:
+    SessionLoop();
+    ~SessionLoop();
+    SessionLoop(const SessionLoop &) = delete;
+    SessionLoop &operator=(const SessionLoop &) = delete;
+
+    void watch(int);
+    bool start(ATM &);
+    std::size_t getActive() const;
+    bool poll(std::chrono::milliseconds, std::vector<ATM *> &);
+
+private:
+    void resume(Entry &, std::vector<ATM *> &);
+    void suspend(Entry &);
+    bool arm(int, void *, bool &);
+};
+
+#endif
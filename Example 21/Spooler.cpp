@@ -0,0 +1,223 @@
+// Spooler.cpp: The source file of the ReceiptSpooler class, the
+// background writer of the ATMs' receipts.
+
+#include "Spooler.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+ReceiptSpooler &ReceiptSpooler::shared()
+{
+    static ReceiptSpooler spooler;
+    return spooler;
+}
+
+// Writing out the last receipts is the destructor's job, so the
+// writer thread is told to stop only once everything queued is
+// written.
+
+ReceiptSpooler::~ReceiptSpooler()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    queuedCondition.notify_one();
+
+    if (writer.joinable())
+    {
+        writer.join();
+    }
+
+    for (const auto &log : logs)
+    {
+        if (log.second >= 0)
+        {
+            ::close(log.second);
+        }
+    }
+}
+
+// With an interval of zero (the default), the receipt logs are left
+// for the operating system to write back whenever it likes.
+
+void ReceiptSpooler::setSyncInterval(std::chrono::milliseconds interval)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    syncInterval = interval;
+}
+
+// The submit method queues the receipt in the given buffer for the
+// given log, and leaves the buffer empty but with the capacity of a
+// buffer the spooler has finished with, so that the caller's next
+// receipt need not allocate.
+
+void ReceiptSpooler::submit(const std::filesystem::path &file, std::string &receipt)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        std::string buffer;
+        if (!spare.empty())
+        {
+            buffer.swap(spare.back());
+            spare.pop_back();
+        }
+        buffer.swap(receipt);
+        queued.emplace_back(file, std::move(buffer));
+
+        if (!writer.joinable())
+        {
+            writer = std::thread(&ReceiptSpooler::write, this);
+        }
+    }
+
+    queuedCondition.notify_one();
+}
+
+// A receipt log is opened once, for appending, and kept open. If it
+// cannot be opened, its receipts go to the standard output instead.
+
+int ReceiptSpooler::openLog(const std::filesystem::path &file)
+{
+    auto found = logs.find(file.string());
+    if (found == logs.end())
+    {
+        const int fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        found = logs.emplace(file.string(), fd).first;
+    }
+
+    return found->second;
+}
+
+static void writeAll(int fd, iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t n = ::writev(fd, iov, count);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return;
+        }
+
+        while (count > 0 && static_cast<std::size_t>(n) >= iov->iov_len)
+        {
+            n -= static_cast<ssize_t>(iov->iov_len);
+            ++iov;
+            --count;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+            iov->iov_len -= static_cast<std::size_t>(n);
+        }
+    }
+}
+
+// The write method is the writer thread. Each pass takes every
+// receipt queued so far, sorts them by log (keeping each log's
+// receipts in the order they were printed), and hands each log's
+// receipts to a single writev. The logs written since the last sync
+// are synced once the interval is up.
+
+void ReceiptSpooler::write()
+{
+    std::vector<std::pair<std::filesystem::path, std::string>> batch;
+    std::vector<iovec> iov;
+    std::vector<int> unsynced;
+    auto lastSync = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        const auto ready = [this]
+        { return stopping || !queued.empty(); };
+        if (syncInterval.count() > 0 && !unsynced.empty())
+        {
+            queuedCondition.wait_until(lock, lastSync + syncInterval, ready);
+        }
+        else
+        {
+            queuedCondition.wait(lock, ready);
+        }
+
+        batch.swap(queued);
+        const std::chrono::milliseconds interval = syncInterval;
+        const bool done = stopping && batch.empty();
+        lock.unlock();
+
+        std::stable_sort(batch.begin(), batch.end(), [](const auto &a, const auto &b)
+                         { return a.first < b.first; });
+
+        for (std::size_t first = 0; first < batch.size();)
+        {
+            std::size_t last = first;
+            iov.clear();
+            while (last < batch.size() && batch[last].first == batch[first].first)
+            {
+                iov.push_back(iovec{batch[last].second.data(), batch[last].second.size()});
+                ++last;
+            }
+
+            const int fd = openLog(batch[first].first);
+            if (fd < 0)
+            {
+                for (std::size_t i = first; i < last; ++i)
+                {
+                    std::cout << batch[i].second;
+                }
+                std::cout.flush();
+            }
+            else
+            {
+                for (std::size_t i = 0; i < iov.size(); i += IOV_MAX)
+                {
+                    writeAll(fd, iov.data() + i, static_cast<int>(std::min<std::size_t>(IOV_MAX, iov.size() - i)));
+                }
+                unsynced.push_back(fd);
+            }
+
+            first = last;
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (interval.count() > 0 && !unsynced.empty() && (now - lastSync >= interval || done))
+        {
+            std::sort(unsynced.begin(), unsynced.end());
+            unsynced.erase(std::unique(unsynced.begin(), unsynced.end()), unsynced.end());
+            for (int fd : unsynced)
+            {
+                ::fdatasync(fd);
+            }
+            unsynced.clear();
+            lastSync = now;
+        }
+        else if (interval.count() == 0)
+        {
+            unsynced.clear();
+        }
+
+        lock.lock();
+        for (auto &receipt : batch)
+        {
+            receipt.second.clear();
+            spare.push_back(std::move(receipt.second));
+        }
+        batch.clear();
+
+        if (done)
+        {
+            return;
+        }
+    }
+}
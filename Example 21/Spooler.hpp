@@ -0,0 +1,59 @@
+// Spooler.hpp: The header file for the ReceiptSpooler class, which
+// takes the writing of receipts off of the ATMs' hands. A session
+// that ended by writing its receipt to disk would keep the customer
+// (and, in a Fleet, one of the few worker threads) waiting on the
+// file system before the card came back out. Instead, a
+// ReceiptPrinter renders the receipt into a buffer in memory and
+// hands the buffer to the spooler, which returns at once. One
+// background thread takes whatever receipts have gathered, appends
+// them to each ATM's receipt log with one write per log, and hands
+// the buffers back to be reused. If asked to, it also syncs the logs
+// it has written every so often, so that a crash loses no more than
+// that interval's receipts.
+//
+// Every ATM in the process shares the one spooler returned by
+// shared. Its thread starts with the first receipt, and the spooler
+// writes out everything still queued when the process exits.
+
+#ifndef SPOOLER_HPP
+#define SPOOLER_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class ReceiptSpooler
+{
+    std::vector<std::pair<std::filesystem::path, std::string>> queued;
+    std::vector<std::string> spare;
+    std::unordered_map<std::string, int> logs;
+    std::chrono::milliseconds syncInterval{0};
+    bool stopping{false};
+    std::mutex mutex;
+    std::condition_variable queuedCondition;
+    std::thread writer;
+
+    ReceiptSpooler() = default;
+
+public:
+    ~ReceiptSpooler();
+    ReceiptSpooler(const ReceiptSpooler &) = delete;
+    ReceiptSpooler &operator=(const ReceiptSpooler &) = delete;
+
+    static ReceiptSpooler &shared();
+
+    void setSyncInterval(std::chrono::milliseconds);
+    void submit(const std::filesystem::path &, std::string &);
+
+private:
+    void write();
+    int openLog(const std::filesystem::path &);
+};
+
+#endif
@@ -0,0 +1,320 @@
+// TimerWheel.cpp: The source file of the TimerWheel that times every
+// ATM in the process, and of the ATM's Deadline.
+
+#include "TimerWheel.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+// A timer that expires further away than the top wheel reaches is
+// kept in the top wheel's farthest slot, and so expires early, after
+// about two days.
+
+const std::uint64_t TimerMaxTicks = (std::uint64_t{1} << (TimerSlotBits * TimerLevels)) - 1;
+
+TimerWheel::TimerWheel() : epoch(std::chrono::steady_clock::now())
+{
+    ticker = std::thread(&TimerWheel::tick, this);
+}
+
+TimerWheel::~TimerWheel()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    scheduledCondition.notify_one();
+    ticker.join();
+}
+
+TimerWheel &TimerWheel::shared()
+{
+    static TimerWheel wheel;
+    return wheel;
+}
+
+// The schedule method (re)schedules a Timer to expire after the given
+// time, rounded up to whole ticks. While no timers are scheduled the
+// wheel's thread does not keep the time, so the first timer to be
+// scheduled brings it up to date. A Timer that is rescheduled before
+// it expires is already counted, and is only moved.
+
+void TimerWheel::schedule(Timer &timer, std::chrono::milliseconds after)
+{
+    const std::uint64_t ticks = static_cast<std::uint64_t>((after + TimerTick - std::chrono::milliseconds(1)) / TimerTick);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    const bool rescheduled = timer.slot != nullptr;
+    if (rescheduled)
+    {
+        remove(timer);
+    }
+    if (count == 0)
+    {
+        now = static_cast<std::uint64_t>((std::chrono::steady_clock::now() - epoch) / TimerTick);
+    }
+
+    timer.expiry = now + std::min(std::max<std::uint64_t>(ticks, 1), TimerMaxTicks);
+    insert(timer);
+    if (!rescheduled && ++count == 1)
+    {
+        scheduledCondition.notify_one();
+    }
+}
+
+// Once cancel returns, the Timer will not expire until it is
+// scheduled again. Cancelling a Timer that is not scheduled (or has
+// already expired) does nothing.
+
+void TimerWheel::cancel(Timer &timer)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (timer.slot != nullptr)
+    {
+        remove(timer);
+        --count;
+    }
+}
+
+// The insert method puts a Timer in the lowest wheel that reaches its
+// expiry. A wheel's slot is picked by the expiry's bits for that
+// wheel, so a wheel turning to a slot finds there exactly the timers
+// that expire within its next turn.
+
+void TimerWheel::insert(Timer &timer)
+{
+    const std::uint64_t delta = timer.expiry - now;
+    std::size_t level = 0;
+    while (level + 1 < TimerLevels && (delta >> (TimerSlotBits * (level + 1))) != 0)
+    {
+        ++level;
+    }
+
+    Timer *&head = slots[level][(timer.expiry >> (TimerSlotBits * level)) & (TimerSlots - 1)];
+    timer.previous = nullptr;
+    timer.next = head;
+    if (head != nullptr)
+    {
+        head->previous = &timer;
+    }
+    head = &timer;
+    timer.slot = &head;
+}
+
+void TimerWheel::remove(Timer &timer)
+{
+    if (timer.previous != nullptr)
+    {
+        timer.previous->next = timer.next;
+    }
+    else
+    {
+        *timer.slot = timer.next;
+    }
+    if (timer.next != nullptr)
+    {
+        timer.next->previous = timer.previous;
+    }
+
+    timer.previous = nullptr;
+    timer.next = nullptr;
+    timer.slot = nullptr;
+}
+
+// The advance method turns the first wheel one slot at a time up to
+// the given tick. Each time a wheel completes a turn, the wheel above
+// it turns a slot, and the timers there move down to the wheels that
+// now reach them. The timers in the first wheel's slot then expire.
+// Once no timers are left, the wheel jumps straight to the tick.
+
+void TimerWheel::advance(std::uint64_t target)
+{
+    while (now < target)
+    {
+        if (count == 0)
+        {
+            now = target;
+            return;
+        }
+
+        ++now;
+        for (std::size_t level = 1; level < TimerLevels; ++level)
+        {
+            if (((now >> (TimerSlotBits * (level - 1))) & (TimerSlots - 1)) != 0)
+            {
+                break;
+            }
+
+            Timer *timer = slots[level][(now >> (TimerSlotBits * level)) & (TimerSlots - 1)];
+            while (timer != nullptr)
+            {
+                Timer *next = timer->next;
+                remove(*timer);
+                insert(*timer);
+                timer = next;
+            }
+        }
+
+        Timer *&head = slots[0][now & (TimerSlots - 1)];
+        while (head != nullptr)
+        {
+            Timer *timer = head;
+            remove(*timer);
+            --count;
+            timer->expire();
+        }
+    }
+}
+
+// The tick method is the wheel's thread. It sleeps until a timer is
+// scheduled, and then wakes every tick for as long as any are.
+
+void TimerWheel::tick()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping)
+    {
+        if (count == 0)
+        {
+            scheduledCondition.wait(lock);
+            continue;
+        }
+
+        scheduledCondition.wait_until(lock, epoch + TimerTick * static_cast<std::chrono::milliseconds::rep>(now + 1));
+        advance(static_cast<std::uint64_t>((std::chrono::steady_clock::now() - epoch) / TimerTick));
+    }
+}
+
+// The pipe is non-blocking at both ends: expire must never block on
+// the wheel's thread, and one unread byte is as good as many.
+
+Deadline::Deadline()
+{
+    int fds[2];
+    if (::pipe(fds) != 0)
+    {
+        throw std::system_error(errno, std::generic_category(), "Cannot make a deadline's pipe");
+    }
+
+    wakeRead = fds[0];
+    wakeWrite = fds[1];
+    for (const int fd : fds)
+    {
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+}
+
+Deadline::~Deadline()
+{
+    disarm();
+    ::close(wakeRead);
+    ::close(wakeWrite);
+}
+
+// The arm method gives the next waits the given time to finish in;
+// zero means they may take as long as they like. Only an expiry
+// writes to the pipe, so the pipe needs emptying only after one.
+
+void Deadline::arm(std::chrono::milliseconds after)
+{
+    disarm();
+    if (expired.exchange(false))
+    {
+        char drain[64];
+        while (::read(wakeRead, drain, sizeof(drain)) > 0)
+        {
+        }
+    }
+
+    if (after.count() > 0)
+    {
+        everArmed = true;
+        TimerWheel::shared().schedule(*this, after);
+    }
+}
+
+// Disarming a Deadline that was never armed must not start the wheel
+// (and its thread) for nothing.
+
+void Deadline::disarm()
+{
+    if (everArmed)
+    {
+        TimerWheel::shared().cancel(*this);
+    }
+}
+
+void Deadline::reset()
+{
+    cancelled.store(false);
+    arm(std::chrono::milliseconds(0));
+}
+
+void Deadline::cancel()
+{
+    cancelled.store(true);
+    expire();
+}
+
+bool Deadline::hasExpired() const
+{
+    return expired.load() || cancelled.load();
+}
+
+int Deadline::getDescriptor() const
+{
+    return wakeRead;
+}
+
+// The wait method waits for the descriptor to become readable (or to
+// be closed) and returns true, or returns false once the Deadline
+// has expired, even if the descriptor is readable too.
+
+bool Deadline::wait(int fd)
+{
+    while (!hasExpired())
+    {
+        pollfd ready[2] = {{fd, POLLIN, 0}, {wakeRead, POLLIN, 0}};
+        if (::poll(ready, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+
+        if (ready[1].revents != 0)
+        {
+            // Whoever wrote this may have been an earlier expiry that
+            // arm has since forgotten; the flags have the last word.
+            char drain[64];
+            while (::read(wakeRead, drain, sizeof(drain)) > 0)
+            {
+            }
+            continue;
+        }
+        if (ready[0].revents != 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void Deadline::expire()
+{
+    expired.store(true);
+    const char wake = 1;
+    if (::write(wakeWrite, &wake, 1) < 0)
+    {
+        // The pipe is full, so a wait will wake anyway.
+    }
+}
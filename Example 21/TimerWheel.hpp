@@ -0,0 +1,122 @@
+// TimerWheel.hpp: The header file for the ATM side's timeouts. The
+// original ATM waited as long as it took: for the customer to type
+// the next key, and for the Bank to answer. In a Fleet, a customer
+// who walks away in the middle of a session, or a reply that never
+// comes, would tie up one of the few worker threads for good. Now
+// every ATM has a Deadline, which it arms before it waits for the
+// customer or the Bank. A wait that outlasts the deadline gives up as
+// if the input had ended, and the ATM ends the session.
+//
+// Every Deadline in the process is timed by the one TimerWheel
+// returned by TimerWheel::shared. It is a hierarchical timing wheel:
+// TimerLevels wheels of TimerSlots slots each, the first of which
+// turns one slot every TimerTick, and each of the others one slot
+// for every full turn of the wheel below it. A Timer goes in the
+// slot of the wheel whose span covers its expiry, and moves down a
+// wheel whenever the wheel above turns to its slot. Scheduling and
+// cancelling a timer therefore take constant time however many ATMs
+// there are, and the wheel's thread does work only for the slots that
+// hold timers. With no timers scheduled, the thread sleeps.
+
+#ifndef TIMERWHEEL_HPP
+#define TIMERWHEEL_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+const std::chrono::milliseconds TimerTick{10};
+const unsigned int TimerSlotBits = 6;
+const std::size_t TimerSlots = std::size_t{1} << TimerSlotBits;
+const std::size_t TimerLevels = 4;
+
+// A Timer is a node of the wheel's slot lists. The wheel calls its
+// expire method on the wheel's thread with the wheel locked, so that
+// once cancel returns, expire is not running and will not run;
+// expire must therefore be brief, and must not use the wheel.
+
+class Timer
+{
+    friend class TimerWheel;
+
+    Timer *previous{nullptr};
+    Timer *next{nullptr};
+    Timer **slot{nullptr};
+    std::uint64_t expiry{0};
+
+public:
+    virtual ~Timer() = default;
+
+    virtual void expire() = 0;
+};
+
+class TimerWheel
+{
+    Timer *slots[TimerLevels][TimerSlots]{};
+    std::uint64_t now{0};
+    std::size_t count{0};
+    std::chrono::steady_clock::time_point epoch;
+    bool stopping{false};
+    std::mutex mutex;
+    std::condition_variable scheduledCondition;
+    std::thread ticker;
+
+    TimerWheel();
+
+public:
+    ~TimerWheel();
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    static TimerWheel &shared();
+
+    void schedule(Timer &, std::chrono::milliseconds);
+    void cancel(Timer &);
+
+private:
+    void insert(Timer &);
+    void remove(Timer &);
+    void advance(std::uint64_t);
+    void tick();
+};
+
+// A Deadline is the Timer of one ATM. A wait on a descriptor polls
+// the descriptor and the Deadline's own pipe together, and the
+// Deadline writes to its pipe when it expires, so an expiry wakes
+// whichever wait is in progress. A Deadline that is not armed never
+// expires. Arming it again forgets an earlier expiry, but not a
+// cancel: once cancelled (from any thread), the Deadline stays
+// expired until it is reset. A caller that waits for many things at
+// once may wait for the Deadline's descriptor among them; it becomes
+// readable when the Deadline expires.
+
+class Deadline : public Timer
+{
+    int wakeRead{-1};
+    int wakeWrite{-1};
+    std::atomic<bool> expired{false};
+    std::atomic<bool> cancelled{false};
+    bool everArmed{false};
+
+public:
+    Deadline();
+    ~Deadline() override;
+    Deadline(const Deadline &) = delete;
+    Deadline &operator=(const Deadline &) = delete;
+
+    void arm(std::chrono::milliseconds);
+    void disarm();
+    void reset();
+    void cancel();
+    bool hasExpired() const;
+    int getDescriptor() const;
+    bool wait(int);
+
+    void expire() override;
+};
+
+#endif
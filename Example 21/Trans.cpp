@@ -8,85 +8,446 @@
 // ATM_SIDE macros.
 
 #ifdef ATM_SIDE
-#include "atm.hpp"
+#include "Atm.hpp"
 #endif
 
 #ifdef BANK_SIDE
-#include "bank.hpp"
+#include "Bank.hpp"
 #endif
 
-#include "trans.hpp"
+#include "Trans.hpp"
+#include "Wire.hpp"
 
 #include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <ostream>
+#include <string_view>
 
-// The TimeStamp constructor uses the time and ctime standard C
-// library functions to create a simple string capturing date and
-// time.
+// The TimeStamp constructor reads the two clocks and does nothing
+// else. On Linux both readings are served by the vDSO without a
+// system call.
 
-TimeStamp::TimeStamp()
+template <typename Clock>
+static std::int64_t nanosNow()
 {
-    std::time_t result = std::time(nullptr);
-    dateTime = std::ctime(&result);
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
 }
 
-std::ostream &TimeStamp::operator<<(std::ostream &stream, const TimeStamp &timeStamp)
+TimeStamp::TimeStamp() : wallNanos(nanosNow<std::chrono::system_clock>()),
+                         monotonicNanos(nanosNow<std::chrono::steady_clock>())
 {
-    stream << timeStamp.dateTime;
+}
+
+std::int64_t TimeStamp::getWallNanos() const
+{
+    return wallNanos;
+}
+
+std::int64_t TimeStamp::getMonotonicNanos() const
+{
+    return monotonicNanos;
+}
+
+// The wall clock reading is printed in the same form as the ctime
+// library function produces, newline included. The reentrant flavor
+// of ctime writes into our own buffer rather than a static one, since
+// several ATMs may be printing receipts on different threads.
+
+std::ostream &operator<<(std::ostream &stream, const TimeStamp &timeStamp)
+{
+    const std::time_t seconds = static_cast<std::time_t>(timeStamp.wallNanos / 1000000000);
+    char buf[32];
+#ifdef _WIN32
+    ctime_s(buf, sizeof(buf), &seconds);
+#else
+    ctime_r(&seconds, buf);
+#endif
+    stream << buf;
     return stream;
 }
 
-Transaction::Transaction(const std::string &account, const std::string &p, double a) : sourceAccount(account),
-                                                                                       pin(p),
-                                                                                       amount(a)
+#ifdef ATM_SIDE
+
+// An account name is seven digits plus an S or C suffix. This
+// helper splits it into the packed form used by the binary packet
+// format.
+
+static void packAccount(std::string_view account, std::uint32_t &number, char &accountType)
+{
+    number = 0;
+    accountType = 0;
+
+    if (account.size() == 8 && packDigits(account.substr(0, 7), number))
+    {
+        accountType = account[7];
+    }
+}
+
+#endif
+
+Transaction::Transaction(std::string_view account, std::string_view p, Money a) : sourceAccount(account),
+                                                                                  pin(p),
+                                                                                  amount(a)
+{
+}
+
+std::string_view Transaction::getSourceAccount() const
 {
+    return sourceAccount.view();
 }
 
-std::string Transaction::getSourceAccount() const
+Money Transaction::getAmount() const
 {
-    return sourceAccount;
+    return amount;
 }
 
-void setAmount(double newAmount)
+void Transaction::setAmount(Money newAmount)
 {
     amount = newAmount;
 }
 
-std::ostream & Transaction::operator<<(std::ostream &stream, const Transaction &timeStamp)
+void Transaction::print(std::ostream &stream) const
 {
-    // TODO: %4.2lf
-    stream << timeStamp << "\tAccount: " << sourceAccount << "\tAmount: " << amount << std::endl;
+    stream << timeStamp << type() << "\tAccount: " << sourceAccount.view() << "\tAmount: " << amount << '\n';
+}
+
+std::ostream &operator<<(std::ostream &stream, const Transaction &transaction)
+{
+    transaction.print(stream);
+    return stream;
 }
 
 #ifdef ATM_SIDE
 
-bool Transaction::preprocess(const ATM& atm) const
+bool Transaction::preprocess(ATM &)
 {
     return true;
 }
 
-void Transaction::postprocess(const ATM&) const
+void Transaction::postprocess(ATM &)
 {
 }
 
-void Transaction::update(const std::string&, int ) const
+void Transaction::update(const std::string &)
 {
 }
 
-void Transaction::packetize() const
+std::string Transaction::packetize() const
 {
-    string buf;
+    std::string buf;
     buf += type();
-    buf += sourceAccount;
+    buf += sourceAccount.view();
     buf += " ";
-    buf += pin;
-    buf += amount; // TODO: %4.2lf
+    buf += pin.view();
+    buf += " ";
+    buf += amount.toString();
+
+    return buf;
+}
+
+// The binary form of the packet carries the same fields as the
+// string above. An account or PIN that does not fit the packed form
+// is left as zero, which the Bank will refuse.
+
+void Transaction::packetize(WireRequest &request) const
+{
+    request = WireRequest{};
+    request.type = wireType();
+    packAccount(sourceAccount.view(), request.account, request.accountType);
+
+    std::uint32_t packedPin;
+    if (pin.view().size() == 4 && packDigits(pin.view(), packedPin))
+    {
+        request.pin = static_cast<std::uint16_t>(packedPin);
+    }
+
+    request.amount = amount;
 }
+
 #endif
 
 // If this is the bank side of the application, include a
 // verifyAccount method, which checks if an account's name and
-// PIN match that of the Transaction.
+// PIN match that of the Transaction. The reply packets carry the
+// status and the (possibly updated) amount of the Transaction.
+
+#ifdef BANK_SIDE
+
+bool Transaction::verifyAccount(const Account &account) const
+{
+    return account.checkPin(pin.view());
+}
+
+std::string Transaction::packetize(int status) const
+{
+    char buf[8];
+    std::snprintf(buf, sizeof(buf), "%04d", status);
+
+    std::string reply{buf};
+    reply += " ";
+    reply += amount.toString();
+
+    return reply;
+}
+
+void Transaction::packetize(WireReply &reply, int status) const
+{
+    reply.status = static_cast<std::uint8_t>(status != 0);
+    reply.flags = WireHasAmount;
+    reply.amount = amount;
+}
+
+#endif
+
+Deposit::Deposit(std::string_view account, std::string_view p, Money a) : Transaction(account, p, a)
+{
+}
+
+std::string Deposit::type() const
+{
+    return "Depo";
+}
+
+std::uint8_t Deposit::wireType() const
+{
+    return WireDeposit;
+}
+
+#ifdef ATM_SIDE
+
+// A Deposit cannot go to the Bank until the ATM has the envelope.
+
+bool Deposit::preprocess(ATM &atm)
+{
+    return atm.retrieveEnvelope();
+}
+
+#endif
 
 #ifdef BANK_SIDE
 
+// Each Bank-side process method finds its account, checks the PIN,
+// does its work, and records any change of balance, all while
+// holding the account's lock.
+
+bool Deposit::process(AccountList &accounts)
+{
+    LockedAccount account{accounts.find(getSourceAccount())};
+    if (!account || !verifyAccount(*account) || !account->deposit(getAmount()))
+    {
+        return false;
+    }
+
+    accounts.record(*account);
+    return true;
+}
+
+#endif
+
+Withdraw::Withdraw(std::string_view account, std::string_view p, Money a) : Transaction(account, p, a)
+{
+}
+
+std::string Withdraw::type() const
+{
+    return "With";
+}
+
+std::uint8_t Withdraw::wireType() const
+{
+    return WireWithdraw;
+}
+
+#ifdef ATM_SIDE
+
+// A Withdraw is checked against the cash on hand before the Bank is
+// asked, and the cash is handed out only after the Bank agrees.
+
+bool Withdraw::preprocess(ATM &atm)
+{
+    return atm.enoughCash(getAmount());
+}
+
+void Withdraw::postprocess(ATM &atm)
+{
+    atm.dispenseCash(getAmount());
+}
+
 #endif
+
+#ifdef BANK_SIDE
+
+bool Withdraw::process(AccountList &accounts)
+{
+    LockedAccount account{accounts.find(getSourceAccount())};
+    if (!account || !verifyAccount(*account) || !account->withdraw(getAmount()))
+    {
+        return false;
+    }
+
+    accounts.record(*account);
+    return true;
+}
+
+#endif
+
+Balance::Balance(std::string_view account, std::string_view p) : Transaction(account, p, Money{})
+{
+}
+
+void Balance::print(std::ostream &stream) const
+{
+    Transaction::print(stream);
+    stream << "\tBalance: " << balance << '\n';
+}
+
+std::string Balance::type() const
+{
+    return "Bala";
+}
+
+std::uint8_t Balance::wireType() const
+{
+    return WireBalance;
+}
+
+#ifdef ATM_SIDE
+
+// The Bank sends the account's balance back as the additional
+// information of its reply.
+
+void Balance::update(const std::string &info)
+{
+    Money::parse(info, balance);
+}
+
+Money Balance::getBalance() const
+{
+    return balance;
+}
+
+#endif
+
+#ifdef BANK_SIDE
+
+// The balance goes back to the ATM as the amount of the reply.
+
+bool Balance::process(AccountList &accounts)
+{
+    LockedAccount account{accounts.find(getSourceAccount())};
+    if (!account || !verifyAccount(*account))
+    {
+        return false;
+    }
+
+    setAmount(account->getBalance());
+    return true;
+}
+
+#endif
+
+Transfer::Transfer(std::string_view account, std::string_view p, std::string_view target, Money a) : Transaction(account, p, a),
+                                                                                                   targetAccount(target)
+{
+}
+
+void Transfer::print(std::ostream &stream) const
+{
+    Transaction::print(stream);
+    stream << "\tTarget Account: " << targetAccount.view() << '\n';
+}
+
+std::string Transfer::type() const
+{
+    return "Tran";
+}
+
+std::uint8_t Transfer::wireType() const
+{
+    return WireTransfer;
+}
+
+#ifdef ATM_SIDE
+
+// The Transfer adds the target account to the end of the packet.
+
+std::string Transfer::packetize() const
+{
+    std::string buf{Transaction::packetize()};
+    buf += " ";
+    buf += targetAccount.view();
+
+    return buf;
+}
+
+void Transfer::packetize(WireRequest &request) const
+{
+    Transaction::packetize(request);
+    packAccount(targetAccount.view(), request.targetAccount, request.targetType);
+}
+
+#endif
+
+#ifdef BANK_SIDE
+
+// A Transfer locks both of its accounts before it touches either
+// (see AccountList::findPair for why that cannot deadlock), so no one
+// ever sees the money in both accounts or in neither. The deposit
+// cannot fail once the withdrawal has succeeded, since the amount is
+// known not to be negative by then.
+
+bool Transfer::process(AccountList &accounts)
+{
+    LockedAccount source;
+    LockedAccount target;
+    if (!accounts.findPair(getSourceAccount(), targetAccount.view(), source, target))
+    {
+        return false;
+    }
+
+    // The credit is checked first, so a Transfer that the target
+    // account cannot take leaves the source untouched.
+    if (!verifyAccount(*source) || !target->canDeposit(getAmount()) || !source->withdraw(getAmount()))
+    {
+        return false;
+    }
+
+    target->deposit(getAmount());
+    accounts.record(*source, &*target);
+    return true;
+}
+
+#endif
+
+bool TransactionList::full() const
+{
+    return count == MaxTransactionAtm;
+}
+
+// The Transaction being added must be the one most recently built
+// by create.
+
+void TransactionList::addTransaction(Transaction *transaction)
+{
+    transList[count++] = transaction;
+}
+
+void TransactionList::print(std::streambuf *buf) const
+{
+    std::ostream stream(buf);
+
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        stream << *transList[i];
+    }
+}
+
+// Every Transaction's destructor has nothing to do, so the storage
+// of the session's Transactions is simply reused by the next
+// session.
+
+void TransactionList::cleanup()
+{
+    count = 0;
+}
@@ -13,25 +13,72 @@
 // BANK_SIDE macros to differentiate them.
 
 class ATM;
-
-#include <ctime>
+class Account;
+class AccountList;
+struct WireRequest;
+struct WireReply;
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <new>
 #include <ostream>
 #include <string>
-#include <vector>
+#include <string_view>
+#include <utility>
+
+#include "consts.hpp"
+#include "Money.hpp"
 
 // A TimeStamp object encapsulates the date and time of a
-// transaction. The current implementation is that of a string
-// produced via the time and ctime library routines. The reader
-// should feel to come up with something more elaborate.
+// transaction. Every Transaction gets one, so making one has to be
+// cheap: it is two raw readings of the clock, in nanoseconds. The
+// wall clock reading is what a receipt shows, and it is turned into
+// text only when the TimeStamp is printed. The monotonic reading
+// never jumps when the system clock is set, so it is the one to
+// subtract when measuring how long something took.
 
 class TimeStamp
 {
-    std::string dateTime;
+    std::int64_t wallNanos;
+    std::int64_t monotonicNanos;
 
 public:
     TimeStamp();
 
-    static std::ostream &operator<<(std::ostream &, const TimeStamp &);
+    std::int64_t getWallNanos() const;
+    std::int64_t getMonotonicNanos() const;
+
+    friend std::ostream &operator<<(std::ostream &, const TimeStamp &);
+};
+
+// Account names and PINs are a handful of characters, so a
+// Transaction keeps them inline rather than in std::strings. Text
+// longer than the capacity is cut short; every valid account name
+// fits with room to spare, so a cut-short name is still invalid.
+
+const std::size_t TransactionFieldSize = 16;
+
+template <std::size_t N>
+class InlineString
+{
+    static_assert(N < 256, "the length must fit in a byte");
+
+    char text[N]{};
+    std::uint8_t length{0};
+
+public:
+    InlineString() = default;
+
+    InlineString(std::string_view s) : length(static_cast<std::uint8_t>(std::min(s.size(), N)))
+    {
+        std::copy_n(s.data(), length, text);
+    }
+
+    std::string_view view() const
+    {
+        return std::string_view(text, length);
+    }
 };
 
 // All transactions have a TimeStamp, one account name, its PIN
@@ -48,34 +95,41 @@ public:
 // implemnentation of the Transaction class. This format knowledge
 // does not imply that a network needs to ship the format as-is. It
 // implies only that they must use it to produce the final packets
-// they will ship.
+// they will ship. The same argument applies to the binary packet
+// format (see Wire.hpp), which every Transaction fills in through
+// an overload of packetize.
 
 class Transaction
 {
     TimeStamp timeStamp;
-    std::string sourceAccount;
-    std::string pin;
-    double amount;
+    InlineString<TransactionFieldSize> sourceAccount;
+    InlineString<TransactionFieldSize> pin;
+    Money amount;
 
 protected:
-    Transaction(const std::string &, const std::string &, double);
+    Transaction(std::string_view, std::string_view, Money);
 
-    std::string getSourceAccount() const;
-    void setAmount(double);
+    std::string_view getSourceAccount() const;
+    Money getAmount() const;
+    void setAmount(Money);
 
 public:
-    virtual void print();
-    virtual std::ostream &operator<<(std::ostream &, const Transaction &);
+    virtual ~Transaction() = default;
+
+    virtual std::string type() const = 0;
+    virtual std::uint8_t wireType() const = 0;
+    virtual void print(std::ostream &) const;
 
     // Only ATM classes use the proprocess, postprocess, and update
     // methods. The Transaction class for the Bank side of the
     // application never compiles them into the object code.
 
 #ifdef ATM_SIDE
-    virtual bool preprocess(const ATM &) const;
-    virtual bool postprocess(const ATM &) const;
-    virtual void update(const std::string &) const;
+    virtual bool preprocess(ATM &);
+    virtual void postprocess(ATM &);
+    virtual void update(const std::string &);
     virtual std::string packetize() const;
+    virtual void packetize(WireRequest &) const;
 #endif
 
     // The process and verify accoutn methods are used only by the
@@ -84,12 +138,15 @@ public:
     // into the object code.
 
 #ifdef BANK_SIDE
-    virtual bool process(const AccountList &) = 0;
-    bool verifyAccount(Iconst Account &);
-    virtual std::string packetize() const;
+    virtual bool process(AccountList &) = 0;
+    bool verifyAccount(const Account &) const;
+    virtual std::string packetize(int) const;
+    virtual void packetize(WireReply &, int) const;
 #endif
 };
 
+std::ostream &operator<<(std::ostream &, const Transaction &);
+
 // The following four classes are the derived classes of the
 // abstract Transaction class: Deposit, Withdraw, Balance, and
 // Transfer.
@@ -97,51 +154,53 @@ public:
 class Deposit : public Transaction
 {
 public:
-    Deposit(const std::string &, const std::string &, double);
-    void print() override;
-    std::string type() override;
+    Deposit(std::string_view, std::string_view, Money);
+    std::string type() const override;
+    std::uint8_t wireType() const override;
 
 #ifdef ATM_SIDE
-    bool preprocess(const ATM &) const override;
+    bool preprocess(ATM &) override;
 #endif
 
 #ifdef BANK_SIDE
-    bool process(const AccountList &) override;
+    bool process(AccountList &) override;
 #endif
 };
 
 class Withdraw : public Transaction
 {
 public:
-    Withdraw(const std::string &, const std::string &, double);
-    std::string type() override;
+    Withdraw(std::string_view, std::string_view, Money);
+    std::string type() const override;
+    std::uint8_t wireType() const override;
 
 #ifdef ATM_SIDE
-    bool preprocess(const ATM &) const override;
-    bool postprocess(const ATM &) const override;
+    bool preprocess(ATM &) override;
+    void postprocess(ATM &) override;
 #endif
 
 #ifdef BANK_SIDE
-    void print() override;
-    ;
+    bool process(AccountList &) override;
 #endif
 };
 
 class Balance : public Transaction
 {
-    double balance;
+    Money balance;
 
 public:
-    Balance(const std::string &, const std::string &);
-    void print() override;
-    std::string type() override;
+    Balance(std::string_view, std::string_view);
+    void print(std::ostream &) const override;
+    std::string type() const override;
+    std::uint8_t wireType() const override;
 
 #ifdef ATM_SIDE
-    void update(const std::string &) const override;
+    void update(const std::string &) override;
+    Money getBalance() const;
 #endif
 
 #ifdef BANK_SIDE
-    bool process(const AccountList &) override;
+    bool process(AccountList &) override;
 #endif
 };
 
@@ -151,32 +210,70 @@ public:
 
 class Transfer : public Transaction
 {
-    std::string targetAccount;
+    InlineString<TransactionFieldSize> targetAccount;
 
 public:
-    Transfer(const std::string &, const std::string &, const std::string &, const std::string &);
+    Transfer(std::string_view, std::string_view, std::string_view, Money);
 
-    void print() override;
-    std::string type() override;
+    void print(std::ostream &) const override;
+    std::string type() const override;
+    std::uint8_t wireType() const override;
 
 #ifdef ATM_SIDE
     std::string packetize() const override;
+    void packetize(WireRequest &) const override;
 #endif
 
 #ifdef BANK_SIDE
-    bool process(const AccountList &) override;
+    bool process(AccountList &) override;
 #endif
 };
 
+// The TransactionList keeps the Transactions of one customer
+// session so that they can be printed on the receipt. It is also the
+// session's arena. The create method builds a Transaction straight
+// into the list's next free slot (or returns NULL if the session has
+// used them all), and addTransaction keeps it there. A Transaction
+// that is never added is simply built over by the next one. A slot
+// is big enough for any of the four kinds of Transaction, so nothing
+// is ever sliced, and no Transaction owns memory outside its slot,
+// so cleanup forgets them all at once instead of destroying them one
+// by one.
+
 class TransactionList
 {
-    std::vector<Transaction> transList;
+    static constexpr std::size_t SlotSize = std::max({sizeof(Deposit), sizeof(Withdraw), sizeof(Balance), sizeof(Transfer)});
+    static constexpr std::size_t SlotAlign = std::max({alignof(Deposit), alignof(Withdraw), alignof(Balance), alignof(Transfer)});
+
+    struct alignas(SlotAlign) Slot
+    {
+        unsigned char bytes[SlotSize];
+    };
+
+    Slot slots[MaxTransactionAtm];
+    Transaction *transList[MaxTransactionAtm];
+    unsigned int count{0};
 
 public:
-    TransactionList(unsigned int);
+    TransactionList() = default;
+    TransactionList(const TransactionList &) = delete;
+    TransactionList &operator=(const TransactionList &) = delete;
+
+    bool full() const;
+
+    template <typename T, typename... Args>
+    T *create(Args &&...args)
+    {
+        if (full())
+        {
+            return NULL;
+        }
+
+        return new (slots[count].bytes) T(std::forward<Args>(args)...);
+    }
 
-    void addTransaction(const Transaction &);
-    void print(const std::streambuf *) const;
+    void addTransaction(Transaction *);
+    void print(std::streambuf *) const;
     void cleanup();
 };
 
@@ -0,0 +1,174 @@
+// TransferBench.cpp: A stress test and benchmark for Transfers on the
+// Bank side of the application. It opens a number of accounts with
+// the same balance, then has several threads run random Transfers
+// between them through Transfer::process, exactly as the Bank would
+// for its ATMs. While they run, an auditor thread keeps adding up
+// all of the balances. Every total it sees, and the total at the end,
+// must be what the Bank started with; money that shows up in two
+// accounts or in none means a Transfer was not atomic. The run is
+// repeated with 1, 2, 4, ... threads up to the requested number, and
+// each run with N threads must manage at least Scaling times N times
+// the one-thread throughput, or Transfers are not scaling. A run with
+// more threads than the machine has processors cannot be expected to
+// scale, and is not checked.
+//
+// Usage: transferbench [Threads [Transfers [Accounts [Scaling]]]]
+//
+// Transfers is the total for each run, shared among its threads.
+// Scaling is a fraction (0.5 by default; 0 turns the check off). The
+// program prints one line of results per run and exits with a
+// nonzero status if money was ever created or destroyed, or if a run
+// did not scale.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Bank.hpp"
+#include "Trans.hpp"
+
+const Money OpeningBalance = Money::fromDollars(1000);
+const double DefaultScaling = 0.5;
+
+static std::string accountName(unsigned int index)
+{
+    char buf[16];
+    std::snprintf(buf, sizeof(buf), "%07u%c", index / 2, index % 2 == 0 ? 'S' : 'C');
+    return buf;
+}
+
+// Each worker moves random amounts (up to $20) between random pairs
+// of accounts. Refusals for lack of funds are expected and counted.
+
+static void transferWorker(AccountList &accounts, const std::vector<std::string> &names, unsigned long transfers,
+                           unsigned int seed, std::atomic<unsigned long> &refused)
+{
+    std::mt19937 random(seed);
+    std::uniform_int_distribution<std::size_t> pick(0, names.size() - 1);
+    std::uniform_int_distribution<std::int64_t> cents(1, 2000);
+    unsigned long localRefused = 0;
+
+    for (unsigned long i = 0; i < transfers; ++i)
+    {
+        Transfer transfer(names[pick(random)], "1234", names[pick(random)], Money::fromCents(cents(random)));
+        if (!transfer.process(accounts))
+        {
+            ++localRefused;
+        }
+    }
+
+    refused += localRefused;
+}
+
+int main(int argc, char **argv)
+{
+    const unsigned int hardware = std::max(1u, std::thread::hardware_concurrency());
+    const unsigned int maxThreads = argc > 1 ? static_cast<unsigned int>(std::atoi(argv[1])) : hardware;
+    const unsigned long transfers = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4000000;
+    const unsigned int accountCount = argc > 3 ? static_cast<unsigned int>(std::atoi(argv[3])) : 10000;
+    const double scaling = argc > 4 ? std::atof(argv[4]) : DefaultScaling;
+
+    if (argc > 5 || maxThreads == 0 || transfers == 0 || accountCount < 2 || scaling < 0 || scaling > 1)
+    {
+        std::cout << "Usage: " << argv[0] << " [Threads [Transfers [Accounts [Scaling]]]]" << std::endl;
+        return 1;
+    }
+
+    bool conserved = true;
+    bool scaled = true;
+    double singleRate = 0;
+
+    for (unsigned int threads = 1;; threads = std::min(threads * 2, maxThreads))
+    {
+        AccountList accounts(accountCount);
+        std::vector<std::string> names;
+        names.reserve(accountCount);
+        for (unsigned int i = 0; i < accountCount; ++i)
+        {
+            names.push_back(accountName(i));
+            accounts.addAccount(names.back(), "1234", OpeningBalance);
+        }
+
+        const Money expected = Money::fromCents(OpeningBalance.getCents() * accountCount);
+        std::atomic<unsigned long> refused{0};
+        std::atomic<bool> running{true};
+        std::atomic<unsigned long> audits{0};
+        std::atomic<bool> auditFailed{false};
+
+        std::thread auditor([&]
+                            {
+                                while (running)
+                                {
+                                    Money total;
+                                    if (!accounts.total(total) || total != expected)
+                                    {
+                                        auditFailed = true;
+                                    }
+                                    ++audits;
+                                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                                } });
+
+        const auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> workers;
+        for (unsigned int t = 0; t < threads; ++t)
+        {
+            const unsigned long share = transfers / threads + (t < transfers % threads ? 1 : 0);
+            workers.emplace_back(transferWorker, std::ref(accounts), std::cref(names), share, t + 1, std::ref(refused));
+        }
+        for (std::thread &worker : workers)
+        {
+            worker.join();
+        }
+
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        running = false;
+        auditor.join();
+
+        Money total;
+        const bool ok = accounts.total(total) && total == expected && !auditFailed;
+        conserved = conserved && ok;
+
+        const double rate = transfers / elapsed.count();
+        const char *scales = "-";
+        if (threads == 1)
+        {
+            singleRate = rate;
+        }
+        else if (scaling > 0 && threads <= hardware)
+        {
+            const bool fast = rate >= scaling * threads * singleRate;
+            scaled = scaled && fast;
+            scales = fast ? "yes" : "NO";
+        }
+        else if (scaling > 0)
+        {
+            scales = "skipped";
+        }
+
+        std::cout << "threads=" << threads
+                  << " transfers=" << transfers
+                  << " refused=" << refused
+                  << " seconds=" << elapsed.count()
+                  << " transfers_per_second=" << static_cast<unsigned long>(rate)
+                  << " audits=" << audits
+                  << " total=" << total
+                  << " conserved=" << (ok ? "yes" : "NO")
+                  << " scaled=" << scales << std::endl;
+
+        if (threads == maxThreads)
+        {
+            break;
+        }
+    }
+
+    return conserved && scaled ? 0 : 1;
+}
@@ -0,0 +1,529 @@
+// Transport.cpp: The implementation of the socket-based transports.
+// These are the only pieces of the application that make socket
+// system calls; the Network class above them sees nothing but
+// whole frames.
+
+#include "TimerWheel.hpp"
+#include "Transport.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Build the exception thrown when a socket call fails during
+// connection setup.
+
+static std::system_error socketError(const std::string &what)
+{
+    return std::system_error(errno, std::generic_category(), what);
+}
+
+// Reads and writes on a stream socket may move fewer bytes than were
+// asked for, so these two helpers loop until the whole buffer has
+// been transferred. They return false on end-of-file or error.
+
+static bool readFully(int fd, char *buf, std::size_t length)
+{
+    while (length > 0)
+    {
+        const ssize_t n = ::recv(fd, buf, length, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        buf += n;
+        length -= static_cast<std::size_t>(n);
+    }
+
+    return true;
+}
+
+static bool writeFully(int fd, iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = static_cast<std::size_t>(count);
+
+        ssize_t n = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return false;
+        }
+
+        // Skip over whatever was written, which may end in the middle
+        // of one of the buffers.
+        while (count > 0 && static_cast<std::size_t>(n) >= iov->iov_len)
+        {
+            n -= static_cast<ssize_t>(iov->iov_len);
+            ++iov;
+            --count;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+            iov->iov_len -= static_cast<std::size_t>(n);
+        }
+    }
+
+    return true;
+}
+
+SocketTransport::SocketTransport(int s) : fd(s)
+{
+}
+
+SocketTransport::~SocketTransport()
+{
+    ::close(fd);
+}
+
+// The sendFrame method writes the length prefix and the packet with
+// a single system call (in the common case), so that a small packet
+// goes out as one segment.
+
+static bool writeFrame(int fd, std::string_view frame)
+{
+    if (frame.size() > MaxFrameSize)
+    {
+        return false;
+    }
+
+    const std::uint32_t length = static_cast<std::uint32_t>(frame.size());
+    unsigned char header[4] = {
+        static_cast<unsigned char>(length >> 24),
+        static_cast<unsigned char>(length >> 16),
+        static_cast<unsigned char>(length >> 8),
+        static_cast<unsigned char>(length)};
+
+    iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = const_cast<char *>(frame.data());
+    iov[1].iov_len = frame.size();
+
+    return writeFully(fd, iov, 2);
+}
+
+bool SocketTransport::sendFrame(std::string_view frame)
+{
+    return writeFrame(fd, frame);
+}
+
+static std::uint32_t decodeLength(const unsigned char *header)
+{
+    return (std::uint32_t{header[0]} << 24) | (std::uint32_t{header[1]} << 16) |
+           (std::uint32_t{header[2]} << 8) | std::uint32_t{header[3]};
+}
+
+// The receiveFrame method blocks until a whole frame has arrived. It
+// returns false if the peer closed the connection or the length
+// prefix is not believable, or if the Deadline expires before the
+// frame starts to arrive.
+
+bool SocketTransport::receiveFrame(std::string &frame)
+{
+    if (deadline != nullptr && !deadline->wait(fd))
+    {
+        return false;
+    }
+
+    unsigned char header[4];
+    if (!readFully(fd, reinterpret_cast<char *>(header), sizeof(header)))
+    {
+        return false;
+    }
+
+    const std::uint32_t length = decodeLength(header);
+    if (length > MaxFrameSize)
+    {
+        return false;
+    }
+
+    frame.resize(length);
+    return length == 0 || readFully(fd, frame.data(), length);
+}
+
+void SocketTransport::setDeadline(Deadline *d)
+{
+    deadline = d;
+}
+
+int SocketTransport::getDescriptor() const
+{
+    return fd;
+}
+
+BufferedTransport::BufferedTransport(int s) : fd(s)
+{
+}
+
+BufferedTransport::~BufferedTransport()
+{
+    ::close(fd);
+}
+
+int BufferedTransport::getDescriptor() const
+{
+    return fd;
+}
+
+// The fill method reads until the socket has nothing more to give,
+// or until the buffer holds a few of the largest frames; whatever is
+// left stays in the socket until the next fill, so a peer that sends
+// faster than its frames are taken out cannot swell the buffer.
+// Frames already handed out are dropped from the front of the buffer
+// first. The method returns false once the peer has closed the
+// connection (or it has failed); frames that arrived before that may
+// still be waiting.
+
+const std::size_t FillChunk = 16 * 1024;
+const std::size_t FillLimit = 4 * MaxFrameSize;
+
+bool BufferedTransport::fill()
+{
+    input.erase(0, consumed);
+    consumed = 0;
+
+    while (input.size() < FillLimit)
+    {
+        const std::size_t used = input.size();
+        input.resize(used + FillChunk);
+
+        const ssize_t n = ::recv(fd, input.data() + used, FillChunk, MSG_DONTWAIT);
+        input.resize(used + static_cast<std::size_t>(n > 0 ? n : 0));
+
+        if (n > 0)
+        {
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+
+    return true;
+}
+
+// A frame whose length prefix is not believable also counts as ready,
+// so that the receiveFrame that rejects it is not put off forever.
+
+bool BufferedTransport::ready() const
+{
+    const std::size_t available = input.size() - consumed;
+    if (available < 4)
+    {
+        return false;
+    }
+
+    const std::uint32_t length = decodeLength(reinterpret_cast<const unsigned char *>(input.data() + consumed));
+    return length > MaxFrameSize || available - 4 >= length;
+}
+
+// Shutting the socket down both ways also tells whoever watches it
+// for input that the connection is finished.
+
+bool BufferedTransport::sendFrame(std::string_view frame)
+{
+    std::lock_guard<std::mutex> lock(sendMutex);
+    if (failed)
+    {
+        return false;
+    }
+
+    if (!writeFrame(fd, frame))
+    {
+        failed = true;
+        ::shutdown(fd, SHUT_RDWR);
+        return false;
+    }
+
+    return true;
+}
+
+bool BufferedTransport::receiveFrame(std::string &frame)
+{
+    if (!ready())
+    {
+        return false;
+    }
+
+    const std::uint32_t length = decodeLength(reinterpret_cast<const unsigned char *>(input.data() + consumed));
+    if (length > MaxFrameSize)
+    {
+        return false;
+    }
+
+    frame.assign(input, consumed + 4, length);
+    consumed += 4 + length;
+    return true;
+}
+
+TransportListener::TransportListener(int s, const std::string &path) : fd(s), unixPath(path)
+{
+}
+
+TransportListener::~TransportListener()
+{
+    ::close(fd);
+    if (!unixPath.empty())
+    {
+        ::unlink(unixPath.c_str());
+    }
+}
+
+int TransportListener::getDescriptor() const
+{
+    return fd;
+}
+
+std::unique_ptr<Transport> TransportListener::accept()
+{
+    return std::make_unique<SocketTransport>(acceptSocket(true));
+}
+
+// A server's replies are written by threads that serve every ATM, so
+// an ATM that stops reading its replies may hold one of them up for
+// this long at most.
+
+const int SendTimeoutSeconds = 5;
+
+std::unique_ptr<BufferedTransport> TransportListener::acceptReady()
+{
+    const int s = acceptSocket(false);
+    if (s < 0)
+    {
+        return NULL;
+    }
+
+    const timeval timeout{SendTimeoutSeconds, 0};
+    ::setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    return std::make_unique<BufferedTransport>(s);
+}
+
+// The listening socket is made non-blocking the first time a server
+// asks not to wait, since an ATM may give up between the server
+// seeing it and accepting it. A caller that is willing to wait is
+// then made to wait in poll instead. Accepted sockets do not inherit
+// the mode, and stay blocking.
+
+int TransportListener::acceptSocket(bool wait)
+{
+    if (!wait)
+    {
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    int s;
+    while ((s = ::accept(fd, nullptr, nullptr)) < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            if (!wait)
+            {
+                return -1;
+            }
+
+            pollfd pfd{fd, POLLIN, 0};
+            ::poll(&pfd, 1, -1);
+        }
+        else if (errno != EINTR && errno != ECONNABORTED)
+        {
+            throw socketError("accept");
+        }
+    }
+
+    // Harmless (and ignored) on Unix-domain sockets.
+    const int one = 1;
+    ::setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return s;
+}
+
+// An address is split into its scheme ("tcp" or "unix") and the
+// rest. For TCP, the rest is split again at the last colon into a
+// host and a port.
+
+static void splitAddress(const std::string &address, std::string &scheme, std::string &rest)
+{
+    const std::string::size_type colon = address.find(':');
+    if (colon == std::string::npos)
+    {
+        throw std::invalid_argument("bad transport address: " + address);
+    }
+
+    scheme = address.substr(0, colon);
+    rest = address.substr(colon + 1);
+
+    if (scheme != "tcp" && scheme != "unix")
+    {
+        throw std::invalid_argument("unknown transport: " + scheme);
+    }
+}
+
+static addrinfo *resolveTcp(const std::string &rest, bool passive)
+{
+    const std::string::size_type colon = rest.rfind(':');
+    if (colon == std::string::npos)
+    {
+        throw std::invalid_argument("TCP address needs host:port: " + rest);
+    }
+
+    const std::string host{rest.substr(0, colon)};
+    const std::string port{rest.substr(colon + 1)};
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+    addrinfo *result;
+    const int rc = ::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result);
+    if (rc != 0)
+    {
+        throw std::invalid_argument("cannot resolve " + rest + ": " + ::gai_strerror(rc));
+    }
+
+    return result;
+}
+
+static sockaddr_un unixAddress(const std::string &path)
+{
+    sockaddr_un sun{};
+    sun.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(sun.sun_path))
+    {
+        throw std::invalid_argument("Unix socket path too long: " + path);
+    }
+    std::memcpy(sun.sun_path, path.c_str(), path.size() + 1);
+
+    return sun;
+}
+
+std::unique_ptr<Transport> connectTransport(const std::string &address)
+{
+    std::string scheme, rest;
+    splitAddress(address, scheme, rest);
+
+    if (scheme == "unix")
+    {
+        const sockaddr_un sun{unixAddress(rest)};
+        const int s = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (s < 0)
+        {
+            throw socketError("socket");
+        }
+        if (::connect(s, reinterpret_cast<const sockaddr *>(&sun), sizeof(sun)) < 0)
+        {
+            const std::system_error error{socketError("connect " + rest)};
+            ::close(s);
+            throw error;
+        }
+        return std::make_unique<SocketTransport>(s);
+    }
+
+    addrinfo *result = resolveTcp(rest, false);
+    int s = -1;
+    int lastErrno = 0;
+
+    for (addrinfo *ai = result; ai != nullptr; ai = ai->ai_next)
+    {
+        s = ::socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (s >= 0 && ::connect(s, ai->ai_addr, ai->ai_addrlen) == 0)
+        {
+            break;
+        }
+        lastErrno = errno;
+        if (s >= 0)
+        {
+            ::close(s);
+            s = -1;
+        }
+    }
+    ::freeaddrinfo(result);
+
+    if (s < 0)
+    {
+        throw std::system_error(lastErrno, std::generic_category(), "connect " + rest);
+    }
+
+    // The packets are tiny and every one is waited for, so Nagle's
+    // algorithm would only add latency.
+    const int one = 1;
+    ::setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return std::make_unique<SocketTransport>(s);
+}
+
+std::unique_ptr<TransportListener> listenTransport(const std::string &address)
+{
+    std::string scheme, rest;
+    splitAddress(address, scheme, rest);
+
+    if (scheme == "unix")
+    {
+        const sockaddr_un sun{unixAddress(rest)};
+        const int s = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (s < 0)
+        {
+            throw socketError("socket");
+        }
+
+        // A socket file left behind by an earlier Bank is removed.
+        ::unlink(rest.c_str());
+        if (::bind(s, reinterpret_cast<const sockaddr *>(&sun), sizeof(sun)) < 0 || ::listen(s, SOMAXCONN) < 0)
+        {
+            const std::system_error error{socketError("listen " + rest)};
+            ::close(s);
+            throw error;
+        }
+        return std::make_unique<TransportListener>(s, rest);
+    }
+
+    addrinfo *result = resolveTcp(rest, true);
+    const int s = ::socket(result->ai_family, result->ai_socktype | SOCK_CLOEXEC, result->ai_protocol);
+    if (s < 0)
+    {
+        ::freeaddrinfo(result);
+        throw socketError("socket");
+    }
+
+    const int one = 1;
+    ::setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (::bind(s, result->ai_addr, result->ai_addrlen) < 0 || ::listen(s, SOMAXCONN) < 0)
+    {
+        const std::system_error error{socketError("listen " + rest)};
+        ::freeaddrinfo(result);
+        ::close(s);
+        throw error;
+    }
+    ::freeaddrinfo(result);
+
+    return std::make_unique<TransportListener>(s, std::string{});
+}
@@ -0,0 +1,142 @@
+// Transport.hpp: The header file for the byte-transfer mechanisms
+// that can be plugged in behind the Network class. The Network class
+// knows how to turn Transactions into packets and back again; a
+// Transport knows only how to move one packet (a "frame") from one
+// process to another. Keeping the two apart means the ATM and Bank
+// applications do not care whether their packets travel over TCP, a
+// Unix-domain socket, or something the reader invents later.
+
+#ifndef TRANSPORT_HPP
+#define TRANSPORT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+// Every frame is preceded by its length as a four-byte, big-endian
+// unsigned integer. Frames larger than the limit below are treated
+// as a corrupted stream rather than an invitation to allocate
+// gigabytes.
+
+const std::uint32_t MaxFrameSize = 64 * 1024;
+
+// Forward references
+class Deadline;
+
+// A Transport may be given a Deadline (see TimerWheel.hpp) to limit
+// how long receiveFrame waits for a frame to start arriving. Once a
+// frame has started, it is read to the end, so a receive that gives
+// up never leaves half a frame behind. Transports that never block
+// have no use for one. A Transport over a descriptor also says which,
+// so that a caller may wait for a frame alongside other things (see
+// SessionLoop.hpp); -1 means there is nothing to wait on.
+
+class Transport
+{
+public:
+    virtual ~Transport() = default;
+
+    virtual bool sendFrame(std::string_view) = 0;
+    virtual bool receiveFrame(std::string &) = 0;
+    virtual void setDeadline(Deadline *)
+    {
+    }
+    virtual int getDescriptor() const
+    {
+        return -1;
+    }
+};
+
+// The SocketTransport moves frames over a connected stream socket.
+// It works for both TCP and Unix-domain sockets, since the framing
+// is the same for either. The transport owns (and closes) its
+// socket.
+
+class SocketTransport : public Transport
+{
+    int fd;
+    Deadline *deadline{nullptr};
+
+public:
+    explicit SocketTransport(int);
+    ~SocketTransport() override;
+    SocketTransport(const SocketTransport &) = delete;
+    SocketTransport &operator=(const SocketTransport &) = delete;
+
+    bool sendFrame(std::string_view) override;
+    bool receiveFrame(std::string &) override;
+    void setDeadline(Deadline *) override;
+    int getDescriptor() const override;
+};
+
+// The BufferedTransport is the SocketTransport's counterpart for a
+// server that watches many connections from one thread. Its fill
+// method reads whatever has arrived without waiting, and ready tells
+// whether a whole frame is now buffered; receiveFrame never blocks,
+// and fails if no whole frame is there. The socket itself stays in
+// blocking mode, so sendFrame still writes the whole frame, but only
+// for as long as the send timeout the listener gave the socket. A
+// send that fails or times out shuts the connection down, since part
+// of a frame may have gone out, and every later send fails at once.
+// Sends are serialized by a lock of their own, so any number of
+// threads may reply on the connection while one thread receives from
+// it.
+
+class BufferedTransport : public Transport
+{
+    int fd;
+    std::string input;
+    std::size_t consumed{0};
+    std::mutex sendMutex;
+    bool failed{false};
+
+public:
+    explicit BufferedTransport(int);
+    ~BufferedTransport() override;
+    BufferedTransport(const BufferedTransport &) = delete;
+    BufferedTransport &operator=(const BufferedTransport &) = delete;
+
+    int getDescriptor() const override;
+    bool fill();
+    bool ready() const;
+    bool sendFrame(std::string_view) override;
+    bool receiveFrame(std::string &) override;
+};
+
+// The TransportListener is the Bank side's half of connection
+// setup. It waits on a listening socket and hands back a Transport
+// for each ATM that connects. A server that waits on the listening
+// socket itself (with epoll, say) uses acceptReady instead, which
+// returns NULL rather than waiting when no ATM is left to accept.
+
+class TransportListener
+{
+    int fd;
+    std::string unixPath;
+
+public:
+    TransportListener(int, const std::string &);
+    ~TransportListener();
+    TransportListener(const TransportListener &) = delete;
+    TransportListener &operator=(const TransportListener &) = delete;
+
+    int getDescriptor() const;
+    std::unique_ptr<Transport> accept();
+    std::unique_ptr<BufferedTransport> acceptReady();
+
+private:
+    int acceptSocket(bool);
+};
+
+// Addresses are given as "tcp:host:port" or "unix:path". Both
+// functions throw std::system_error if the address cannot be
+// connected to (or listened on), and std::invalid_argument if the
+// address is not in one of the two forms above.
+
+std::unique_ptr<Transport> connectTransport(const std::string &);
+std::unique_ptr<TransportListener> listenTransport(const std::string &);
+
+#endif
@@ -0,0 +1,220 @@
+// Wire.cpp: The implementation of the binary packet format. This
+// code is compiled into both sides of the application, since the ATM
+// encodes requests and decodes replies while the Bank does the
+// reverse.
+
+#include "Wire.hpp"
+
+#include <cstring>
+
+// The fields are stored a byte at a time so that the layout does not
+// depend on the host's byte order or structure padding. Compilers
+// turn these into single loads and stores on little-endian machines.
+
+static void put16(unsigned char *p, std::uint16_t v)
+{
+    p[0] = static_cast<unsigned char>(v);
+    p[1] = static_cast<unsigned char>(v >> 8);
+}
+
+static void put32(unsigned char *p, std::uint32_t v)
+{
+    put16(p, static_cast<std::uint16_t>(v));
+    put16(p + 2, static_cast<std::uint16_t>(v >> 16));
+}
+
+static void put64(unsigned char *p, std::uint64_t v)
+{
+    put32(p, static_cast<std::uint32_t>(v));
+    put32(p + 4, static_cast<std::uint32_t>(v >> 32));
+}
+
+static std::uint16_t get16(const unsigned char *p)
+{
+    return static_cast<std::uint16_t>(p[0] | (p[1] << 8));
+}
+
+static std::uint32_t get32(const unsigned char *p)
+{
+    return get16(p) | (static_cast<std::uint32_t>(get16(p + 2)) << 16);
+}
+
+static std::uint64_t get64(const unsigned char *p)
+{
+    return get32(p) | (static_cast<std::uint64_t>(get32(p + 4)) << 32);
+}
+
+static bool isAccountType(char c)
+{
+    return c == 'S' || c == 'C';
+}
+
+void encodeRequest(const WireRequest &request, unsigned char *buf)
+{
+    buf[0] = WireVersion;
+    buf[1] = request.type;
+    buf[2] = static_cast<unsigned char>(request.accountType);
+    buf[3] = static_cast<unsigned char>(request.targetType);
+    put32(buf + 4, request.account);
+    put32(buf + 8, request.targetAccount);
+    put16(buf + 12, request.pin);
+    put16(buf + 14, 0);
+    put64(buf + 16, static_cast<std::uint64_t>(request.amount.getCents()));
+}
+
+bool decodeRequest(const unsigned char *buf, std::size_t length, WireRequest &request)
+{
+    if (length != WireRequestSize || buf[0] != WireVersion || get16(buf + 14) != 0)
+    {
+        return false;
+    }
+
+    request.type = buf[1];
+    request.accountType = static_cast<char>(buf[2]);
+    request.targetType = static_cast<char>(buf[3]);
+    request.account = get32(buf + 4);
+    request.targetAccount = get32(buf + 8);
+    request.pin = get16(buf + 12);
+    request.amount = Money::fromCents(static_cast<std::int64_t>(get64(buf + 16)));
+
+    if (request.type < WireWithdraw || request.type > WireTransfer)
+    {
+        return false;
+    }
+
+    if (request.account > 9999999 || !isAccountType(request.accountType) || request.pin > 9999)
+    {
+        return false;
+    }
+
+    // Only a Transfer has a target account, and it must have one.
+    if (request.type == WireTransfer)
+    {
+        return request.targetAccount <= 9999999 && isAccountType(request.targetType);
+    }
+
+    return request.targetAccount == 0 && request.targetType == 0;
+}
+
+void encodeReply(const WireReply &reply, unsigned char *buf)
+{
+    buf[0] = WireVersion;
+    buf[1] = reply.status;
+    buf[2] = reply.flags;
+    buf[3] = 0;
+    put64(buf + 4, static_cast<std::uint64_t>(reply.amount.getCents()));
+}
+
+bool decodeReply(const unsigned char *buf, std::size_t length, WireReply &reply)
+{
+    if (length != WireReplySize || buf[0] != WireVersion || buf[3] != 0 || (buf[2] & ~WireHasAmount) != 0)
+    {
+        return false;
+    }
+
+    reply.status = buf[1];
+    reply.flags = buf[2];
+    reply.amount = Money::fromCents(static_cast<std::int64_t>(get64(buf + 4)));
+
+    return true;
+}
+
+void encodeHello(WireFormat format, std::uint8_t options, unsigned char *buf)
+{
+    std::memcpy(buf, "HELO", 4);
+    buf[4] = static_cast<unsigned char>(format);
+    buf[5] = WireVersion;
+    buf[6] = options;
+}
+
+bool decodeHello(const unsigned char *buf, std::size_t length, WireFormat &format, std::uint8_t &version, std::uint8_t &options)
+{
+    if (length != WireHelloSize || std::memcmp(buf, "HELO", 4) != 0)
+    {
+        return false;
+    }
+
+    const char f = static_cast<char>(buf[4]);
+    if (f != static_cast<char>(WireFormat::Ascii) && f != static_cast<char>(WireFormat::Binary))
+    {
+        return false;
+    }
+
+    format = static_cast<WireFormat>(f);
+    version = buf[5];
+    options = buf[6];
+
+    return true;
+}
+
+void encodeTag(std::uint32_t tag, unsigned char *buf)
+{
+    put32(buf, tag);
+}
+
+std::uint32_t decodeTag(const unsigned char *buf)
+{
+    return get32(buf);
+}
+
+void appendRecord(std::string &frame, std::uint32_t tag, std::string_view packet)
+{
+    unsigned char header[WireRecordHeaderSize + WireTagSize];
+    put16(header, static_cast<std::uint16_t>(WireTagSize + packet.size()));
+    put32(header + WireRecordHeaderSize, tag);
+
+    frame.append(reinterpret_cast<const char *>(header), sizeof(header));
+    frame.append(packet);
+}
+
+bool nextRecord(std::string_view &frame, std::uint32_t &tag, std::string_view &packet)
+{
+    if (frame.size() < WireRecordHeaderSize + WireTagSize)
+    {
+        return false;
+    }
+
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(frame.data());
+    const std::size_t length = get16(p);
+    if (length < WireTagSize || frame.size() - WireRecordHeaderSize < length)
+    {
+        return false;
+    }
+
+    tag = get32(p + WireRecordHeaderSize);
+    packet = frame.substr(WireRecordHeaderSize + WireTagSize, length - WireTagSize);
+    frame.remove_prefix(WireRecordHeaderSize + length);
+    return true;
+}
+
+bool packDigits(std::string_view digits, std::uint32_t &value)
+{
+    if (digits.empty() || digits.size() > 9)
+    {
+        return false;
+    }
+
+    value = 0;
+    for (char c : digits)
+    {
+        if (c < '0' || c > '9')
+        {
+            return false;
+        }
+        value = value * 10 + static_cast<std::uint32_t>(c - '0');
+    }
+
+    return true;
+}
+
+// The unpackDigits method writes exactly width digits (with leading
+// zeros) and no terminator.
+
+void unpackDigits(std::uint32_t value, unsigned int width, char *out)
+{
+    while (width > 0)
+    {
+        out[--width] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    }
+}
@@ -0,0 +1,144 @@
+// Wire.hpp: The header file for the compact binary packet format.
+// The ASCII packets built by Transaction::packetize() are pleasant to
+// read while debugging, but every one of them has to be formatted on
+// one side of the network and tokenized again on the other. The
+// binary format below carries the same fields in a fixed layout so
+// that both directions are a handful of loads and stores. The two
+// sides agree on which format to use with a "hello" frame when they
+// connect (see Network::negotiate). They may also agree to tag every
+// frame with a correlation ID, so that several requests can be
+// outstanding at once and the replies can come back in any order. A
+// tag is four bytes (little-endian) in front of the packet, whichever
+// format the packet is in. A connection that tags its frames may also
+// agree to batch them: a batched frame carries any number of tagged
+// packets ("records"), each preceded by its length, so that a
+// Concentrator (see Concentrator.hpp) can ship the requests of many
+// ATMs, and the Bank the replies to them, a frame at a time.
+//
+// All multi-byte fields are little-endian, whatever the host's byte
+// order. The first byte of every request and reply is the format
+// version, so that the layout can grow later without confusing an
+// older peer.
+//
+// Request (WireRequestSize bytes):
+//   0      version
+//   1      type tag (WireWithdraw, ...)
+//   2      source account type ('S' or 'C')
+//   3      target account type ('S', 'C', or 0 if not a Transfer)
+//   4-7    source account number (seven digits)
+//   8-11   target account number (0 if not a Transfer)
+//   12-13  PIN (four digits)
+//   14-15  reserved, zero
+//   16-23  amount in cents (signed)
+//
+// Reply (WireReplySize bytes):
+//   0      version
+//   1      status (nonzero if the Bank accepted the transaction)
+//   2      flags (WireHasAmount if the amount field is meaningful)
+//   3      reserved, zero
+//   4-11   amount in cents (signed), e.g., the balance of an account
+//
+// Record (in a batched frame):
+//   0-1    length of the rest of the record
+//   2-5    tag
+//   6-     packet, in either format
+
+#ifndef WIRE_HPP
+#define WIRE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "Money.hpp"
+
+const std::uint8_t WireVersion = 1;
+const std::size_t WireRequestSize = 24;
+const std::size_t WireReplySize = 12;
+const std::size_t WireHelloSize = 7;
+const std::size_t WireTagSize = 4;
+const std::size_t WireRecordHeaderSize = 2;
+
+const std::uint8_t WireWithdraw = 1;
+const std::uint8_t WireDeposit = 2;
+const std::uint8_t WireBalance = 3;
+const std::uint8_t WireTransfer = 4;
+
+const std::uint8_t WireHasAmount = 0x01;
+
+// Hello frame options. Batching is agreed to only along with tags.
+const std::uint8_t WireTagged = 0x01;
+const std::uint8_t WireBatched = 0x02;
+
+// A Bank reads no further ahead on one connection than this many
+// unanswered requests. An ATM that keeps more outstanding, and does
+// not read its replies while it sends, may end up waiting on the Bank
+// while the Bank waits on it.
+const std::size_t WireMaxOutstanding = 256;
+
+// The two packet formats a connection may use. The ASCII format is
+// always understood, so it is what a Bank answers with if it does not
+// like the ATM's proposal.
+
+enum class WireFormat : char
+{
+    Ascii = 'A',
+    Binary = 'B'
+};
+
+struct WireRequest
+{
+    std::uint8_t type{0};
+    char accountType{0};
+    char targetType{0};
+    std::uint32_t account{0};
+    std::uint32_t targetAccount{0};
+    std::uint16_t pin{0};
+    Money amount;
+};
+
+struct WireReply
+{
+    std::uint8_t status{0};
+    std::uint8_t flags{0};
+    Money amount;
+};
+
+// Encoding writes exactly WireRequestSize (WireReplySize) bytes into
+// the caller's buffer. Decoding checks the version and every field's
+// range, and returns false if the bytes are not a valid packet.
+// Neither direction touches the heap.
+
+void encodeRequest(const WireRequest &, unsigned char *);
+bool decodeRequest(const unsigned char *, std::size_t, WireRequest &);
+void encodeReply(const WireReply &, unsigned char *);
+bool decodeReply(const unsigned char *, std::size_t, WireReply &);
+
+// The hello frame is the four characters "HELO", the proposed (or
+// accepted) format, the highest binary version the sender
+// understands, and the proposed (or accepted) options.
+
+void encodeHello(WireFormat, std::uint8_t, unsigned char *);
+bool decodeHello(const unsigned char *, std::size_t, WireFormat &, std::uint8_t &, std::uint8_t &);
+
+void encodeTag(std::uint32_t, unsigned char *);
+std::uint32_t decodeTag(const unsigned char *);
+
+// appendRecord adds a record with the given tag and packet to a
+// batched frame. nextRecord takes the first record off the front of
+// what is left of a frame, and returns false if there is none, or if
+// what is left is not a whole record.
+
+void appendRecord(std::string &, std::uint32_t, std::string_view);
+bool nextRecord(std::string_view &, std::uint32_t &, std::string_view &);
+
+// Account numbers and PINs are strings of decimal digits everywhere
+// else in the application. These two helpers convert between those
+// strings and the packed integers used on the wire. packDigits fails
+// on anything that is not all digits, or on more than nine of them.
+
+bool packDigits(std::string_view, std::uint32_t &);
+void unpackDigits(std::uint32_t, unsigned int, char *);
+
+#endif
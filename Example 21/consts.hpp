@@ -6,4 +6,7 @@
 const unsigned int MaxTransactionAtm = 20;
 const char EnterKey = '\n';
 
+// The key reported when there is no more input to be had.
+const char NoKey = '\0';
+
 #endif